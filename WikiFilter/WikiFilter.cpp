@@ -13,15 +13,41 @@
 #include <sstream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <chrono>
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <queue>
+#include <deque>
 #include <memory>
+#include <functional>
 #include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
+#include <cerrno>
+#include <cmath>
 #include <sys/sysinfo.h>  // 获取系统内存信息
+#include <sys/mman.h>     // 内存映射文本文件
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>  // 硬件计数器（--perf-counters）
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>    // 整理词典时检查空白字符
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22  // Linux 5.14 起支持，旧的 C 库头文件没有定义；旧内核上返回 EINVAL
+#endif
 
 using namespace std;
 
@@ -53,6 +79,27 @@ static size_t read_cgroup_value(const char* path) {
     return value;
 }
 
+// ============================================================================
+// 读取内存压力（PSI）：some/full 行的 avg10，即最近 10 秒内因内存等待的时间占比（%）
+// 优先读取 cgroup v2 的 memory.pressure，没有时读取整机的 /proc/pressure/memory
+// ============================================================================
+static bool read_memory_pressure(double& some_avg10, double& full_avg10) {
+    FILE* file = fopen("/sys/fs/cgroup/memory.pressure", "r");
+    if (!file) file = fopen("/proc/pressure/memory", "r");
+    if (!file) return false;
+    some_avg10 = 0.0;
+    full_avg10 = 0.0;
+    char kind[8];
+    double avg10 = 0.0;
+    int found = 0;
+    while (fscanf(file, "%7s avg10=%lf %*[^\n]", kind, &avg10) == 2) {
+        if (strcmp(kind, "some") == 0) { some_avg10 = avg10; found++; }
+        else if (strcmp(kind, "full") == 0) { full_avg10 = avg10; found++; }
+    }
+    fclose(file);
+    return found > 0;
+}
+
 // ============================================================================
 // 获取系统可用内存（单位：MB）
 // 兼容 Docker/cgroup 环境
@@ -120,28 +167,492 @@ static size_t get_process_memory_mb() {
     return 0;
 }
 
+// ============================================================================
+// 读取 "键 数值" 格式文件中某个键的值（/proc/meminfo、memory.stat），没有时返回 0
+// ============================================================================
+static size_t read_keyed_value(const char* path, const char* key) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    char line[256];
+    char name[64];
+    size_t value = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (sscanf(line, "%63s %zu", name, &value) == 2 && strcmp(name, key) == 0) {
+            fclose(file);
+            return value;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// ============================================================================
+// 进程的内存峰值（VmHWM，单位：MB）
+// ============================================================================
+static size_t get_peak_memory_mb() {
+    return read_keyed_value("/proc/self/status", "VmHWM:") / 1024;  // KB -> MB
+}
+
+// ============================================================================
+// 运行中的内存余量（单位：MB）
+// 与 get_available_memory_mb 不同，这里扣除可回收的页缓存：扫描时映射的文本页会计入 memory.current
+// 和 freeram，但内核可以随时回收。cgroup 取 memory.max - (memory.current - inactive_file)，
+// 整机取 MemAvailable，返回两者中较小的一个
+// ============================================================================
+static size_t get_memory_headroom_mb() {
+    size_t headroom_mb = read_keyed_value("/proc/meminfo", "MemAvailable:") / 1024;  // KB -> MB
+    if (headroom_mb == 0) headroom_mb = get_available_memory_mb();
+
+    size_t limit = read_cgroup_value("/sys/fs/cgroup/memory.max");
+    size_t usage = 0;
+    size_t inactive_file = 0;
+    if (limit != 0) {
+        usage = read_cgroup_value("/sys/fs/cgroup/memory.current");
+        inactive_file = read_keyed_value("/sys/fs/cgroup/memory.stat", "inactive_file");
+    } else {
+        limit = read_cgroup_value("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        usage = read_cgroup_value("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+        inactive_file = read_keyed_value("/sys/fs/cgroup/memory/memory.stat", "total_inactive_file");
+    }
+    if (limit != 0) {
+        size_t working_set = usage - min(usage, inactive_file);
+        size_t cgroup_headroom_mb = limit > working_set ? (limit - working_set) / (1024 * 1024) : 0;
+        headroom_mb = min(headroom_mb, cgroup_headroom_mb);
+    }
+    return headroom_mb;
+}
+
+// ============================================================================
+// 64 位 FNV-1a 哈希（词典校验和）
+// ============================================================================
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+static uint64_t hash_bytes(const char* data, size_t length, uint64_t hash = HASH_SEED) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 按 8 字节为单位的 FNV-1a，用于大文件的全文哈希；每一步对哈希值是双射，单个 8 字节块的改动必然改变结果
+static uint64_t hash_words(const char* data, size_t length, uint64_t hash = HASH_SEED) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ULL;
+    }
+    return hash_bytes(data + i, length - i, hash);
+}
+
+// 计算整个文件的校验和与大小，文件无法打开时返回 false
+static bool checksum_file(const string& path, uint64_t& checksum, uint64_t& size) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) return false;
+    vector<char> buffer(1 << 20);
+    checksum = HASH_SEED;
+    size = 0;
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        size_t n = (size_t)file.gcount();
+        if (n == 0) break;
+        checksum = hash_bytes(buffer.data(), n, checksum);
+        size += n;
+    }
+    return true;
+}
+
+// ============================================================================
+// 预编译自动机索引文件
+// compile 模式把构建好的自动机（转移表、边、失败指针、output、字母表）和词表写入一个文件，
+// 扫描时直接 mmap 使用，省去解析词典和构建自动机的时间
+// 文件布局：IndexHeader + 若干按 64 字节对齐的数组段，段位置是相对文件开头的偏移，与加载地址无关
+// 头部记录源词典的大小和校验和，词典变化后旧索引会被拒绝
+// 头部还记录每个数组段和头部自身的校验和，打开时全部核对，损坏的索引在使用前就被拒绝
+// ============================================================================
+
+const char INDEX_MAGIC[8] = { 'W', 'F', 'I', 'D', 'X', '\0', '\0', '\0' };
+const uint32_t INDEX_VERSION = 4;
+const size_t INDEX_ALIGNMENT = 64;
+
+enum IndexSection {
+    SECTION_WORD_OFFSETS,           // 词表：每个词条在 SECTION_WORD_BYTES 中的起始位置（词条数 + 1 个 uint64）
+    SECTION_WORD_BYTES,             // 词表：所有词条依次拼接
+    SECTION_ALPHABET_PAGE_OFFSET,   // 码点字母表的页索引
+    SECTION_ALPHABET_PAGES,         // 码点字母表的页
+    SECTION_DENSE_GOTO,
+    SECTION_EDGE_BEGIN,
+    SECTION_EDGE_LABEL,
+    SECTION_EDGE_TARGET,
+    SECTION_FAIL,
+    SECTION_OUTPUT_SLOT,
+    SECTION_OUTPUT_BEGIN,
+    SECTION_OUTPUTS,
+    SECTION_OUTPUT_LINK,
+    SECTION_COUNT
+};
+
+// 各段的元素大小：词表起始位置为 uint64，词表为字节，其余数组都是 int
+const size_t INDEX_SECTION_ELEMENT_BYTES[SECTION_COUNT] = {
+    sizeof(uint64_t), sizeof(char), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int),
+    sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int)
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t engine;                // SearchEngine 的取值
+    uint64_t dict_size;             // 源词典文件大小
+    uint64_t dict_checksum;         // 源词典文件校验和
+    uint64_t word_count;
+    int32_t alphabet_size;          // 稠密行宽度
+    int32_t dense_states;
+    int32_t pattern_count;
+    int32_t symbol_count;           // 码点字母表的符号数（字节自动机为 0）
+    uint64_t normalization;         // 归一化规则的指纹（CharFolding::fingerprint），未归一化为 0
+    uint64_t section_offset[SECTION_COUNT];
+    uint64_t section_bytes[SECTION_COUNT];
+    uint64_t section_checksum[SECTION_COUNT];   // 各数组段内容的校验和（hash_words）
+    uint64_t header_checksum;       // 头部其余字段的校验和（计算时本字段为 0）
+};
+
+// 头部的校验和：本字段按 0 计算
+static uint64_t index_header_checksum(const IndexHeader& header) {
+    IndexHeader copy = header;
+    copy.header_checksum = 0;
+    return hash_bytes((const char*)&copy, sizeof(copy));
+}
+
+// 只读数组：指向自己持有的 vector，或 mmap 的索引文件中的一段
+template<typename T>
+class ArrayRef {
+private:
+    vector<T> owned;
+    const T* ptr;
+    size_t count;
+
+public:
+    ArrayRef() : ptr(nullptr), count(0) {}
+
+    void assign(vector<T>&& values) {
+        owned = move(values);
+        ptr = owned.data();
+        count = owned.size();
+    }
+
+    void attach(const T* data, size_t n) {
+        owned.clear();
+        owned.shrink_to_fit();
+        ptr = data;
+        count = n;
+    }
+
+    const T& operator[](size_t i) const { return ptr[i]; }
+    const T* data() const { return ptr; }
+    size_t size() const { return count; }
+    size_t bytes() const { return count * sizeof(T); }
+};
+
+// 索引文件写入器：先写占位头部，逐段追加数据，最后回填头部
+class IndexWriter {
+private:
+    ofstream file;
+    IndexHeader header;
+    size_t offset;
+
+public:
+    explicit IndexWriter(const string& path) : file(path, ios::binary | ios::trunc), offset(sizeof(IndexHeader)) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.version = INDEX_VERSION;
+        for (int i = 0; i < SECTION_COUNT; i++) {
+            header.section_checksum[i] = hash_words(nullptr, 0);  // 没有写入的段为空
+        }
+        file.write((const char*)&header, sizeof(header));
+    }
+
+    bool isOpen() const { return file.is_open(); }
+
+    IndexHeader& getHeader() { return header; }
+
+    template<typename T>
+    void writeSection(IndexSection id, const T* data, size_t count) {
+        static const char padding[INDEX_ALIGNMENT] = {};
+        size_t aligned = (offset + INDEX_ALIGNMENT - 1) / INDEX_ALIGNMENT * INDEX_ALIGNMENT;
+        file.write(padding, aligned - offset);
+        header.section_offset[id] = aligned;
+        header.section_bytes[id] = count * sizeof(T);
+        header.section_checksum[id] = hash_words((const char*)data, count * sizeof(T));
+        file.write((const char*)data, count * sizeof(T));
+        offset = aligned + count * sizeof(T);
+    }
+
+    bool finish() {
+        header.header_checksum = index_header_checksum(header);
+        file.seekp(0, ios::beg);
+        file.write((const char*)&header, sizeof(header));
+        file.close();
+        return !file.fail();
+    }
+
+    size_t getSize() const { return offset; }
+};
+
+// 只读映射的索引文件，数组段直接挂到 ArrayRef 上使用
+class IndexFile {
+private:
+    const char* mapped;
+    size_t size;
+    IndexHeader header;
+
+public:
+    IndexFile() : mapped(nullptr), size(0) {
+        memset(&header, 0, sizeof(header));
+    }
+
+    ~IndexFile() {
+        if (mapped) munmap((void*)mapped, size);
+    }
+
+    IndexFile(const IndexFile&) = delete;
+    IndexFile& operator=(const IndexFile&) = delete;
+
+    // 映射并校验索引文件，失败时返回 false 并给出原因
+    // verify 为 true 时核对各数组段的校验和（需要把整个文件读一遍），刚写出的临时文件可以跳过
+    bool open(const string& path, string& error, bool verify = true) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "cannot open " + path;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+            close(fd);
+            error = "file too small";
+            return false;
+        }
+        size = (size_t)st.st_size;
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            error = string("mmap failed: ") + strerror(errno);
+            return false;
+        }
+        mapped = (const char*)addr;
+        memcpy(&header, mapped, sizeof(header));
+
+        if (memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+            error = "not a WikiFilter index";
+            return false;
+        }
+        if (header.version != INDEX_VERSION) {
+            error = "unsupported index version " + to_string(header.version);
+            return false;
+        }
+        if (header.header_checksum != index_header_checksum(header)) {
+            error = "corrupt index (header checksum mismatch), run 'compile' again";
+            return false;
+        }
+        for (int i = 0; i < SECTION_COUNT; i++) {
+            // 先比较长度再做减法，损坏的偏移加上长度可能回绕
+            if (header.section_offset[i] % INDEX_ALIGNMENT != 0
+                || header.section_bytes[i] % INDEX_SECTION_ELEMENT_BYTES[i] != 0
+                || header.section_bytes[i] > size
+                || header.section_offset[i] > size - header.section_bytes[i]) {
+                error = "corrupt index (bad section table), run 'compile' again";
+                return false;
+            }
+            if (verify && hash_words(mapped + header.section_offset[i], header.section_bytes[i])
+                          != header.section_checksum[i]) {
+                error = "corrupt index (section " + to_string(i) + " checksum mismatch), run 'compile' again";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const IndexHeader& getHeader() const { return header; }
+
+    template<typename T>
+    void attach(IndexSection id, ArrayRef<T>& array) const {
+        array.attach((const T*)(mapped + header.section_offset[id]), header.section_bytes[id] / sizeof(T));
+    }
+
+    size_t getSize() const { return size; }
+};
+
+// ============================================================================
+// 词表（字符串池）
+// 所有词条依次拼接在一块连续的内存中，另有词条数 + 1 个起始位置，第 i 个词条为 bytes[offsets[i], offsets[i + 1])；
+// 布局与索引文件的词表段相同，打开预编译索引时直接挂到映射的文件上，不逐个复制
+// 词条编号即读入的顺序，之后不再变化，批次、计数、部分结果和缓存都按编号引用词条
+// ============================================================================
+
+// 词表中的一个词条：指向字符串池中的一段字节（不以 0 结尾），池存在期间有效
+// 比较按无符号字节序，与 string 相同
+class WordRef {
+private:
+    const char* ptr;
+    size_t length;
+
+public:
+    WordRef() : ptr(""), length(0) {}
+    WordRef(const char* data, size_t size) : ptr(data), length(size) {}
+    WordRef(const string& text) : ptr(text.data()), length(text.size()) {}
+
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const char* begin() const { return ptr; }
+    const char* end() const { return ptr + length; }
+    string str() const { return string(ptr, length); }
+
+    int compare(const WordRef& other) const {
+        int cmp = memcmp(ptr, other.ptr, min(length, other.length));
+        if (cmp != 0) return cmp;
+        return length < other.length ? -1 : (length > other.length ? 1 : 0);
+    }
+
+    bool operator==(const WordRef& other) const {
+        return length == other.length && memcmp(ptr, other.ptr, length) == 0;
+    }
+
+    bool operator<(const WordRef& other) const { return compare(other) < 0; }
+};
+
+static ostream& operator<<(ostream& out, const WordRef& word) {
+    return out.write(word.data(), word.size());
+}
+
+class WordList {
+private:
+    ArrayRef<uint64_t> offsets;
+    ArrayRef<char> bytes;
+
+public:
+    WordList() {
+        offsets.assign(vector<uint64_t>(1, 0));
+    }
+
+    WordList(const WordList&) = delete;
+    WordList& operator=(const WordList&) = delete;
+    WordList(WordList&&) = default;
+    WordList& operator=(WordList&&) = default;
+
+    // word_offsets 为词条数 + 1 个起始位置
+    void assign(vector<uint64_t>&& word_offsets, vector<char>&& word_bytes) {
+        offsets.assign(move(word_offsets));
+        bytes.assign(move(word_bytes));
+    }
+
+    // 使用索引文件中的词表，词表段损坏时返回 false
+    bool attach(const IndexFile& index) {
+        index.attach(SECTION_WORD_OFFSETS, offsets);
+        index.attach(SECTION_WORD_BYTES, bytes);
+        uint64_t count = index.getHeader().word_count;
+        return offsets.size() == count + 1 && offsets[count] <= bytes.size();
+    }
+
+    // 写入索引文件的词表段
+    void save(IndexWriter& writer) const {
+        writer.writeSection(SECTION_WORD_OFFSETS, offsets.data(), offsets.size());
+        writer.writeSection(SECTION_WORD_BYTES, bytes.data(), bytes.size());
+    }
+
+    size_t size() const { return offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+
+    WordRef operator[](size_t i) const {
+        return WordRef(bytes.data() + offsets[i], (size_t)(offsets[i + 1] - offsets[i]));
+    }
+
+    // 词表占用的字节数（挂在索引文件上时为映射的大小）
+    size_t memoryBytes() const { return offsets.bytes() + bytes.bytes(); }
+};
+
+// 逐个追加词条，最后交给 WordList
+class WordListBuilder {
+private:
+    vector<uint64_t> offsets;
+    vector<char> bytes;
+
+public:
+    WordListBuilder() : offsets(1, 0) {}
+
+    void add(const WordRef& word) {
+        bytes.insert(bytes.end(), word.begin(), word.end());
+        offsets.push_back(bytes.size());
+    }
+
+    void finish(WordList& words) {
+        bytes.shrink_to_fit();
+        words.assign(move(offsets), move(bytes));
+        offsets.assign(1, 0);
+        bytes.clear();
+    }
+};
+
+// ============================================================================
+// 在 threads 个线程上执行 task(t)（t = 0 .. threads - 1），全部完成后返回；threads <= 1 时直接在当前线程执行
+// ============================================================================
+static void run_threads(int threads, const function<void(int)>& task) {
+    if (threads <= 1) {
+        task(0);
+        return;
+    }
+    vector<thread> workers;
+    for (int t = 1; t < threads; t++) {
+        workers.emplace_back(task, t);
+    }
+    task(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
 // ============================================================================
 // Aho-Corasick 自动机实现（内存优化版）
 // 使用连续内存存储节点，用数组索引替代指针
+// Symbol 为 char 时按字节建树；为 int 时按码点符号建树（见 CodepointAhoCorasick）
+// 构建可以多线程进行（insertAll / buildFailureLinks 的 threads 参数）：
+//   - 建树：按首个符号把词条分成若干组，各组在自己的局部字典树中插入，再依次拼接到根节点之下
+//   - 失败指针：按 BFS 层构建，深度 d + 1 的失败指针只依赖深度 <= d 的节点，同一层内可以并行
+// 结果与串行构建一致：各节点的子节点、失败指针和 output（含顺序）都相同，只有建树的节点编号不同，
+// 冻结为 DenseAhoCorasick 时按 BFS 重新编号，得到的数组逐字节相同
+// 每个词条的 output 只存放在它结尾的节点上；节点另有 output 链接，指向失败链上最近的有 output 的节点，
+// 匹配时先报告本节点的 output，再沿 output 链接报告后缀词条（不把失败节点的 output 复制到每个节点）
 // ============================================================================
 
-// 紧凑的 AC 节点：使用 vector<pair<char,int>> 替代 unordered_map
+// 紧凑的 AC 节点：使用 vector<pair<Symbol,int>> 替代 unordered_map
 // 子节点按字符排序，支持二分查找
+template<typename Symbol>
 struct CompactACNode {
-    vector<pair<char, int>> children;  // (字符, 子节点索引)，按字符排序
+    vector<pair<Symbol, int>> children; // (字符, 子节点索引)，按字符排序
     int fail = 0;                       // 失败指针（节点索引）
     int output_start = -1;              // output 在全局数组中的起始位置，-1 表示无输出
-    int output_count = 0;               // output 数量
+    int output_count = 0;               // output 数量（只含以本节点结尾的词条）
+    int output_link = 0;                // 失败链上最近的有 output 的节点（不含自身），0 表示没有
 };
 
-class AhoCorasick {
+template<typename Symbol>
+struct FlatTrie;
+
+template<typename Symbol>
+class BasicAhoCorasick {
+    friend struct FlatTrie<Symbol>;  // 冻结时直接读取节点数据
+
 private:
-    vector<CompactACNode> nodes;       // 所有节点存储在连续内存中
+    typedef CompactACNode<Symbol> Node;
+
+    vector<Node> nodes;                // 所有节点存储在连续内存中
     vector<int> outputs;               // 所有 output 存储在连续数组中
     int patternCount;
+    size_t childBytes;                 // 所有节点的子节点数组已分配的字节数（建树时累计）
 
     // 在子节点中二分查找字符
-    int findChild(int nodeIdx, char c) const {
+    int findChild(int nodeIdx, Symbol c) const {
         const auto& children = nodes[nodeIdx].children;
         // 二分查找
         int left = 0, right = (int)children.size() - 1;
@@ -158,48 +669,176 @@ private:
         return -1;  // 未找到
     }
 
+    // 失败指针的目标：沿 parent 的失败指针寻找有 c 边的节点，返回该边指向的节点，找不到时为根节点
+    int failTarget(int parent, Symbol c) const {
+        int fail = nodes[parent].fail;
+        while (fail != 0 && findChild(fail, c) == -1) {
+            fail = nodes[fail].fail;
+        }
+        int failChild = findChild(fail, c);
+        return failChild == -1 ? 0 : failChild;
+    }
+
+    // 设置 child 的失败指针和 output 链接（失败节点更浅，它的 output 链接已经确定）
+    void linkChild(int child, int failChild) {
+        nodes[child].fail = failChild;
+        nodes[child].output_link = nodes[failChild].output_count > 0 ? failChild : nodes[failChild].output_link;
+    }
+
     // 添加子节点（保持有序）
-    int addChild(int nodeIdx, char c) {
+    int addChild(int nodeIdx, Symbol c) {
         int newIdx = (int)nodes.size();
-        nodes.push_back(CompactACNode());
+        nodes.push_back(Node());
 
         auto& children = nodes[nodeIdx].children;
+        size_t old_capacity = children.capacity();
         // 找到插入位置
         auto it = lower_bound(children.begin(), children.end(), make_pair(c, 0),
-            [](const pair<char,int>& a, const pair<char,int>& b) {
+            [](const pair<Symbol,int>& a, const pair<Symbol,int>& b) {
                 return a.first < b.first;
             });
         children.insert(it, make_pair(c, newIdx));
+        childBytes += (children.capacity() - old_capacity) * sizeof(pair<Symbol, int>);
         return newIdx;
     }
 
+    // 词条或节点数少于这些值时多线程构建得不偿失，改为串行
+    static const size_t PARALLEL_MIN_PATTERNS = 65536;
+    static const size_t PARALLEL_MIN_LEVEL = 4096;
+
 public:
-    AhoCorasick() : patternCount(0) {
+    BasicAhoCorasick() : patternCount(0), childBytes(0) {
         nodes.reserve(1000000);  // 预分配空间
-        nodes.push_back(CompactACNode());  // 根节点
+        nodes.push_back(Node());  // 根节点
     }
 
-    // 添加词条
-    void insert(const string& pattern, int index) {
+    // 添加词条（pattern 为 string 或符号序列）
+    template<typename Sequence>
+    void insert(const Sequence& pattern, int index) {
         int current = 0;  // 从根节点开始
-        for (char c : pattern) {
+        for (Symbol c : pattern) {
             int childIdx = findChild(current, c);
             if (childIdx == -1) {
                 childIdx = addChild(current, c);
             }
             current = childIdx;
         }
-        // 添加输出
-        if (nodes[current].output_start == -1) {
-            nodes[current].output_start = (int)outputs.size();
+        // 添加输出（重复词条时，若该节点的 output 已不在数组末尾，先整体搬到末尾以保持连续）
+        Node& node = nodes[current];
+        if (node.output_start == -1) {
+            node.output_start = (int)outputs.size();
+        } else if (node.output_start + node.output_count != (int)outputs.size()) {
+            int new_start = (int)outputs.size();
+            for (int i = 0; i < node.output_count; i++) {
+                outputs.push_back(outputs[node.output_start + i]);
+            }
+            node.output_start = new_start;
         }
         outputs.push_back(index);
         nodes[current].output_count++;
         patternCount++;
     }
 
-    // 构建失败指针（BFS）
-    void buildFailureLinks() {
+    // 插入 count 个词条，pattern_at(i) 返回第 i 个词条的符号序列，词条索引即为 i；只用于空的自动机
+    // threads > 1 时按首个符号分组并行建树（pattern_at 会被多个线程同时调用）：
+    // 各组是首符号连续的一段，组内按词条索引顺序插入，拼接后根节点的子节点仍然有序，
+    // 每个节点的子节点和 output 顺序与串行插入相同
+    template<typename PatternAt>
+    void insertAll(size_t count, PatternAt&& pattern_at, int threads = 1) {
+        if (threads <= 1 || count < PARALLEL_MIN_PATTERNS || nodes.size() != 1) {
+            for (size_t i = 0; i < count; i++) {
+                insert(pattern_at(i), (int)i);
+            }
+            return;
+        }
+
+        // 1. 各词条的首符号（空词条只在根节点输出，最后串行插入）
+        vector<Symbol> first(count);
+        vector<char> empty(count, 0);
+        run_threads(threads, [&](int t) {
+            for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+                const auto& pattern = pattern_at(i);
+                if (pattern.empty()) {
+                    empty[i] = 1;
+                } else {
+                    first[i] = *pattern.begin();
+                }
+            }
+        });
+
+        // 2. 按首符号排序后切成词条数大致相等的组，groupFirst 为每组的第一个首符号
+        vector<Symbol> sorted;
+        sorted.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            if (!empty[i]) sorted.push_back(first[i]);
+        }
+        sort(sorted.begin(), sorted.end());
+        vector<Symbol> groupFirst;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            if (i > 0 && sorted[i] == sorted[i - 1]) continue;
+            if (groupFirst.empty() || (i >= sorted.size() * groupFirst.size() / threads
+                                       && (int)groupFirst.size() < threads)) {
+                groupFirst.push_back(sorted[i]);
+            }
+        }
+        sorted.clear();
+        sorted.shrink_to_fit();
+        int groups = (int)groupFirst.size();
+        vector<vector<int>> members(groups);
+        for (size_t i = 0; i < count; i++) {
+            if (empty[i]) continue;
+            int g = (int)(upper_bound(groupFirst.begin(), groupFirst.end(), first[i]) - groupFirst.begin()) - 1;
+            members[g].push_back((int)i);
+        }
+        first.clear();
+        first.shrink_to_fit();
+
+        // 3. 各组在自己的局部字典树中插入
+        vector<unique_ptr<BasicAhoCorasick>> parts(groups);
+        run_threads(groups, [&](int g) {
+            parts[g].reset(new BasicAhoCorasick());
+            for (int i : members[g]) {
+                parts[g]->insert(pattern_at(i), i);
+            }
+            vector<int>().swap(members[g]);
+        });
+
+        // 4. 依次拼接：局部节点 k（k >= 1）成为全局节点 base + k，output 位置整体平移
+        size_t total = 1;
+        for (const auto& part : parts) total += part->nodes.size() - 1;
+        nodes.reserve(total);
+        auto& rootChildren = nodes[0].children;
+        for (auto& part : parts) {
+            int base = (int)nodes.size() - 1;
+            int outputBase = (int)outputs.size();
+            for (const auto& child : part->nodes[0].children) {
+                rootChildren.push_back(make_pair(child.first, child.second + base));
+            }
+            for (size_t k = 1; k < part->nodes.size(); k++) {
+                Node& node = part->nodes[k];
+                for (auto& child : node.children) child.second += base;
+                if (node.output_start != -1) node.output_start += outputBase;
+                nodes.push_back(move(node));
+            }
+            outputs.insert(outputs.end(), part->outputs.begin(), part->outputs.end());
+            childBytes += part->childBytes - part->nodes[0].children.capacity() * sizeof(pair<Symbol, int>);
+            patternCount += part->patternCount;
+            part.reset();
+        }
+        childBytes += rootChildren.capacity() * sizeof(pair<Symbol, int>);
+
+        for (size_t i = 0; i < count; i++) {
+            if (empty[i]) insert(pattern_at(i), (int)i);
+        }
+    }
+
+    // 构建失败指针（BFS），threads > 1 时同一层的节点分给多个线程
+    void buildFailureLinks(int threads = 1) {
+        if (threads > 1 && nodes.size() >= PARALLEL_MIN_LEVEL) {
+            buildFailureLinksByLevel(threads);
+            return;
+        }
+
         queue<int> q;  // 存储节点索引
 
         // 根节点的子节点失败指针指向根
@@ -214,51 +853,51 @@ public:
             q.pop();
 
             for (const auto& childPair : nodes[current].children) {
-                char c = childPair.first;
                 int child = childPair.second;
-                int fail = nodes[current].fail;
+                linkChild(child, failTarget(current, childPair.first));
+                q.push(child);
+            }
+        }
+    }
 
-                // 沿着失败指针查找
-                while (fail != 0 && findChild(fail, c) == -1) {
-                    fail = nodes[fail].fail;
-                }
+    // 逐层构建失败指针：每层按顺序切成连续的段分给各线程，线程只写下一层节点的失败指针和 output 链接
+    void buildFailureLinksByLevel(int threads) {
+        vector<int> level;
+        for (const auto& child : nodes[0].children) {
+            nodes[child.second].fail = 0;
+            level.push_back(child.second);
+        }
 
-                int failChild = findChild(fail, c);
-                if (fail == 0 && failChild == -1) {
-                    nodes[child].fail = 0;
-                } else if (failChild != -1) {
-                    nodes[child].fail = failChild;
-                    // 合并输出
-                    if (nodes[failChild].output_count > 0) {
-                        // 需要扩容 output
-                        int new_start = (int)outputs.size();
-                        // 复制原有 output
-                        for (int i = 0; i < nodes[child].output_count; i++) {
-                            outputs.push_back(outputs[nodes[child].output_start + i]);
-                        }
-                        // 添加 fail 节点的 output
-                        for (int i = 0; i < nodes[failChild].output_count; i++) {
-                            outputs.push_back(outputs[nodes[failChild].output_start + i]);
-                        }
-                        nodes[child].output_start = new_start;
-                        nodes[child].output_count += nodes[failChild].output_count;
+        vector<vector<int>> nextParts(threads);
+        while (!level.empty()) {
+            int parts = level.size() >= PARALLEL_MIN_LEVEL ? threads : 1;
+            run_threads(parts, [&](int t) {
+                vector<int>& next = nextParts[t];
+                next.clear();
+                for (size_t i = level.size() * t / parts; i < level.size() * (t + 1) / parts; i++) {
+                    int current = level[i];
+                    for (const auto& childPair : nodes[current].children) {
+                        int child = childPair.second;
+                        linkChild(child, failTarget(current, childPair.first));
+                        next.push_back(child);
                     }
-                } else {
-                    nodes[child].fail = 0;
                 }
-                q.push(child);
+            });
+
+            level.clear();
+            for (int t = 0; t < parts; t++) {
+                level.insert(level.end(), nextParts[t].begin(), nextParts[t].end());
             }
         }
     }
 
-    // 搜索文本，返回所有匹配的词条索引（去重）
-    // 优化：使用vector收集+排序去重，比unordered_set快2-3倍
-    vector<int> search(const char* text, size_t length) {
-        vector<int> matches;
+    // 搜索文本，对每个匹配位置的每个词条索引调用 visit（同一词条可能多次出现），仅用于按字节建树的自动机
+    template<typename Visitor>
+    void search(const char* text, size_t length, Visitor&& visit) const {
         int current = 0;  // 从根节点开始
 
         for (size_t i = 0; i < length; i++) {
-            char c = text[i];
+            Symbol c = text[i];
 
             // 沿着失败指针查找
             while (current != 0 && findChild(current, c) == -1) {
@@ -272,452 +911,5566 @@ public:
                 current = 0;
             }
 
-            // 收集匹配
-            if (nodes[current].output_count > 0) {
-                for (int j = 0; j < nodes[current].output_count; j++) {
-                    matches.push_back(outputs[nodes[current].output_start + j]);
+            // 报告匹配：本节点的 output，再沿 output 链接报告作为后缀出现的词条
+            for (int node = nodes[current].output_count > 0 ? current : nodes[current].output_link;
+                 node != 0; node = nodes[node].output_link) {
+                for (int j = 0; j < nodes[node].output_count; j++) {
+                    visit(outputs[nodes[node].output_start + j]);
                 }
             }
         }
-
-        // 去重：排序后去重
-        if (matches.size() > 1) {
-            sort(matches.begin(), matches.end());
-            matches.erase(unique(matches.begin(), matches.end()), matches.end());
-        }
-
-        return matches;
     }
 
     int getPatternCount() const { return patternCount; }
+    size_t getNodeCount() const { return nodes.size(); }
+
+    // 实际占用的字节数：节点、子节点数组、output 数组
+    // 节点数组预留的容量在写入前不会真正占用物理内存，按已用的节点数计算
+    size_t memoryBytes() const {
+        return nodes.size() * sizeof(Node) + childBytes + outputs.capacity() * sizeof(int);
+    }
 };
 
+typedef BasicAhoCorasick<char> AhoCorasick;
+
 // ============================================================================
-// 全局变量
+// 平铺字典树：状态按 BFS 编号，边以 CSR 数组存放（每个状态的边按 Symbol 排序），附带失败指针和 output 链接
+// 是冻结为 DenseAhoCorasick 之前的中间形式，有两种来源：
+//   - fromTrie：把构建好的 BasicAhoCorasick 按 BFS 重新编号（classic 自动机冻结时使用）
+//   - build：从词典直接批量构建。词条先按符号序列排序，深度为 d 的节点就是长度为 d 的不同前缀，
+//     按字典序排列正好是 BFS 顺序，每个节点对应排序后词条中连续的一段；
+//     逐层扫描这些区间，一次线性遍历生成该层的全部节点、边和 output，直接追加到平铺数组中，
+//     没有每个节点各自的子节点容器，也没有有序数组中间的插入
+// 两种来源得到的数组完全相同（同一词条重复出现时按词条索引排序，与逐个插入的 output 顺序一致）
+// threads > 1 时排序、逐层扫描和失败指针都按段分给多个线程，结果不变
 // ============================================================================
 
-mutex file_mutex;
-mutex cout_mutex;
-
-// 批次处理的词条范围
-struct BatchRange {
-    size_t start;
-    size_t end;
-};
-
-// 分块边界信息（不存储数据，只存储偏移）
-struct ChunkBoundary {
-    size_t start_offset;    // 分块在文件中的起始偏移
-    size_t end_offset;      // 分块在文件中的结束偏移
-    size_t line_count;      // 该分块的行数
-};
-
-// 流式文件加载器 - 真正的内存优化版本
-// 只保持一个分块在内存中，或缓存整个文件（当内存足够时）
-class StreamingFileLoader {
-private:
-    string file_path;
-    size_t chunk_size;
-    size_t total_lines;
-    size_t file_size;
-    vector<ChunkBoundary> boundaries;  // 分块边界信息
-    vector<char> cached_file;          // 缓存的整个文件内容（当文件能完全加载时）
-    bool file_cached;                  // 是否已缓存整个文件
+template<typename Symbol>
+struct FlatTrie {
+    typedef typename make_unsigned<Symbol>::type Label;
+
+    vector<int> edgeBegin;      // 每个状态的边的起始位置（大小为状态数 + 1）
+    vector<Label> edgeLabel;    // 边上的符号，按 Symbol 的顺序排列（char 为有符号顺序，与 BasicAhoCorasick 一致）
+    vector<int> edgeTarget;
+    vector<int> fail;
+    vector<int> outputLink;     // 失败链上最近的有 output 的状态，0 表示没有
+    vector<int> outputBegin;    // 每个状态的 output 起始位置（大小为状态数 + 1），只含以该状态结尾的词条
+    vector<int> outputs;
+    int patternCount = 0;
+    size_t buildPeakBytes = 0;  // build 过程中的内存峰值（排序用的临时数组 + 平铺数组）
+
+    size_t stateCount() const { return fail.size(); }
+
+    // 各数组已用部分的字节数（预留而未写入的容量不占用物理内存）
+    size_t memoryBytes() const {
+        return edgeBegin.size() * sizeof(int) + edgeLabel.size() * sizeof(Label) + edgeTarget.size() * sizeof(int)
+             + fail.size() * sizeof(int) + outputLink.size() * sizeof(int) + outputBegin.size() * sizeof(int)
+             + outputs.size() * sizeof(int);
+    }
 
-public:
-    StreamingFileLoader(const string& path, size_t chunk_bytes = 200 * 1024 * 1024)
-        : file_path(path), chunk_size(chunk_bytes), total_lines(0), file_size(0), file_cached(false) {}
+    // 所有数组内容的校验和，用于确认不同构建方式的结果相同
+    uint64_t checksum() const {
+        uint64_t hash = HASH_SEED;
+        hash = hash_bytes((const char*)edgeBegin.data(), edgeBegin.size() * sizeof(int), hash);
+        hash = hash_bytes((const char*)edgeLabel.data(), edgeLabel.size() * sizeof(Label), hash);
+        hash = hash_bytes((const char*)edgeTarget.data(), edgeTarget.size() * sizeof(int), hash);
+        hash = hash_bytes((const char*)fail.data(), fail.size() * sizeof(int), hash);
+        hash = hash_bytes((const char*)outputLink.data(), outputLink.size() * sizeof(int), hash);
+        hash = hash_bytes((const char*)outputBegin.data(), outputBegin.size() * sizeof(int), hash);
+        return hash_bytes((const char*)outputs.data(), outputs.size() * sizeof(int), hash);
+    }
 
-    // 预扫描文件，记录分块边界（不加载内容到内存）
-    bool scanBoundaries() {
-        ifstream file(file_path, ios::binary);
-        if (!file.is_open()) {
-            cerr << "Error opening file: " << file_path << endl;
-            return false;
+    // 查找状态的 c 边，找不到返回 -1
+    int findEdge(int state, Symbol c) const {
+        int left = edgeBegin[state];
+        int right = edgeBegin[state + 1] - 1;
+        while (left <= right) {
+            int mid = left + (right - left) / 2;
+            Symbol label = (Symbol)edgeLabel[mid];
+            if (label == c) {
+                return edgeTarget[mid];
+            } else if (label < c) {
+                left = mid + 1;
+            } else {
+                right = mid - 1;
+            }
         }
+        return -1;
+    }
 
-        // 获取文件大小
-        file.seekg(0, ios::end);
-        file_size = file.tellg();
-        file.seekg(0, ios::beg);
+    // 把 BasicAhoCorasick（已构建失败指针）按 BFS 重新编号
+    static FlatTrie fromTrie(const BasicAhoCorasick<Symbol>& ac) {
+        const auto& nodes = ac.nodes;
+        size_t node_count = nodes.size();
+
+        // BFS 编号，保证浅层状态在前、失败指针总是指向编号更小的状态
+        vector<int> order;               // BFS 编号 -> 原节点索引
+        vector<int> newId(node_count, -1);
+        order.reserve(node_count);
+        order.push_back(0);
+        newId[0] = 0;
+        for (size_t head = 0; head < order.size(); head++) {
+            for (const auto& child : nodes[order[head]].children) {
+                newId[child.second] = (int)order.size();
+                order.push_back(child.second);
+            }
+        }
 
-        cout << "Scanning file: " << file_path << " (" << file_size << " bytes)" << endl;
+        FlatTrie trie;
+        trie.patternCount = ac.patternCount;
+        trie.edgeBegin.resize(node_count + 1);
+        trie.outputBegin.resize(node_count + 1);
+        trie.fail.resize(node_count);
+        trie.outputLink.resize(node_count);
+        trie.edgeLabel.reserve(node_count);
+        trie.edgeTarget.reserve(node_count);
+        for (size_t s = 0; s < node_count; s++) {
+            const CompactACNode<Symbol>& node = nodes[order[s]];
+            trie.edgeBegin[s] = (int)trie.edgeLabel.size();
+            for (const auto& child : node.children) {
+                trie.edgeLabel.push_back((Label)child.first);
+                trie.edgeTarget.push_back(newId[child.second]);
+            }
+            trie.fail[s] = newId[node.fail];
+            trie.outputLink[s] = newId[node.output_link];
+            trie.outputBegin[s] = (int)trie.outputs.size();
+            for (int i = 0; i < node.output_count; i++) {
+                trie.outputs.push_back(ac.outputs[node.output_start + i]);
+            }
+        }
+        trie.edgeBegin[node_count] = (int)trie.edgeLabel.size();
+        trie.outputBegin[node_count] = (int)trie.outputs.size();
+        trie.buildPeakBytes = trie.memoryBytes();
+        return trie;
+    }
 
-        // 预分配缓冲区用于扫描
-        vector<char> buffer(min(chunk_size, file_size) + 1);
-        size_t current_offset = 0;
+    // 从词典批量构建：pattern_at(i) 返回第 i 个词条的符号序列 (指针, 长度)，词条索引即为 i
+    template<typename PatternAt>
+    static FlatTrie build(size_t count, PatternAt&& pattern_at, int threads = 1) {
+        FlatTrie trie;
+        trie.patternCount = (int)count;
+
+        // 1. 按符号序列排序（相同时按词条索引）：先比较由前几个符号压缩成的 64 位键，相同再逐个比较
+        int parts = count >= PARALLEL_MIN_PATTERNS ? max(1, threads) : 1;
+        vector<pair<uint64_t, int>> keyed(count);
+        vector<size_t> partSymbols(parts, 0);
+        auto less = [&](const pair<uint64_t, int>& a, const pair<uint64_t, int>& b) {
+            if (a.first != b.first) return a.first < b.first;
+            pair<const Symbol*, size_t> pa = pattern_at(a.second);
+            pair<const Symbol*, size_t> pb = pattern_at(b.second);
+            size_t common = min(pa.second, pb.second);
+            for (size_t k = 0; k < common; k++) {
+                if (pa.first[k] != pb.first[k]) return pa.first[k] < pb.first[k];
+            }
+            if (pa.second != pb.second) return pa.second < pb.second;
+            return a.second < b.second;
+        };
+        run_threads(parts, [&](int t) {
+            size_t begin = count * t / parts;
+            size_t end = count * (t + 1) / parts;
+            for (size_t i = begin; i < end; i++) {
+                pair<const Symbol*, size_t> pattern = pattern_at(i);
+                keyed[i] = make_pair(sortKey(pattern.first, pattern.second), (int)i);
+                partSymbols[t] += pattern.second;
+            }
+            sort(keyed.begin() + begin, keyed.begin() + end, less);
+        });
+        // 各段排好后两两归并
+        for (int width = 1; width < parts; width *= 2) {
+            int merges = (parts + 2 * width - 1) / (2 * width);
+            run_threads(merges, [&](int m) {
+                int first = m * 2 * width;
+                int middle = min(parts, first + width);
+                int last = min(parts, first + 2 * width);
+                if (middle < last) {
+                    inplace_merge(keyed.begin() + count * first / parts, keyed.begin() + count * middle / parts,
+                                  keyed.begin() + count * last / parts, less);
+                }
+            });
+        }
+        size_t totalSymbols = 0;
+        for (size_t symbols : partSymbols) totalSymbols += symbols;
+        vector<int> sorted(count);
+        for (size_t i = 0; i < count; i++) sorted[i] = keyed[i].second;
+        size_t sortPeak = count * (sizeof(pair<uint64_t, int>) + sizeof(int));
+        vector<pair<uint64_t, int>>().swap(keyed);
+
+        // 2. 逐层生成节点：level 为当前层每个节点对应的词条区间 [first, second)（在 sorted 中）
+        //    状态数不超过符号总数 + 1，按上限预留，只有实际写入的部分占用物理内存
+        trie.edgeBegin.reserve(totalSymbols + 2);
+        trie.outputBegin.reserve(totalSymbols + 2);
+        trie.edgeLabel.reserve(totalSymbols);
+        trie.edgeTarget.reserve(totalSymbols);
+        trie.outputs.reserve(count);
+        vector<int> levelBegin(1, 0);   // 每一层第一个状态的编号
+        vector<pair<int, int>> level(1, make_pair(0, (int)count));
+        vector<pair<int, int>> nextLevel;
+        size_t levelPeak = 0;
+
+        // 每个线程处理当前层连续的一段节点，结果先写到自己的缓冲区，再按顺序拼接
+        struct LevelPart {
+            vector<int> outputs;
+            vector<int> outputCount;        // 每个节点的 output 数
+            vector<int> edgeCount;          // 每个节点的子节点数
+            vector<Label> labels;
+            vector<pair<int, int>> children;
+        };
+        vector<LevelPart> levelParts(max(1, threads));
+        int depth = 0;
+        while (!level.empty()) {
+            int levelThreads = level.size() >= PARALLEL_MIN_LEVEL ? max(1, threads) : 1;
+            run_threads(levelThreads, [&](int t) {
+                LevelPart& part = levelParts[t];
+                part.outputs.clear();
+                part.outputCount.clear();
+                part.edgeCount.clear();
+                part.labels.clear();
+                part.children.clear();
+                for (size_t n = level.size() * t / levelThreads; n < level.size() * (t + 1) / levelThreads; n++) {
+                    int pos = level[n].first;
+                    int end = level[n].second;
+                    // 在本节点结束的词条排在区间最前面
+                    int outputs = 0;
+                    while (pos < end && pattern_at(sorted[pos]).second == (size_t)depth) {
+                        part.outputs.push_back(sorted[pos++]);
+                        outputs++;
+                    }
+                    // 其余词条按第 depth 个符号分组，每组是一个子节点
+                    int edges = 0;
+                    while (pos < end) {
+                        Symbol c = pattern_at(sorted[pos]).first[depth];
+                        int groupEnd = pos + 1;
+                        while (groupEnd < end && pattern_at(sorted[groupEnd]).first[depth] == c) groupEnd++;
+                        part.labels.push_back((Label)c);
+                        part.children.push_back(make_pair(pos, groupEnd));
+                        edges++;
+                        pos = groupEnd;
+                    }
+                    part.outputCount.push_back(outputs);
+                    part.edgeCount.push_back(edges);
+                }
+            });
+
+            // 按顺序拼接：子节点按出现顺序依次编号，即下一层的 BFS 顺序
+            nextLevel.clear();
+            int nextId = levelBegin.back() + (int)level.size();
+            for (int t = 0; t < levelThreads; t++) {
+                LevelPart& part = levelParts[t];
+                size_t outputPos = 0;
+                size_t edgePos = 0;
+                for (size_t n = 0; n < part.outputCount.size(); n++) {
+                    trie.outputBegin.push_back((int)trie.outputs.size());
+                    for (int k = 0; k < part.outputCount[n]; k++) {
+                        trie.outputs.push_back(part.outputs[outputPos++]);
+                    }
+                    trie.edgeBegin.push_back((int)trie.edgeLabel.size());
+                    for (int k = 0; k < part.edgeCount[n]; k++) {
+                        trie.edgeLabel.push_back(part.labels[edgePos]);
+                        trie.edgeTarget.push_back(nextId++);
+                        nextLevel.push_back(part.children[edgePos++]);
+                    }
+                }
+            }
+            levelBegin.push_back(levelBegin.back() + (int)level.size());
+            levelPeak = max(levelPeak, (level.size() + nextLevel.size()) * sizeof(pair<int, int>));
+            level.swap(nextLevel);
+            depth++;
+        }
+        size_t state_count = trie.edgeBegin.size();
+        trie.edgeBegin.push_back((int)trie.edgeLabel.size());
+        trie.outputBegin.push_back((int)trie.outputs.size());
+        trie.buildPeakBytes = max(sortPeak, count * sizeof(int) + levelPeak + trie.memoryBytes());
+        vector<int>().swap(sorted);
+
+        // 3. 失败指针和 output 链接
+        trie.fail.assign(state_count, 0);
+        trie.outputLink.assign(state_count, 0);
+        trie.buildFailureLinks(levelBegin, threads);
+        trie.buildPeakBytes = max(trie.buildPeakBytes, trie.memoryBytes());
+        return trie;
+    }
+
+private:
+    static const size_t PARALLEL_MIN_PATTERNS = 65536;
+    static const size_t PARALLEL_MIN_LEVEL = 4096;
+
+    // 排序键：前几个符号按顺序压缩进 64 位（字节每个 8 位，码点符号每个 21 位），不足时补 0
+    // 键的顺序与符号序列的顺序一致（键相同时不能区分，需要逐个比较）
+    static uint64_t sortKey(const Symbol* p, size_t length) {
+        const int width = sizeof(Symbol) == 1 ? 8 : 21;
+        const uint64_t limit = (1ULL << width) - 1;
+        uint64_t key = 0;
+        for (int k = 0; k < 64 / width; k++) {
+            uint64_t v = 0;
+            if ((size_t)k < length) {
+                // char 有符号：翻转最高位，使无符号比较与有符号顺序一致；码点符号不为负
+                v = sizeof(Symbol) == 1 ? (uint64_t)(uint8_t)((uint8_t)p[k] ^ 0x80)
+                                        : min((uint64_t)(Label)p[k], limit);
+            }
+            key = (key << width) | v;
+        }
+        return key;
+    }
+
+    // 逐层构建失败指针：第 d 层状态的子节点只依赖更浅的状态，每层的状态按段分给各线程
+    void buildFailureLinks(const vector<int>& levelBegin, int threads) {
+        for (size_t d = 0; d + 1 < levelBegin.size(); d++) {
+            int first = levelBegin[d];
+            int last = levelBegin[d + 1];
+            int levelThreads = (size_t)(last - first) >= PARALLEL_MIN_LEVEL ? max(1, threads) : 1;
+            run_threads(levelThreads, [&](int t) {
+                int begin = first + (int)((size_t)(last - first) * t / levelThreads);
+                int end = first + (int)((size_t)(last - first) * (t + 1) / levelThreads);
+                for (int parent = begin; parent < end; parent++) {
+                    for (int e = edgeBegin[parent]; e < edgeBegin[parent + 1]; e++) {
+                        int child = edgeTarget[e];
+                        int failChild = 0;
+                        if (parent != 0) {
+                            Symbol c = (Symbol)edgeLabel[e];
+                            int state = fail[parent];
+                            while (true) {
+                                int target = findEdge(state, c);
+                                if (target != -1) {
+                                    failChild = target;
+                                    break;
+                                }
+                                if (state == 0) break;
+                                state = fail[state];
+                            }
+                        }
+                        fail[child] = failChild;
+                        outputLink[child] = outputBegin[failChild] != outputBegin[failChild + 1]
+                                          ? failChild : outputLink[failChild];
+                    }
+                }
+            });
+        }
+    }
+};
+
+// ============================================================================
+// 冻结的只读 AC 自动机（稠密转移表 + 连续边数组）
+// 由平铺字典树（FlatTrie，可以来自 BasicAhoCorasick 或直接从词典批量构建）生成，扫描时不再二分查找：
+//   - 状态按 BFS 顺序重新编号，浅层（热点）状态排在前面
+//   - 前 denseStates 个状态拥有完整的 alphabetSize 路 goto 表（已预先折叠失败跳转），每个符号一次数组读取
+//   - 其余深层状态的边按符号排序存放在连续数组中（CSR），查找失败时沿失败指针回退，
+//     失败指针一旦落入稠密区即可一次读取得到结果
+//   - 稠密表只在留在缓存中时才有收益：大小不超过 L2 缓存，也不超过其余数组的一半，小批次的表随之缩小
+//     （实测 6.5 万行、64 MB 的表与只有根状态一行相比扫描速度相差在噪声以内，却占去每个批次 64 MB）
+// 只用于码点自动机（CodepointAhoCorasick）：字母表为词典用到的字符数，稠密行只覆盖最热的少量状态
+// 按字节的 dense 引擎已移除：256 路的行只能覆盖前一两千个状态，更深的状态仍要查找边并沿失败指针回退，
+// 扫描速度与 classic 相当，而码点自动机每个字符只转移一次，在 bench 中快一倍以上
+// ============================================================================
+
+template<typename Symbol>
+class DenseAhoCorasick {
+public:
+    typedef typename make_unsigned<Symbol>::type Label;
+
+private:
+    // 检测不到 L2 缓存大小时稠密 goto 表的上限：1 MB（字节自动机每个状态 256 * 4 字节 = 1 KB，约 1000 个状态）
+    static const size_t DENSE_TABLE_FALLBACK_BYTES = 1024 * 1024;
+    // 边数超过该值时改用二分查找
+    static const int LINEAR_SCAN_EDGES = 8;
+
+    int alphabetSize;                    // 稠密行宽度
+    int denseStates;                     // 拥有完整 goto 表的状态数（BFS 编号 < denseStates）
+    ArrayRef<int> denseGoto;             // denseStates * alphabetSize 的完整转移表
+    ArrayRef<int> edgeBegin;             // 每个状态的边在 edgeLabel/edgeTarget 中的起始位置（大小为状态数 + 1）
+    ArrayRef<Label> edgeLabel;           // 边上的符号，按状态连续、按符号排序
+    ArrayRef<int> edgeTarget;            // 边指向的状态
+    ArrayRef<int> fail;                  // 失败指针（BFS 编号）
+    // output 按"槽"存放：每个有词条结尾的状态一个槽（编号从 1 开始，按 BFS 顺序分配），
+    // 槽记录以该状态结尾的词条和 output 链上的下一个槽；每个词条在 outputs 中只出现一次
+    ArrayRef<int> outputSlot;            // 每个状态匹配时的第一个槽：自身的槽，自身没有时为 output 链上的第一个槽，0 表示没有匹配
+    ArrayRef<int> outputBegin;           // 每个槽的词条在 outputs 中的起始位置（大小为槽数 + 2，槽 0 为空）
+    ArrayRef<int> outputs;               // 所有 output（词条索引）
+    ArrayRef<int> outputLink;            // 每个槽在 output 链上的下一个槽，0 表示没有
+    int patternCount;
+    size_t buildPeakBytes;               // 冻结过程中的内存峰值（从索引文件加载时为 0）
+
+    // 稠密 goto 表的上限：L2 缓存大小
+    static size_t denseTableLimit() {
+        static const size_t limit = []() {
+            long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+            return l2 > 0 ? (size_t)l2 : DENSE_TABLE_FALLBACK_BYTES;
+        }();
+        return limit;
+    }
+
+    // 在深层状态的边中查找符号，找不到返回 -1
+    int findEdge(int state, Label c) const {
+        int begin = edgeBegin[state];
+        int end = edgeBegin[state + 1];
+        if (end - begin <= LINEAR_SCAN_EDGES) {
+            for (int e = begin; e < end; e++) {
+                if (edgeLabel[e] == c) return edgeTarget[e];
+                if (edgeLabel[e] > c) break;
+            }
+            return -1;
+        }
+        const Label* first = edgeLabel.data() + begin;
+        const Label* last = edgeLabel.data() + end;
+        const Label* it = lower_bound(first, last, c);
+        if (it != last && *it == c) return edgeTarget[begin + (it - first)];
+        return -1;
+    }
+
+public:
+    // 从平铺字典树冻结，边、失败指针和 output 数组直接接管，不再复制
+    DenseAhoCorasick(FlatTrie<Symbol>&& trie, int alphabet_size)
+        : alphabetSize(alphabet_size), denseStates(0), patternCount(trie.patternCount), buildPeakBytes(0) {
+        size_t node_count = trie.stateCount();
+        vector<int>& edgeBegin = trie.edgeBegin;
+        vector<Label>& edgeLabel = trie.edgeLabel;
+        vector<int>& edgeTarget = trie.edgeTarget;
+        const vector<int>& fail = trie.fail;
+
+        // 1. 平铺字典树的边按 Symbol 排序（char 有符号），这里按无符号标签重新排序
+        for (size_t s = 0; s < node_count; s++) {
+            int begin = edgeBegin[s];
+            int end = edgeBegin[s + 1];
+            for (int i = begin + 1; i < end; i++) {
+                Label label = edgeLabel[i];
+                int target = edgeTarget[i];
+                int j = i - 1;
+                while (j >= begin && edgeLabel[j] > label) {
+                    edgeLabel[j + 1] = edgeLabel[j];
+                    edgeTarget[j + 1] = edgeTarget[j];
+                    j--;
+                }
+                edgeLabel[j + 1] = label;
+                edgeTarget[j + 1] = target;
+            }
+        }
+
+        // 2. output 槽：按 BFS 顺序给有 output 的状态分配，output 链接指向的状态更浅，它的槽已经分配
+        vector<int> outputSlot(node_count, 0);
+        vector<int> outputBegin(2, 0);
+        vector<int> outputLink(1, 0);
+        for (size_t s = 0; s < node_count; s++) {
+            int linkSlot = outputSlot[trie.outputLink[s]];
+            if (trie.outputBegin[s] != trie.outputBegin[s + 1]) {
+                outputSlot[s] = (int)outputLink.size();
+                outputLink.push_back(linkSlot);
+                outputBegin.push_back(trie.outputBegin[s + 1]);
+            } else {
+                outputSlot[s] = linkSlot;
+            }
+        }
+
+        // 3. 稠密 goto 表：BFS 顺序填充，缺失的转移直接取失败状态的转移（失败状态编号更小，已填好）
+        //    行数按缓存大小和其余数组的大小确定，至少包含根状态
+        size_t row_bytes = (size_t)alphabetSize * sizeof(int);
+        size_t sparse_bytes = edgeBegin.size() * sizeof(int) + edgeLabel.size() * sizeof(Label)
+                            + edgeTarget.size() * sizeof(int) + fail.size() * sizeof(int)
+                            + outputSlot.size() * sizeof(int) + trie.outputs.size() * sizeof(int);
+        size_t table_bytes = min(denseTableLimit(), sparse_bytes / 2);
+        denseStates = (int)max((size_t)1, min(node_count, table_bytes / row_bytes));
+        vector<int> denseGoto((size_t)denseStates * alphabetSize, 0);
+        for (int s = 0; s < denseStates; s++) {
+            int* row = &denseGoto[(size_t)s * alphabetSize];
+            if (s != 0) {
+                const int* failRow = &denseGoto[(size_t)fail[s] * alphabetSize];
+                memcpy(row, failRow, row_bytes);
+            }
+            for (int e = edgeBegin[s]; e < edgeBegin[s + 1]; e++) {
+                row[edgeLabel[e]] = edgeTarget[e];
+            }
+        }
+
+        this->denseGoto.assign(move(denseGoto));
+        this->edgeBegin.assign(move(trie.edgeBegin));
+        this->edgeLabel.assign(move(trie.edgeLabel));
+        this->edgeTarget.assign(move(trie.edgeTarget));
+        this->fail.assign(move(trie.fail));
+        this->outputSlot.assign(move(outputSlot));
+        this->outputBegin.assign(move(outputBegin));
+        this->outputs.assign(move(trie.outputs));
+        this->outputLink.assign(move(outputLink));
+        // 冻结时平铺字典树剩下的数组（output 起始位置、output 链接）与冻结结果同时存在
+        buildPeakBytes = memoryBytes() + trie.memoryBytes();
+    }
+
+    // 直接使用 mmap 的索引文件中的数组（索引文件必须比自动机活得久）
+    explicit DenseAhoCorasick(const IndexFile& index) : buildPeakBytes(0) {
+        const IndexHeader& header = index.getHeader();
+        alphabetSize = header.alphabet_size;
+        denseStates = header.dense_states;
+        patternCount = header.pattern_count;
+        index.attach(SECTION_DENSE_GOTO, denseGoto);
+        index.attach(SECTION_EDGE_BEGIN, edgeBegin);
+        index.attach(SECTION_EDGE_LABEL, edgeLabel);
+        index.attach(SECTION_EDGE_TARGET, edgeTarget);
+        index.attach(SECTION_FAIL, fail);
+        index.attach(SECTION_OUTPUT_SLOT, outputSlot);
+        index.attach(SECTION_OUTPUT_BEGIN, outputBegin);
+        index.attach(SECTION_OUTPUTS, outputs);
+        index.attach(SECTION_OUTPUT_LINK, outputLink);
+    }
+
+    // 写入索引文件
+    void save(IndexWriter& writer) const {
+        IndexHeader& header = writer.getHeader();
+        header.alphabet_size = alphabetSize;
+        header.dense_states = denseStates;
+        header.pattern_count = patternCount;
+        writer.writeSection(SECTION_DENSE_GOTO, denseGoto.data(), denseGoto.size());
+        writer.writeSection(SECTION_EDGE_BEGIN, edgeBegin.data(), edgeBegin.size());
+        writer.writeSection(SECTION_EDGE_LABEL, edgeLabel.data(), edgeLabel.size());
+        writer.writeSection(SECTION_EDGE_TARGET, edgeTarget.data(), edgeTarget.size());
+        writer.writeSection(SECTION_FAIL, fail.data(), fail.size());
+        writer.writeSection(SECTION_OUTPUT_SLOT, outputSlot.data(), outputSlot.size());
+        writer.writeSection(SECTION_OUTPUT_BEGIN, outputBegin.data(), outputBegin.size());
+        writer.writeSection(SECTION_OUTPUTS, outputs.data(), outputs.size());
+        writer.writeSection(SECTION_OUTPUT_LINK, outputLink.data(), outputLink.size());
+    }
+
+    // 状态转移：稠密区一次读取；深层状态查找连续边数组，找不到则沿失败指针回退
+    int next(int state, Label c) const {
+        while (state >= denseStates) {
+            int target = findEdge(state, c);
+            if (target != -1) return target;
+            state = fail[state];
+        }
+        return denseGoto[(size_t)state * alphabetSize + c];
+    }
+
+    // 对状态匹配到的所有词条（本状态及 output 链上各状态的 output）调用 visit
+    template<typename Visitor>
+    void visitOutputs(int state, Visitor& visit) const {
+        // 绝大多数状态没有匹配，只需读取一次 outputSlot
+        for (int slot = outputSlot[state]; slot != 0; slot = outputLink[slot]) {
+            for (int j = outputBegin[slot]; j < outputBegin[slot + 1]; j++) {
+                visit(outputs[j]);
+            }
+        }
+    }
+
+    int getPatternCount() const { return patternCount; }
+    size_t getBuildPeakBytes() const { return buildPeakBytes; }
+    size_t getStateCount() const { return fail.size(); }
+    int getDenseStateCount() const { return denseStates; }
+    size_t getEdgeCount() const { return edgeLabel.size(); }  // 稀疏状态以 CSR 存储的边数
+
+    // 自动机占用的字节数（各数组大小之和）
+    size_t memoryBytes() const {
+        return denseGoto.bytes() + edgeBegin.bytes() + edgeLabel.bytes() + edgeTarget.bytes()
+             + fail.bytes() + outputSlot.bytes() + outputBegin.bytes() + outputs.bytes() + outputLink.bytes();
+    }
+};
+
+// ============================================================================
+// UTF-8 解码与码点字母表
+// ============================================================================
+
+// 非法字节映射到 Unicode 范围之外的伪码点，保证任意字节序列都能无歧义地解码
+const uint32_t INVALID_BYTE_BASE = 0x110000;
+const uint32_t CODEPOINT_LIMIT = INVALID_BYTE_BASE + 256;
+
+static inline bool is_utf8_continuation(unsigned char b) {
+    return (b & 0xC0) == 0x80;
+}
+
+// 从 p 解码一个字符（最多读取 avail 字节），返回消耗的字节数
+// 不完整、超长编码、代理区等非法序列只消耗 1 个字节，解码为伪码点 INVALID_BYTE_BASE + 字节值
+static inline size_t decode_utf8(const unsigned char* p, size_t avail, uint32_t& cp) {
+    unsigned char b0 = p[0];
+    if (b0 < 0x80) {
+        cp = b0;
+        return 1;
+    }
+    if (b0 >= 0xC2 && b0 <= 0xDF) {
+        if (avail >= 2 && is_utf8_continuation(p[1])) {
+            cp = ((b0 & 0x1Fu) << 6) | (p[1] & 0x3Fu);
+            return 2;
+        }
+    } else if (b0 >= 0xE0 && b0 <= 0xEF) {
+        if (avail >= 3 && is_utf8_continuation(p[1]) && is_utf8_continuation(p[2])) {
+            uint32_t c = ((b0 & 0x0Fu) << 12) | ((p[1] & 0x3Fu) << 6) | (p[2] & 0x3Fu);
+            if (c >= 0x800 && (c < 0xD800 || c > 0xDFFF)) {
+                cp = c;
+                return 3;
+            }
+        }
+    } else if (b0 >= 0xF0 && b0 <= 0xF4) {
+        if (avail >= 4 && is_utf8_continuation(p[1]) && is_utf8_continuation(p[2]) && is_utf8_continuation(p[3])) {
+            uint32_t c = ((b0 & 0x07u) << 18) | ((p[1] & 0x3Fu) << 12) | ((p[2] & 0x3Fu) << 6) | (p[3] & 0x3Fu);
+            if (c >= 0x10000 && c < INVALID_BYTE_BASE) {
+                cp = c;
+                return 4;
+            }
+        }
+    }
+    cp = INVALID_BYTE_BASE + b0;
+    return 1;
+}
+
+// 把码点编码为 UTF-8 追加到 out（伪码点还原为原来的单个字节）
+static inline void encode_utf8(uint32_t cp, string& out) {
+    if (cp >= INVALID_BYTE_BASE) {
+        out += (char)(cp - INVALID_BYTE_BASE);
+    } else if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// ============================================================================
+// 字符归一化（--normalize）：OpenCC 格式的单字映射表（如 TSCharacters 繁->简）、全角->半角、ASCII 大小写
+// 归一化直接合进码点字母表：被映射的码点与目标码点共用一个符号，扫描循环没有额外开销
+// 词典按归一化后的形式去重，每篇文章对每个归一化形式只计一次
+// ============================================================================
+
+class CharFolding {
+private:
+    unordered_map<uint32_t, uint32_t> table;  // 映射表：码点 -> 码点（只取单字到单字的第一个候选）
+    bool fold_width;                          // 全角 ASCII 和全角空格 -> 半角
+    bool fold_case;                           // A-Z -> a-z
+
+    uint32_t foldOnce(uint32_t cp, bool with_case) const {
+        auto it = table.find(cp);
+        if (it != table.end()) cp = it->second;
+        if (fold_width) {
+            if (cp >= 0xFF01 && cp <= 0xFF5E) cp -= 0xFF01 - 0x21;
+            else if (cp == 0x3000) cp = 0x20;
+        }
+        if (with_case && cp >= 'A' && cp <= 'Z') cp += 'a' - 'A';
+        return cp;
+    }
+
+    // 读取 OpenCC 文本格式的映射表：每行 "源<TAB>目标 [其他候选...]"
+    bool loadTable(const string& path, string& error) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) {
+            error = "cannot open " + path;
+            return false;
+        }
+        string line;
+        size_t skipped = 0;
+        size_t loaded = 0;
+        while (getline(file, line)) {
+            if (loaded == 0 && skipped == 0 && line.compare(0, 13, "OPENCC_MARISA") == 0) {
+                error = path + " is a binary ocd2 dictionary, convert it first: "
+                        "opencc_dict -i TSCharacters.ocd2 -o TSCharacters.txt -f ocd2 -t text";
+                return false;
+            }
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            size_t tab = line.find('\t');
+            if (tab == string::npos) continue;
+            size_t value_end = line.find(' ', tab + 1);
+            if (value_end == string::npos) value_end = line.size();
+
+            const unsigned char* key = (const unsigned char*)line.data();
+            const unsigned char* value = key + tab + 1;
+            size_t value_len = value_end - tab - 1;
+            uint32_t from, to;
+            if (tab == 0 || value_len == 0
+                || decode_utf8(key, tab, from) != tab || decode_utf8(value, value_len, to) != value_len) {
+                skipped++;  // 词组映射无法逐字替换，跳过
+                continue;
+            }
+            if (from != to) {
+                table.emplace(from, to);
+            }
+            loaded++;
+        }
+        cout << "Normalization table: " << path << " (" << table.size() << " mappings, "
+             << skipped << " phrase entries skipped)" << endl;
+        return true;
+    }
+
+public:
+    CharFolding() : fold_width(false), fold_case(false) {}
+
+    // spec 为逗号分隔的列表：width、case 或映射表文件路径
+    bool load(const string& spec, string& error) {
+        size_t begin = 0;
+        while (begin <= spec.size()) {
+            size_t end = spec.find(',', begin);
+            if (end == string::npos) end = spec.size();
+            string item = spec.substr(begin, end - begin);
+            if (item == "width") {
+                fold_width = true;
+            } else if (item == "case") {
+                fold_case = true;
+            } else if (!item.empty() && !loadTable(item, error)) {
+                return false;
+            }
+            begin = end + 1;
+        }
+        return true;
+    }
+
+    // 归一化一个码点，重复应用直到不再变化，保证结果再归一化时不变
+    uint32_t fold(uint32_t cp, bool with_case = true) const {
+        for (int i = 0; i < 8; i++) {
+            uint32_t next = foldOnce(cp, with_case);
+            if (next == cp) break;
+            cp = next;
+        }
+        return cp;
+    }
+
+    // 归一化一个字符串；with_case 为 false 时不做大小写折叠（用于输出的词条）
+    string apply(const string& text, bool with_case = true) const {
+        string out;
+        out.reserve(text.size());
+        const unsigned char* p = (const unsigned char*)text.data();
+        for (size_t pos = 0; pos < text.size(); ) {
+            uint32_t cp;
+            pos += decode_utf8(p + pos, text.size() - pos, cp);
+            encode_utf8(fold(cp, with_case), out);
+        }
+        return out;
+    }
+
+    // 对每个会被改变的码点调用 visit(源码点, 归一化后的码点)
+    template<typename Visitor>
+    void forEachMapping(Visitor&& visit) const {
+        for (const auto& entry : table) {
+            if (fold(entry.first) != entry.first) visit(entry.first, fold(entry.first));
+        }
+        auto visit_range = [&](uint32_t first, uint32_t last) {
+            for (uint32_t cp = first; cp <= last; cp++) {
+                if (table.count(cp) == 0 && fold(cp) != cp) visit(cp, fold(cp));
+            }
+        };
+        if (fold_width) {
+            visit_range(0xFF01, 0xFF5E);
+            visit_range(0x3000, 0x3000);
+        }
+        if (fold_case) {
+            visit_range('A', 'Z');
+        }
+    }
+
+    // 归一化规则的指纹，记录在预编译索引中
+    uint64_t fingerprint() const {
+        vector<pair<uint32_t, uint32_t>> entries(table.begin(), table.end());
+        sort(entries.begin(), entries.end());
+        uint64_t hash = HASH_SEED;
+        unsigned char flags[2] = { (unsigned char)fold_width, (unsigned char)fold_case };
+        hash = hash_bytes((const char*)flags, sizeof(flags), hash);
+        return hash_bytes((const char*)entries.data(), entries.size() * sizeof(entries[0]), hash);
+    }
+};
+
+// 码点 -> 稠密符号 ID 的映射，只包含词典实际用到的字符
+// 符号 0 为“其他”：词典中没有出现的字符，扫描时直接回到根节点
+// 两级表：按 256 个码点分页，只为出现过的页分配空间（CJK 词典约 100 页，约 100 KB）
+class Utf8Alphabet {
+private:
+    static const uint32_t PAGE_BITS = 8;
+    static const uint32_t PAGE_SIZE = 1u << PAGE_BITS;
+
+    ArrayRef<int> pageOffset;            // 页号 -> pages 中的起始位置，0 为共享的全零页
+    ArrayRef<int> pages;                 // 各页的符号表
+    int symbolCount;                     // 符号数（含符号 0）
+
+public:
+    Utf8Alphabet() : symbolCount(1) {}
+
+    // 根据码点出现次数分配符号：出现次数多的字符 ID 更小，稠密行更集中
+    // 有归一化规则时，codepoint_counts 中是归一化后的码点，被映射的码点再指向目标码点的符号
+    void build(const vector<pair<uint32_t, size_t>>& codepoint_counts, const CharFolding* folding = nullptr) {
+        vector<int> pageOffset(CODEPOINT_LIMIT >> PAGE_BITS, 0);
+        vector<int> pages(PAGE_SIZE, 0);
+        symbolCount = 1;
+        vector<pair<uint32_t, size_t>> sorted = codepoint_counts;
+        sort(sorted.begin(), sorted.end(), [](const pair<uint32_t, size_t>& a, const pair<uint32_t, size_t>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        for (const auto& item : sorted) {
+            uint32_t page = item.first >> PAGE_BITS;
+            if (pageOffset[page] == 0) {
+                pageOffset[page] = (int)pages.size();
+                pages.resize(pages.size() + PAGE_SIZE, 0);
+            }
+            pages[pageOffset[page] + (item.first & (PAGE_SIZE - 1))] = symbolCount++;
+        }
+        if (folding) {
+            auto lookup = [&](uint32_t cp) { return pages[pageOffset[cp >> PAGE_BITS] + (cp & (PAGE_SIZE - 1))]; };
+            folding->forEachMapping([&](uint32_t from, uint32_t to) {
+                int symbol = lookup(to);
+                if (symbol == 0) return;
+                uint32_t page = from >> PAGE_BITS;
+                if (pageOffset[page] == 0) {
+                    pageOffset[page] = (int)pages.size();
+                    pages.resize(pages.size() + PAGE_SIZE, 0);
+                }
+                pages[pageOffset[page] + (from & (PAGE_SIZE - 1))] = symbol;
+            });
+        }
+        this->pageOffset.assign(move(pageOffset));
+        this->pages.assign(move(pages));
+    }
+
+    void load(const IndexFile& index) {
+        symbolCount = index.getHeader().symbol_count;
+        index.attach(SECTION_ALPHABET_PAGE_OFFSET, pageOffset);
+        index.attach(SECTION_ALPHABET_PAGES, pages);
+    }
+
+    void save(IndexWriter& writer) const {
+        writer.getHeader().symbol_count = symbolCount;
+        writer.writeSection(SECTION_ALPHABET_PAGE_OFFSET, pageOffset.data(), pageOffset.size());
+        writer.writeSection(SECTION_ALPHABET_PAGES, pages.data(), pages.size());
+    }
+
+    int symbolOf(uint32_t cp) const {
+        return pages[pageOffset[cp >> PAGE_BITS] + (cp & (PAGE_SIZE - 1))];
+    }
+
+    int size() const { return symbolCount; }
+
+    size_t memoryBytes() const {
+        return pageOffset.bytes() + pages.bytes();
+    }
+};
+
+// ============================================================================
+// 码点字母表 AC 自动机
+// 扫描时只解码一次 UTF-8，在以稠密符号 ID 为边的字典树上转移：
+// 每个汉字只需一次转移，字典树深度约为字节自动机的 1/3
+// 对合法 UTF-8 的词条，匹配结果与字节自动机完全一致
+// ============================================================================
+
+class CodepointAhoCorasick {
+private:
+    Utf8Alphabet alphabet;
+    unique_ptr<DenseAhoCorasick<int>> automaton;
+    size_t trieNodes;
+    size_t buildPeakBytes;  // 构建过程中的内存峰值（冻结时字典树与冻结结果同时存在）
+
+public:
+    CodepointAhoCorasick(const WordList& words, size_t start, size_t end, const CharFolding* folding = nullptr,
+                         int threads = 1)
+        : trieNodes(0), buildPeakBytes(0) {
+        // 1. 统计词典用到的字符（归一化后），建立字母表
+        vector<size_t> counts;
+        vector<uint32_t> used;
+        {
+            vector<uint32_t> seen_index(CODEPOINT_LIMIT, 0);  // 码点 -> used 中的位置 + 1
+            for (size_t i = start; i < end; i++) {
+                const unsigned char* p = (const unsigned char*)words[i].data();
+                size_t len = words[i].size();
+                for (size_t pos = 0; pos < len; ) {
+                    uint32_t cp;
+                    pos += decode_utf8(p + pos, len - pos, cp);
+                    if (folding) cp = folding->fold(cp);
+                    if (seen_index[cp] == 0) {
+                        used.push_back(cp);
+                        counts.push_back(0);
+                        seen_index[cp] = (uint32_t)used.size();
+                    }
+                    counts[seen_index[cp] - 1]++;
+                }
+            }
+        }
+        vector<pair<uint32_t, size_t>> codepoint_counts;
+        codepoint_counts.reserve(used.size());
+        for (size_t i = 0; i < used.size(); i++) {
+            codepoint_counts.push_back(make_pair(used[i], counts[i]));
+        }
+        alphabet.build(codepoint_counts, folding);
+
+        // 2. 把词条转换为符号序列，依次存放在一个数组中（归一化已包含在字母表中）
+        size_t count = end - start;
+        vector<int> symbols;
+        vector<size_t> symbolBegin(count + 1);
+        for (size_t i = 0; i < count; i++) {
+            const unsigned char* p = (const unsigned char*)words[start + i].data();
+            size_t len = words[start + i].size();
+            symbolBegin[i] = symbols.size();
+            for (size_t pos = 0; pos < len; ) {
+                uint32_t cp;
+                pos += decode_utf8(p + pos, len - pos, cp);
+                symbols.push_back(alphabet.symbolOf(cp));
+            }
+        }
+        symbolBegin[count] = symbols.size();
+        size_t symbolBytes = symbols.capacity() * sizeof(int) + symbolBegin.size() * sizeof(size_t);
+
+        // 3. 批量构建平铺字典树和失败指针，然后冻结
+        FlatTrie<int> trie = FlatTrie<int>::build(count, [&](size_t i) {
+            return make_pair((const int*)symbols.data() + symbolBegin[i], symbolBegin[i + 1] - symbolBegin[i]);
+        }, threads);
+        size_t triePeak = symbolBytes + trie.buildPeakBytes;
+        vector<int>().swap(symbols);
+        vector<size_t>().swap(symbolBegin);
+        trieNodes = trie.stateCount();
+        automaton.reset(new DenseAhoCorasick<int>(move(trie), alphabet.size()));
+        buildPeakBytes = max(triePeak, alphabet.memoryBytes() + automaton->getBuildPeakBytes());
+    }
+
+    explicit CodepointAhoCorasick(const IndexFile& index) : trieNodes(0), buildPeakBytes(0) {
+        alphabet.load(index);
+        automaton.reset(new DenseAhoCorasick<int>(index));
+        trieNodes = automaton->getStateCount();
+    }
+
+    void save(IndexWriter& writer) const {
+        alphabet.save(writer);
+        automaton->save(writer);
+    }
+
+    // 搜索文本，语义与 AhoCorasick::search 一致
+    template<typename Visitor>
+    void search(const char* text, size_t length, Visitor&& visit) const {
+        const unsigned char* p = (const unsigned char*)text;
+        int current = 0;
+
+        for (size_t i = 0; i < length; ) {
+            uint32_t cp;
+            i += decode_utf8(p + i, length - i, cp);
+            int symbol = alphabet.symbolOf(cp);
+            // 词典中没有的字符：任何词条都不可能跨过它，直接回到根节点
+            current = symbol == 0 ? 0 : automaton->next(current, (unsigned)symbol);
+            automaton->visitOutputs(current, visit);
+        }
+    }
+
+    size_t getStateCount() const { return automaton->getStateCount(); }
+    int getDenseStateCount() const { return automaton->getDenseStateCount(); }
+    size_t getEdgeCount() const { return automaton->getEdgeCount(); }
+    int getAlphabetSize() const { return alphabet.size(); }
+
+    size_t memoryBytes() const {
+        return alphabet.memoryBytes() + automaton->memoryBytes();
+    }
+
+    size_t getBuildPeakBytes() const { return buildPeakBytes; }
+};
+
+// ============================================================================
+// 全局变量
+// ============================================================================
+
+mutex file_mutex;
+mutex cout_mutex;
+
+// 扫描引擎（取值写入索引头部，保持不变；0 曾是已移除的按字节的 dense 引擎）
+enum class SearchEngine {
+    Codepoint = 1,  // 按 UTF-8 码点建树的稠密自动机（默认，bench 中扫描最快）
+    Classic = 2,    // 原始 AhoCorasick（二分查找子节点），作为回退
+};
+
+static const char* engine_name(SearchEngine engine) {
+    switch (engine) {
+        case SearchEngine::Codepoint: return "codepoint";
+        default: return "classic";
+    }
+}
+
+// 输出的统计列（--columns），按指定的顺序输出在词条之后
+// 文章数总是统计（决定词条是否输出），其余各列只在选择时统计
+enum class StatColumn {
+    DocFreq,        // df：出现的文章（行）数（默认）
+    Total,          // total：出现的总次数
+    MaxPerArticle,  // max：单篇文章中出现的最多次数
+    FirstArticle,   // first：第一次出现的文章的行号（从 1 开始，多个输入时连续编号）
+};
+
+// 统计列掩码（DocumentCounter 的模板参数）
+const unsigned STAT_TOTAL = 1;
+const unsigned STAT_MAX = 2;
+const unsigned STAT_FIRST = 4;
+const unsigned STAT_MASK_COUNT = 8;
+
+static const char* stat_column_name(StatColumn column) {
+    switch (column) {
+        case StatColumn::Total: return "total";
+        case StatColumn::MaxPerArticle: return "max";
+        case StatColumn::FirstArticle: return "first";
+        default: return "df";
+    }
+}
+
+static unsigned stat_mask(const vector<StatColumn>& columns) {
+    unsigned mask = 0;
+    for (StatColumn column : columns) {
+        switch (column) {
+            case StatColumn::Total: mask |= STAT_TOTAL; break;
+            case StatColumn::MaxPerArticle: mask |= STAT_MAX; break;
+            case StatColumn::FirstArticle: mask |= STAT_FIRST; break;
+            default: break;
+        }
+    }
+    return mask;
+}
+
+// 解析 --columns 的列表（如 "df,total,max"），失败时返回 false 并给出原因
+static bool parse_stat_columns(const string& spec, vector<StatColumn>& columns, string& error) {
+    const StatColumn all[] = { StatColumn::DocFreq, StatColumn::Total, StatColumn::MaxPerArticle, StatColumn::FirstArticle };
+    columns.clear();
+    stringstream stream(spec);
+    string name;
+    while (getline(stream, name, ',')) {
+        bool found = false;
+        for (StatColumn column : all) {
+            if (name == stat_column_name(column)) {
+                if (find(columns.begin(), columns.end(), column) != columns.end()) {
+                    error = "duplicate column " + name;
+                    return false;
+                }
+                columns.push_back(column);
+                found = true;
+            }
+        }
+        if (!found) {
+            error = "unknown column '" + name + "' (expected df, total, max or first)";
+            return false;
+        }
+    }
+    if (columns.empty()) {
+        error = "no columns given";
+        return false;
+    }
+    return true;
+}
+
+// 多线程的划分方式
+enum class ParallelSplit {
+    Dictionary,  // 按词典划分批次，每个线程构建自己的自动机并扫描整个文本（默认）
+    Corpus,      // 所有线程共享一个自动机，按行对齐的切片划分文本
+};
+
+// 词典需要多个批次时的扫描顺序
+enum class ScanSchedule {
+    Auto,   // 按内存预算和预计读盘量自动选择（默认）
+    Batch,  // 批次优先：每个批次构建自动机后把语料完整扫描一遍
+    Chunk,  // 分块优先：先构建所有批次的自动机，语料只读一遍，每个切片依次交给所有自动机扫描
+};
+
+class RunTelemetry;
+
+// 命令行选项
+struct FilterOptions {
+    SearchEngine engine = SearchEngine::Codepoint;
+    ParallelSplit split = ParallelSplit::Dictionary;
+    string index_path;  // 预编译索引文件（compile 模式生成），为空时从词典构建
+    string output_path; // 输出文件，为空时按输入文件自动命名
+    bool per_shard = false;  // 输出合计之外，再按输入分片各输出一列
+    string partial_path;     // 另外写出按词条编号存储的二进制部分结果，供 merge 合并
+    string dict_path;        // merge 模式：解析二进制部分结果所用的词典
+    long long threshold = 0; // merge 模式：词频大于该值的词条写入 .txt
+    shared_ptr<CharFolding> folding;  // --normalize 的归一化规则，为空时不做归一化
+    shared_ptr<RunTelemetry> telemetry;  // --metrics-json / --trace / --perf-counters，为空时不记录
+    int build_threads = 0;   // 构建自动机的线程数（--build-threads），0 为自动：与扫描线程数相同，compile 使用全部核心
+    vector<StatColumn> columns = { StatColumn::DocFreq };  // 输出的统计列（--columns）
+    double checkpoint_interval = 300;  // 写检查点的间隔秒数（--checkpoint-interval），0 为不写
+    bool resume = false;               // 从输出文件旁的检查点继续（--resume）
+    string cache_path;                 // 结果缓存文件（--cache）
+    int readahead = 2;                 // 放不进内存时每个扫描线程驻留的分块数（--readahead），1 为不预读
+    ScanSchedule schedule = ScanSchedule::Auto;  // 多个批次时的扫描顺序（--schedule）
+};
+
+// 批次处理的词条范围
+struct BatchRange {
+    size_t start;
+    size_t end;
+};
+
+// 分块边界信息（不存储数据，只存储偏移）
+struct ChunkBoundary {
+    size_t start_offset;    // 分块在文件中的起始偏移
+    size_t end_offset;      // 分块在文件中的结束偏移
+    size_t line_count;      // 该分块的行数
+    size_t first_line;      // 该分块第一行的全局行号
+};
+
+// 流式文件加载器 - 内存映射版本
+// 整个文件以只读方式 mmap，所有线程、所有批次共享同一份映射，回调直接拿到 (const char*, len) 视图，不复制也不修改数据
+// 读取由页缓存负责：按分块 madvise(WILLNEED) 预读（扫描时由 ChunkReadahead 的 I/O 线程提前读入），
+// 分块处理完后 madvise(DONTNEED) 释放本进程的驻留页，驻留内存大致限制在预读的几个分块以内
+// （文件能放进内存时只有一个分块，始终保持驻留）
+// 分块内部再按行切成较小的切片，供多个线程共享一个自动机并行扫描
+class StreamingFileLoader {
+private:
+    string file_path;
+    size_t chunk_size;
+    size_t slice_size;
+    size_t total_lines;
+    size_t file_size;
+    vector<ChunkBoundary> boundaries;  // 分块边界信息
+    vector<ChunkBoundary> slices;      // 按行对齐的切片（不跨分块）
+    vector<size_t> slice_chunk;        // 每个切片所属的分块
+    const char* mapped;                // 只读映射的文件内容
+    int fd;
+
+    // 对 [offset, offset + bytes) 所在的页调用 madvise
+    void adviseRange(size_t offset, size_t bytes, int advice) const {
+        if (!mapped || bytes == 0) return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = offset / page * page;
+        madvise((void*)(mapped + begin), offset + bytes - begin, advice);
+    }
+
+    // 从 pos 开始找到下一行的起始位置（不超过 limit）
+    size_t nextLineStart(size_t pos, size_t limit) const {
+        if (pos >= limit) return limit;
+        if (pos > 0 && mapped[pos - 1] == '\n') return pos;
+        const char* newline = (const char*)memchr(mapped + pos, '\n', limit - pos);
+        return newline ? (size_t)(newline - mapped) + 1 : limit;
+    }
+
+public:
+    // 处理 [data, data + bytes) 中的每一行，返回 false 表示回调要求停止
+    // 末尾没有换行符的内容（文件最后一行）同样作为一行处理
+    template<typename Callback>
+    static bool processLines(const char* data, size_t bytes, size_t chunk_idx, size_t first_line, Callback& callback) {
+        size_t line_no = first_line;
+        const char* line_start = data;
+        const char* end = data + bytes;
+        while (line_start < end) {
+            const char* newline = (const char*)memchr(line_start, '\n', end - line_start);
+            const char* line_end = newline ? newline : end;
+            size_t line_len = line_end - line_start;
+            if (line_len > 0) {
+                if (!callback(line_start, line_len, chunk_idx, line_no)) {
+                    return false;
+                }
+            }
+            line_no++;
+            line_start = line_end + 1;
+        }
+        return true;
+    }
+
+    // 统计 [data, data + bytes) 中的行数（末尾不完整的一行也算一行）
+    static size_t countLines(const char* data, size_t bytes) {
+        size_t lines = 0;
+        const char* p = data;
+        const char* end = data + bytes;
+        while (p < end) {
+            const char* newline = (const char*)memchr(p, '\n', end - p);
+            lines++;
+            if (!newline) break;
+            p = newline + 1;
+        }
+        return lines;
+    }
+
+    StreamingFileLoader(const string& path, size_t chunk_bytes = 200 * 1024 * 1024, size_t slice_bytes = 8 * 1024 * 1024)
+        : file_path(path), chunk_size(chunk_bytes), slice_size(slice_bytes), total_lines(0), file_size(0),
+          mapped(nullptr), fd(-1) {}
+
+    ~StreamingFileLoader() {
+        if (mapped) munmap((void*)mapped, file_size);
+        if (fd >= 0) close(fd);
+    }
+
+    StreamingFileLoader(const StreamingFileLoader&) = delete;
+    StreamingFileLoader& operator=(const StreamingFileLoader&) = delete;
+
+    // 映射文件并记录分块、切片边界（只扫描换行符，不复制内容）
+    bool scanBoundaries() {
+        fd = open(file_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error opening file: " << file_path << endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            cerr << "Error reading file size: " << file_path << endl;
+            return false;
+        }
+        file_size = (size_t)st.st_size;
+
+        cout << "Scanning file: " << file_path << " (" << file_size << " bytes)" << endl;
+
+        if (file_size > 0) {
+            void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                cerr << "Error mapping file: " << file_path << " (" << strerror(errno) << ")" << endl;
+                return false;
+            }
+            mapped = (const char*)addr;
+            madvise(addr, file_size, MADV_SEQUENTIAL);
+        }
+
+        size_t current_offset = 0;
         size_t chunk_id = 0;
 
-        while (current_offset < file_size) {
-            size_t read_size = min(chunk_size, file_size - current_offset);
-            file.read(buffer.data(), read_size);
-            size_t actual_read = file.gcount();
-
-            if (actual_read == 0) break;
-
-            // 如果不是最后一块，找到最后一个换行符
-            size_t chunk_end = actual_read;
-            if (current_offset + actual_read < file_size) {
-                for (int i = actual_read - 1; i >= 0; i--) {
-                    if (buffer[i] == '\n') {
-                        chunk_end = i + 1;
-                        break;
-                    }
-                }
-            }
+        while (current_offset < file_size) {
+            // 分块在 chunk_size 之后的第一个换行处结束
+            size_t chunk_end = nextLineStart(min(current_offset + chunk_size, file_size), file_size);
+
+            // 按 slice_size 切成按行对齐的切片，同时统计行数
+            size_t lines = 0;
+            size_t slice_start = current_offset;
+            while (slice_start < chunk_end) {
+                size_t slice_end = nextLineStart(min(slice_start + slice_size, chunk_end), chunk_end);
+                size_t slice_lines = countLines(mapped + slice_start, slice_end - slice_start);
+
+                ChunkBoundary slice;
+                slice.start_offset = slice_start;
+                slice.end_offset = slice_end;
+                slice.line_count = slice_lines;
+                slice.first_line = total_lines + lines;
+                slices.push_back(slice);
+                slice_chunk.push_back(chunk_id);
+
+                lines += slice_lines;
+                slice_start = slice_end;
+            }
+
+            // 记录边界信息
+            ChunkBoundary boundary;
+            boundary.start_offset = current_offset;
+            boundary.end_offset = chunk_end;
+            boundary.line_count = lines;
+            boundary.first_line = total_lines;
+            boundaries.push_back(boundary);
+
+            total_lines += lines;
+            chunk_id++;
+
+            cout << "  Chunk " << chunk_id << ": "
+                 << (chunk_end - current_offset) / (1024 * 1024) << " MB, "
+                 << lines << " lines" << endl;
+
+            // 扫描完的分块不再占用本进程的驻留内存（页缓存仍保留）
+            if (chunk_end < file_size) {
+                adviseRange(current_offset, chunk_end - current_offset, MADV_DONTNEED);
+            }
+
+            // 移动到下一个分块
+            current_offset = chunk_end;
+        }
+
+        cout << "Total lines: " << total_lines << ", chunks: " << boundaries.size()
+             << ", slices: " << slices.size() << endl;
+        return true;
+    }
+
+    // 获取文件路径
+    const string& getPath() const { return file_path; }
+
+    // 获取总行数
+    size_t getLineCount() const { return total_lines; }
+
+    // 获取文件大小
+    size_t getFileSize() const { return file_size; }
+
+    // 获取分块数量
+    size_t getChunkCount() const { return boundaries.size(); }
+
+    // 获取切片数量
+    size_t getSliceCount() const { return slices.size(); }
+
+    // 切片第一行的行号
+    size_t getSliceFirstLine(size_t slice_idx) const { return slices[slice_idx].first_line; }
+
+    // 切片所属的分块
+    size_t getSliceChunk(size_t slice_idx) const { return slice_chunk[slice_idx]; }
+
+    // 分块之后第一行的行号（from_line 不小于它时整块跳过）
+    size_t getChunkEndLine(size_t chunk_idx) const {
+        return boundaries[chunk_idx].first_line + boundaries[chunk_idx].line_count;
+    }
+
+    // 处理单个分块中的所有行，返回 false 表示回调要求停止
+    template<typename Callback>
+    bool processChunk(size_t chunk_idx, Callback& callback) const {
+        const auto& boundary = boundaries[chunk_idx];
+        return processLines(mapped + boundary.start_offset, boundary.end_offset - boundary.start_offset,
+                            chunk_idx, boundary.first_line, callback);
+    }
+
+    // 把分块读入本进程的映射，读完才返回（由预读线程调用）
+    // 优先用 MADV_POPULATE_READ（Linux 5.14+）一次完成，内核不支持时每页读一个字节
+    void populateChunk(size_t chunk_idx) const {
+        const auto& boundary = boundaries[chunk_idx];
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = boundary.start_offset / page * page;
+        size_t end = boundary.end_offset;
+        if (!mapped || end <= begin) return;
+        if (madvise((void*)(mapped + begin), end - begin, MADV_POPULATE_READ) == 0) return;
+        volatile unsigned char sink = 0;
+        for (size_t offset = begin; offset < end; offset += page) {
+            sink += (unsigned char)mapped[offset];
+        }
+        (void)sink;
+    }
+
+    // 释放分块的驻留页（页缓存仍保留）
+    void releaseChunk(size_t chunk_idx) const {
+        const auto& boundary = boundaries[chunk_idx];
+        adviseRange(boundary.start_offset, boundary.end_offset - boundary.start_offset, MADV_DONTNEED);
+    }
+
+    // 处理单个切片中的所有行（可被多个线程并发调用）
+    // 回调参数与 streamProcess 相同，第三个参数为切片索引
+    template<typename Callback>
+    void processSlice(size_t slice_idx, Callback callback) const {
+        const auto& slice = slices[slice_idx];
+        processLines(mapped + slice.start_offset, slice.end_offset - slice.start_offset,
+                     slice_idx, slice.first_line, callback);
+    }
+
+    // 流式处理所有行：预读下一个分块，处理完的分块释放驻留内存
+    // from_line 之前的分块整块跳过（续跑时使用），同一分块中更早的行仍会交给回调
+    template<typename Callback>
+    void streamProcess(Callback callback, size_t from_line = 0) const {
+        for (size_t chunk_idx = 0; chunk_idx < boundaries.size(); chunk_idx++) {
+            if (getChunkEndLine(chunk_idx) <= from_line) continue;
+
+            if (chunk_idx + 1 < boundaries.size()) {
+                const auto& next = boundaries[chunk_idx + 1];
+                adviseRange(next.start_offset, next.end_offset - next.start_offset, MADV_WILLNEED);
+            }
+
+            bool keep_going = processChunk(chunk_idx, callback);
+
+            if (boundaries.size() > 1) {
+                releaseChunk(chunk_idx);
+            }
+            if (!keep_going) return;
+        }
+    }
+
+    // 获取单个分块的内存占用估算
+    size_t getChunkMemoryMB() const {
+        if (boundaries.empty()) return 0;
+        size_t max_chunk = 0;
+        for (const auto& b : boundaries) {
+            size_t chunk_size = b.end_offset - b.start_offset;
+            if (chunk_size > max_chunk) max_chunk = chunk_size;
+        }
+        return max_chunk / (1024 * 1024);
+    }
+
+    // 整个文件只有一个分块时，提前让内核把文件读入页缓存
+    void prefetchEntireFile() const {
+        if (boundaries.size() == 1) {
+            adviseRange(0, file_size, MADV_WILLNEED);
+        }
+    }
+
+    // 释放本进程对整个映射的驻留页（页缓存仍保留）
+    void release() const {
+        adviseRange(0, file_size, MADV_DONTNEED);
+    }
+};
+
+// ============================================================================
+// 分块预读：所有输入放不进内存时，由一个专门的 I/O 线程提前把后面的分块读入映射，
+// 扫描线程处理当前分块时下一个分块已经在读（双缓冲，--readahead=3 时为三缓冲）
+// 所有扫描线程的预读请求都交给这一个线程按提交顺序完成，磁盘上同一时间只有一处顺序读，
+// 不会因为多个线程同时缺页而在不同位置来回寻道；扫描线程只在分块还没读完时等待
+// ============================================================================
+
+class ChunkReadahead {
+public:
+    // 一个分块的预读请求，读完后 done 置为 true
+    struct Request {
+        const StreamingFileLoader* loader;
+        size_t chunk;
+        bool done;
+    };
+    typedef shared_ptr<Request> Ticket;
+
+private:
+    deque<Ticket> pending;
+    mutex queue_mutex;
+    condition_variable work_cv;
+    condition_variable done_cv;
+    bool stopping;
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> lock(queue_mutex);
+        while (true) {
+            work_cv.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) return;
+            Ticket request = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            request->loader->populateChunk(request->chunk);
+            lock.lock();
+            request->done = true;
+            done_cv.notify_all();
+        }
+    }
+
+public:
+    ChunkReadahead() : stopping(false) {
+        worker = thread(&ChunkReadahead::run, this);
+    }
+
+    ~ChunkReadahead() {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        worker.join();
+    }
+
+    ChunkReadahead(const ChunkReadahead&) = delete;
+    ChunkReadahead& operator=(const ChunkReadahead&) = delete;
+
+    // 提交一个分块的预读
+    Ticket submit(const StreamingFileLoader& loader, size_t chunk) {
+        Ticket request(new Request{ &loader, chunk, false });
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            pending.push_back(request);
+        }
+        work_cv.notify_one();
+        return request;
+    }
+
+    // 等待请求读完，返回等待的秒数
+    double wait(const Ticket& request) {
+        unique_lock<mutex> lock(queue_mutex);
+        if (request->done) return 0.0;
+        auto start = chrono::steady_clock::now();
+        done_cv.wait(lock, [&request] { return request->done; });
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+// 一个扫描线程顺序处理分块时的预读窗口：已提交预读、还没处理的分块（全局编号），以及累计的等待时间
+struct ReadaheadWindow {
+    deque<pair<size_t, ChunkReadahead::Ticket>> tickets;
+    double wait_seconds = 0.0;
+};
+
+// ============================================================================
+// 流式输入：标准输入（"-"）和 zstd / gzip / xz 压缩文件
+// 解压交给外部命令（zstd -dc 等）通过管道完成，不增加链接依赖；流不能回退，只能读一遍
+// 读取线程把数据切成按行对齐的数据块放入有界的环，扫描线程从环中领取，扫描完后归还重新填充
+// ============================================================================
+
+// 解压命令，按文件头的魔数识别，不是压缩文件时返回 nullptr
+static const char* decompress_command(const string& path) {
+    unsigned char magic[6] = {};
+    ifstream file(path, ios::binary);
+    file.read((char*)magic, sizeof(magic));
+    size_t n = (size_t)file.gcount();
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) return "zstd -dc";
+    if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) return "gzip -dc";
+    if (n >= 6 && memcmp(magic, "\xFD" "7zXZ\0", 6) == 0) return "xz -dc";
+    return nullptr;
+}
+
+// 输入是否只能按流读取（标准输入或压缩文件）
+static bool is_stream_input(const string& path) {
+    return path == "-" || decompress_command(path) != nullptr;
+}
+
+// 打开输入流：标准输入、解压命令的管道或普通文件
+static FILE* open_input_stream(const string& path, bool& is_pipe) {
+    is_pipe = false;
+    if (path == "-") return stdin;
+    const char* command = decompress_command(path);
+    if (!command) return fopen(path.c_str(), "rb");
+
+    // 路径放进单引号，内部的单引号写成 '\''
+    string quoted = "'";
+    for (char c : path) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    quoted += "'";
+    is_pipe = true;
+    return popen((string(command) + " -- " + quoted).c_str(), "r");
+}
+
+// 环中的一个数据块：只包含完整的行
+struct StreamBlock {
+    vector<char> data;
+    size_t size;        // 有效字节数
+    size_t shard;       // 所属输入的序号
+    size_t first_line;  // 第一行的行号（从读取开始连续编号）
+};
+
+class StreamReader {
+private:
+    vector<string> paths;
+    size_t shard_begin;
+    size_t shard_end;
+    size_t block_size;
+    vector<unique_ptr<StreamBlock>> blocks;  // 环中的全部数据块
+    queue<StreamBlock*> ready;               // 已填充、等待扫描
+    vector<StreamBlock*> free_blocks;        // 已扫描、可以重新填充
+    mutex queue_mutex;
+    condition_variable ready_cv;
+    condition_variable free_cv;
+    bool finished;
+    bool failed;
+    size_t line_count;                       // 读取的总行数（读取线程结束后有效）
+    double wait_seconds;                     // 扫描线程在 acquire 中等待数据块的时间之和
+    thread reader;
+
+    StreamBlock* takeFreeBlock() {
+        unique_lock<mutex> lock(queue_mutex);
+        free_cv.wait(lock, [this] { return !free_blocks.empty(); });
+        StreamBlock* block = free_blocks.back();
+        free_blocks.pop_back();
+        return block;
+    }
+
+    void publish(StreamBlock* block) {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            ready.push(block);
+        }
+        ready_cv.notify_one();
+    }
+
+    // 读取一个输入，按行对齐切成数据块；返回 false 表示读取或解压失败
+    bool readShard(size_t shard, size_t& line_no) {
+        const string& path = paths[shard];
+        bool is_pipe = false;
+        FILE* input = open_input_stream(path, is_pipe);
+        if (!input) {
+            cerr << "Error opening file: " << path << endl;
+            return false;
+        }
+
+        string carry;  // 上一块末尾不完整的行
+        bool eof = false;
+        while (!eof) {
+            StreamBlock* block = takeFreeBlock();
+            block->data.resize(max(block->data.size(), carry.size() + block_size));
+            memcpy(block->data.data(), carry.data(), carry.size());
+            size_t size = carry.size();
+            carry.clear();
+
+            while (size < block->data.size()) {
+                size_t n = fread(block->data.data() + size, 1, block->data.size() - size, input);
+                if (n == 0) {
+                    eof = true;
+                    break;
+                }
+                size += n;
+            }
+
+            // 最后一个换行之后的内容留给下一块；一行比数据块还长时扩大数据块继续读
+            if (!eof) {
+                const char* last = (const char*)memrchr(block->data.data(), '\n', size);
+                size_t keep = last ? (size_t)(last - block->data.data()) + 1 : 0;
+                carry.assign(block->data.data() + keep, size - keep);
+                size = keep;
+            }
+
+            if (size == 0) {
+                recycle(block);
+                continue;
+            }
+            block->size = size;
+            block->shard = shard;
+            block->first_line = line_no;
+            line_no += StreamingFileLoader::countLines(block->data.data(), size);
+            publish(block);
+        }
+
+        bool ok = !ferror(input);
+        if (is_pipe) {
+            int status = pclose(input);
+            if (status != 0) {
+                cerr << "Error reading " << path << ": decompressor exited with status "
+                     << (WIFEXITED(status) ? WEXITSTATUS(status) : status) << endl;
+                ok = false;
+            }
+        } else if (input != stdin) {
+            fclose(input);
+        }
+        if (!ok) {
+            cerr << "Error reading file: " << path << endl;
+        }
+        return ok;
+    }
+
+    void run() {
+        size_t line_no = 0;
+        for (size_t shard = shard_begin; shard < shard_end; shard++) {
+            if (!readShard(shard, line_no)) {
+                failed = true;
+                break;
+            }
+        }
+        line_count = line_no;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            finished = true;
+        }
+        ready_cv.notify_all();
+    }
+
+public:
+    // 依次读取 paths[begin, end)，环中共有 ring_blocks 个数据块
+    StreamReader(const vector<string>& input_paths, size_t begin, size_t end, size_t block_bytes, size_t ring_blocks)
+        : paths(input_paths), shard_begin(begin), shard_end(end), block_size(block_bytes),
+          finished(false), failed(false), line_count(0), wait_seconds(0.0) {
+        for (size_t i = 0; i < ring_blocks; i++) {
+            blocks.emplace_back(new StreamBlock());
+            free_blocks.push_back(blocks.back().get());
+        }
+    }
+
+    ~StreamReader() {
+        if (reader.joinable()) reader.join();
+    }
+
+    StreamReader(const StreamReader&) = delete;
+    StreamReader& operator=(const StreamReader&) = delete;
+
+    void start() {
+        reader = thread(&StreamReader::run, this);
+    }
+
+    // 领取下一个数据块（可被多个线程并发调用），全部读完后返回 nullptr
+    StreamBlock* acquire() {
+        unique_lock<mutex> lock(queue_mutex);
+        if (ready.empty() && !finished) {
+            auto start = chrono::steady_clock::now();
+            ready_cv.wait(lock, [this] { return !ready.empty() || finished; });
+            wait_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        if (ready.empty()) return nullptr;
+        StreamBlock* block = ready.front();
+        ready.pop();
+        return block;
+    }
+
+    // 归还扫描完的数据块
+    void recycle(StreamBlock* block) {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            free_blocks.push_back(block);
+        }
+        free_cv.notify_one();
+    }
+
+    // 等待读取线程结束，返回是否全部读取成功
+    bool finish() {
+        if (reader.joinable()) reader.join();
+        return !failed;
+    }
+
+    // 读取的总行数，finish() 之后调用
+    size_t getLineCount() const { return line_count; }
+
+    // 扫描线程等待数据块的时间之和，finish() 之后调用
+    double getWaitSeconds() const { return wait_seconds; }
+};
+
+// ============================================================================
+// 输入语料：一次运行的全部输入分片（如 wiki_00.txt ~ wiki_NN.txt）
+// 每个分片一个 StreamingFileLoader，所有分片共用同一个自动机扫描，
+// 切片、分块编号和行号在分片之间连续编号；所有分片放不进内存时，每个分块扫描完即释放驻留页，
+// 并由 ChunkReadahead 提前读入后面的分块（可以跨分片）
+// 任一输入是标准输入或压缩文件时，全部输入改为流式读取（见 StreamReader），只能扫描一遍
+// ============================================================================
+
+class InputCorpus {
+private:
+    vector<string> paths;
+    bool streamed;              // 全部输入按流读取，不建立映射和切片
+    vector<unique_ptr<StreamingFileLoader>> shards;
+    vector<size_t> slice_base;  // 每个分片第一个切片的全局编号，末尾多存一个总切片数
+    vector<size_t> line_base;   // 每个分片第一行的全局行号，末尾多存一个总行数
+    vector<size_t> chunk_base;  // 每个分片第一个分块的全局编号，末尾多存一个总分块数
+    size_t total_size;
+    bool resident;              // 所有分片能否同时驻留
+    size_t readahead_depth;     // 每个扫描线程同时驻留的分块数（当前分块和预读的分块）
+    unique_ptr<ChunkReadahead> readahead;  // 放不进内存且有多个分块时的预读线程
+
+    // 全局切片编号所在的分片（空分片的切片区间为空，不会被选中）
+    size_t shardOfSlice(size_t slice_idx) const {
+        return upper_bound(slice_base.begin(), slice_base.end(), slice_idx) - slice_base.begin() - 1;
+    }
+
+    // 全局分块编号所在的分片
+    size_t shardOfChunk(size_t chunk_idx) const {
+        return upper_bound(chunk_base.begin(), chunk_base.end(), chunk_idx) - chunk_base.begin() - 1;
+    }
+
+public:
+    InputCorpus() : streamed(false), total_size(0), resident(true), readahead_depth(1) {}
+
+    // 依次映射并扫描每个分片的边界；放不进内存时每个扫描线程驻留 depth 个分块，depth > 1 时启动预读线程
+    bool open(const vector<string>& input_paths, size_t chunk_size, size_t slice_size, size_t depth = 1) {
+        paths = input_paths;
+        for (const auto& path : paths) {
+            if (is_stream_input(path)) {
+                streamed = true;
+            }
+        }
+        if (streamed) {
+            for (const auto& path : paths) {
+                struct stat st;
+                if (path != "-" && stat(path.c_str(), &st) == 0) {
+                    total_size += (size_t)st.st_size;
+                }
+            }
+            cout << "Streaming " << paths.size() << " input(s) (compressed or stdin), single pass" << endl;
+            return true;
+        }
+
+        for (const auto& path : paths) {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) {
+                cerr << "Error opening file: " << path << endl;
+                return false;
+            }
+            total_size += (size_t)st.st_size;
+        }
+        resident = total_size <= chunk_size;
+
+        size_t slices = 0;
+        size_t lines = 0;
+        size_t chunks = 0;
+        for (const auto& path : paths) {
+            unique_ptr<StreamingFileLoader> loader(new StreamingFileLoader(path, chunk_size, slice_size));
+            if (!loader->scanBoundaries()) {
+                return false;
+            }
+            if (!resident) {
+                loader->release();
+            }
+            slice_base.push_back(slices);
+            line_base.push_back(lines);
+            chunk_base.push_back(chunks);
+            slices += loader->getSliceCount();
+            lines += loader->getLineCount();
+            chunks += loader->getChunkCount();
+            shards.push_back(move(loader));
+        }
+        slice_base.push_back(slices);
+        line_base.push_back(lines);
+        chunk_base.push_back(chunks);
+
+        if (!resident && depth > 1 && chunks > 1) {
+            readahead_depth = depth;
+            readahead.reset(new ChunkReadahead());
+            cout << "Read-ahead: " << depth << " chunk buffers per scan thread, " << chunks << " chunks" << endl;
+        }
+
+        if (shards.size() > 1) {
+            cout << "Total shards: " << shards.size() << ", lines: " << lines
+                 << ", slices: " << slices << ", size: " << total_size / (1024 * 1024) << " MB" << endl;
+        }
+        return true;
+    }
+
+    size_t getShardCount() const { return paths.size(); }
+
+    const vector<string>& getPaths() const { return paths; }
+
+    // 流式输入只能读一遍，由 StreamReader 读取，行数事先未知
+    bool isStreamed() const { return streamed; }
+
+    size_t getLineCount() const { return line_base.empty() ? 0 : line_base.back(); }
+
+    size_t getFileSize() const { return total_size; }
+
+    size_t getSliceCount() const { return slice_base.empty() ? 0 : slice_base.back(); }
+
+    // 分片 shard_idx 的切片在全局编号中的区间 [begin, end)
+    size_t getShardSliceBegin(size_t shard_idx) const { return slice_base[shard_idx]; }
+
+    // 分片第一行的全局行号（shard_idx 为分片数时返回总行数）
+    size_t getShardFirstLine(size_t shard_idx) const { return line_base[shard_idx]; }
+
+    // 全局行号 line 所在的分片（line 为总行数时返回分片数）
+    size_t shardOfLine(size_t line) const {
+        size_t shard_idx = upper_bound(line_base.begin(), line_base.end(), line) - line_base.begin() - 1;
+        return line >= getLineCount() ? paths.size() : shard_idx;
+    }
+
+    // 切片第一行的全局行号（slice_idx 为总切片数时返回总行数）
+    size_t getSliceFirstLine(size_t slice_idx) const {
+        if (slice_idx >= getSliceCount()) return getLineCount();
+        size_t shard_idx = shardOfSlice(slice_idx);
+        return line_base[shard_idx] + shards[shard_idx]->getSliceFirstLine(slice_idx - slice_base[shard_idx]);
+    }
+
+    // 包含全局行号 line 的切片（line 为总行数时返回总切片数）
+    size_t sliceOfLine(size_t line) const {
+        size_t slice_idx = 0;
+        size_t count = getSliceCount();
+        while (slice_idx < count && getSliceFirstLine(slice_idx + 1) <= line) {
+            slice_idx++;
+        }
+        return slice_idx;
+    }
+    size_t getShardSliceEnd(size_t shard_idx) const { return slice_base[shard_idx + 1]; }
+
+    size_t getChunkCount() const { return chunk_base.empty() ? 0 : chunk_base.back(); }
+
+    // 切片所属分块的全局编号
+    size_t chunkOfSlice(size_t slice_idx) const {
+        size_t shard_idx = shardOfSlice(slice_idx);
+        return chunk_base[shard_idx] + shards[shard_idx]->getSliceChunk(slice_idx - slice_base[shard_idx]);
+    }
+
+    // 是否启用了分块预读
+    bool hasReadahead() const { return readahead != nullptr; }
+
+    // 每个扫描线程同时驻留的分块数（未启用预读时为 1）
+    size_t getReadaheadDepth() const { return readahead_depth; }
+
+    // 提交全局分块的预读（需已启用预读）
+    ChunkReadahead::Ticket prefetchChunk(size_t chunk_idx) const {
+        size_t shard_idx = shardOfChunk(chunk_idx);
+        return readahead->submit(*shards[shard_idx], chunk_idx - chunk_base[shard_idx]);
+    }
+
+    // 等待预读请求完成，返回等待的秒数
+    double waitChunk(const ChunkReadahead::Ticket& request) const {
+        return readahead->wait(request);
+    }
+
+    // 释放全局分块的驻留页
+    void releaseChunk(size_t chunk_idx) const {
+        size_t shard_idx = shardOfChunk(chunk_idx);
+        shards[shard_idx]->releaseChunk(chunk_idx - chunk_base[shard_idx]);
+    }
+
+    // 顺序扫描到全局分块 chunk_idx 时调用：为它和其后共 depth 个分块提交预读（已提交的不重复），
+    // 并等待它读完，等待时间累计到 window
+    void awaitChunk(size_t chunk_idx, ReadaheadWindow& window) const {
+        while (!window.tickets.empty() && window.tickets.front().first < chunk_idx) {
+            window.tickets.pop_front();
+        }
+        size_t next = window.tickets.empty() ? chunk_idx : window.tickets.back().first + 1;
+        size_t end = min(chunk_idx + readahead_depth, getChunkCount());
+        for (; next < end; next++) {
+            window.tickets.emplace_back(next, prefetchChunk(next));
+        }
+        ChunkReadahead::Ticket request = window.tickets.front().second;
+        window.tickets.pop_front();
+        window.wait_seconds += waitChunk(request);
+    }
+
+    // 所有分片中最大的分块
+    size_t getChunkMemoryMB() const {
+        size_t max_chunk_mb = 0;
+        for (const auto& shard : shards) {
+            max_chunk_mb = max(max_chunk_mb, shard->getChunkMemoryMB());
+        }
+        return max_chunk_mb;
+    }
+
+    // 按全局编号处理单个切片（可被多个线程并发调用），回调收到的是全局行号
+    template<typename Callback>
+    void processSlice(size_t slice_idx, Callback callback) const {
+        size_t shard_idx = shardOfSlice(slice_idx);
+        size_t first_line = line_base[shard_idx];
+        shards[shard_idx]->processSlice(slice_idx - slice_base[shard_idx],
+            [&](const char* line_text, size_t line_len, size_t, size_t line_no) -> bool {
+                return callback(line_text, line_len, slice_idx, first_line + line_no);
+            });
+    }
+
+    // 流式处理单个分片的所有行，回调收到的是全局行号；from_line（全局行号）之前的分块整块跳过
+    // 启用了预读且给出 window 时，每个分块处理前等待预读线程读完并提交后面分块的预读，处理完即释放
+    template<typename Callback>
+    void streamShard(size_t shard_idx, Callback callback, size_t from_line = 0, ReadaheadWindow* window = nullptr) const {
+        size_t first_line = line_base[shard_idx];
+        size_t local_from = from_line > first_line ? from_line - first_line : 0;
+        const StreamingFileLoader& shard = *shards[shard_idx];
+        auto shard_line = [&](const char* line_text, size_t line_len, size_t chunk_idx, size_t line_no) -> bool {
+            return callback(line_text, line_len, chunk_idx, first_line + line_no);
+        };
+        if (readahead && window) {
+            for (size_t chunk_idx = 0; chunk_idx < shard.getChunkCount(); chunk_idx++) {
+                if (shard.getChunkEndLine(chunk_idx) <= local_from) continue;
+                awaitChunk(chunk_base[shard_idx] + chunk_idx, *window);
+                bool keep_going = shard.processChunk(chunk_idx, shard_line);
+                shard.releaseChunk(chunk_idx);
+                if (!keep_going) return;
+            }
+            return;
+        }
+        shard.streamProcess(shard_line, local_from);
+        if (!resident && shard.getChunkCount() == 1) {
+            shard.release();
+        }
+    }
+
+    // 依次流式处理所有分片
+    template<typename Callback>
+    void streamProcess(Callback callback) const {
+        for (size_t shard_idx = 0; shard_idx < shards.size(); shard_idx++) {
+            streamShard(shard_idx, callback);
+        }
+    }
+
+    // 所有分片能同时驻留时，提前读入页缓存
+    void prefetchEntireFile() const {
+        if (!resident) return;
+        for (const auto& shard : shards) {
+            shard->prefetchEntireFile();
+        }
+    }
+};
+
+// 数据并行扫描时所有线程共用的预读：切片按编号顺序领取，领到某个分块的切片时
+// 确保该分块及其后共 depth 个分块已提交预读，并等待该分块读完；分块的切片全部扫描完后释放该分块
+class SliceReadahead {
+private:
+    const InputCorpus& corpus;
+    vector<ChunkReadahead::Ticket> tickets;  // 按全局分块编号
+    vector<size_t> remaining;                // 每个分块还没扫描完的切片数
+    size_t next_submit;                      // 下一个要提交预读的分块
+    mutex state_mutex;
+
+public:
+    // 从 first_slice 开始领取（续跑时之前的切片不再扫描）
+    SliceReadahead(const InputCorpus& input, size_t first_slice)
+        : corpus(input), tickets(input.getChunkCount()), remaining(input.getChunkCount(), 0), next_submit(0) {
+        for (size_t slice_idx = first_slice; slice_idx < corpus.getSliceCount(); slice_idx++) {
+            remaining[corpus.chunkOfSlice(slice_idx)]++;
+        }
+    }
+
+    // 扫描切片前调用，返回等待的秒数
+    double acquire(size_t slice_idx) {
+        size_t chunk_idx = corpus.chunkOfSlice(slice_idx);
+        ChunkReadahead::Ticket request;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            size_t end = min(chunk_idx + corpus.getReadaheadDepth(), tickets.size());
+            for (next_submit = max(next_submit, chunk_idx); next_submit < end; next_submit++) {
+                tickets[next_submit] = corpus.prefetchChunk(next_submit);
+            }
+            request = tickets[chunk_idx];
+        }
+        return corpus.waitChunk(request);
+    }
+
+    // 切片扫描完后调用
+    void finish(size_t slice_idx) {
+        size_t chunk_idx = corpus.chunkOfSlice(slice_idx);
+        lock_guard<mutex> lock(state_mutex);
+        if (--remaining[chunk_idx] == 0) {
+            corpus.releaseChunk(chunk_idx);
+            tickets[chunk_idx].reset();
+        }
+    }
+};
+
+// ============================================================================
+// 一个批次使用的自动机：按所选引擎构建，只保留扫描需要的那一份
+// ============================================================================
+
+class BatchAutomaton {
+private:
+    SearchEngine engine;
+    unique_ptr<AhoCorasick> classic;
+    unique_ptr<CodepointAhoCorasick> codepoint;
+    size_t buildPeakBytes;  // 构建过程中的内存峰值（精确统计各数组，不含分配器开销）
+
+public:
+    // threads > 1 时多线程建树和构建失败指针（结果与单线程相同）
+    BatchAutomaton(const WordList& words, const BatchRange& range, SearchEngine search_engine,
+                   const CharFolding* folding = nullptr, int threads = 1)
+        : engine(search_engine), buildPeakBytes(0) {
+        if (engine == SearchEngine::Codepoint) {
+            codepoint.reset(new CodepointAhoCorasick(words, range.start, range.end, folding, threads));
+            buildPeakBytes = codepoint->getBuildPeakBytes();
+            return;
+        }
+
+        // classic 引擎直接使用逐个插入构建的原始自动机
+        classic.reset(new AhoCorasick());
+        classic->insertAll(range.end - range.start, [&](size_t i) {
+            return words[range.start + i];
+        }, threads);
+        classic->buildFailureLinks(threads);
+        buildPeakBytes = classic->memoryBytes();
+    }
+
+    // 使用预编译索引文件中的自动机（数组直接映射，不计入构建峰值；索引总是 codepoint 引擎）
+    explicit BatchAutomaton(const IndexFile& index) : engine(SearchEngine::Codepoint), buildPeakBytes(0) {
+        codepoint.reset(new CodepointAhoCorasick(index));
+    }
+
+    // 写入索引文件（classic 引擎不支持）
+    bool save(IndexWriter& writer) const {
+        writer.getHeader().engine = (uint32_t)engine;
+        if (engine != SearchEngine::Codepoint) return false;
+        codepoint->save(writer);
+        return true;
+    }
+
+    SearchEngine getEngine() const { return engine; }
+
+    // 构建完成后常驻的字节数
+    size_t memoryBytes() const {
+        switch (engine) {
+            case SearchEngine::Codepoint: return codepoint->memoryBytes();
+            default: return classic->memoryBytes();
+        }
+    }
+
+    size_t getBuildPeakBytes() const { return buildPeakBytes; }
+
+    size_t getStateCount() const {
+        switch (engine) {
+            case SearchEngine::Codepoint: return codepoint->getStateCount();
+            default: return classic->getNodeCount();
+        }
+    }
+
+    int getDenseStateCount() const {
+        switch (engine) {
+            case SearchEngine::Codepoint: return codepoint->getDenseStateCount();
+            default: return 0;
+        }
+    }
+
+    // 以 CSR 存储的边数（classic 引擎为字典树的全部边）
+    size_t getEdgeCount() const {
+        switch (engine) {
+            case SearchEngine::Codepoint: return codepoint->getEdgeCount();
+            default: return classic->getNodeCount() - 1;
+        }
+    }
+
+    // 扫描一行文本，对每个匹配调用 visit（按行分派一次引擎，内层循环无虚调用）
+    template<typename Visitor>
+    void search(const char* text, size_t length, Visitor&& visit) const {
+        switch (engine) {
+            case SearchEngine::Codepoint: codepoint->search(text, length, visit); break;
+            default: classic->search(text, length, visit); break;
+        }
+    }
+
+    // 打印自动机规模（状态数、稠密状态数、字母表、内存）
+    void describe(ostream& out) const {
+        switch (engine) {
+            case SearchEngine::Codepoint:
+                out << "states: " << codepoint->getStateCount()
+                    << ", engine: codepoint (" << codepoint->getAlphabetSize() << " symbols, "
+                    << codepoint->getDenseStateCount() << " dense states, "
+                    << codepoint->memoryBytes() / (1024 * 1024) << " MB)";
+                break;
+            default:
+                out << "states: " << classic->getNodeCount() << ", engine: classic ("
+                    << classic->memoryBytes() / (1024 * 1024) << " MB)";
+                break;
+        }
+    }
+};
+
+// ============================================================================
+// 文章计数器：每个词条在每篇文章（行）中最多计 1 次
+// 每个词条记录最后一次计数时的行戳，行戳相同即为本行重复匹配，
+// 不需要临时 vector、排序去重和原子操作；每个计数器只由一个线程使用
+// 模板参数 Stats 为 --columns 选择的其他统计（STAT_TOTAL 等的组合），在编译期确定：
+// 没有选择的统计不分配数组，hit() 中对应的代码被整个去掉，热循环中没有额外的分支
+// ============================================================================
+
+const uint64_t NO_ARTICLE = numeric_limits<uint64_t>::max();
+
+// 一组词条的统计结果，未选择的统计为空数组
+struct WordStats {
+    vector<int> df;
+    vector<uint64_t> total;
+    vector<int> maxPerArticle;
+    vector<uint64_t> firstArticle;  // 行号从 0 开始，NO_ARTICLE 表示没有出现
+
+    // 合并另一部分文本（其他线程或分片）的统计：文章数和总次数相加，单篇最多取较大值，第一次出现取较小值
+    void merge(const WordStats& other) {
+        if (df.empty()) {
+            *this = other;
+            return;
+        }
+        for (size_t i = 0; i < df.size(); i++) df[i] += other.df[i];
+        for (size_t i = 0; i < total.size(); i++) total[i] += other.total[i];
+        for (size_t i = 0; i < maxPerArticle.size(); i++) {
+            maxPerArticle[i] = max(maxPerArticle[i], other.maxPerArticle[i]);
+        }
+        for (size_t i = 0; i < firstArticle.size(); i++) {
+            firstArticle[i] = min(firstArticle[i], other.firstArticle[i]);
+        }
+    }
+
+    // 为 count 个词条分配文章数和 stats 选择的统计
+    void assign(size_t count, unsigned stats) {
+        df.assign(count, 0);
+        total.assign((stats & STAT_TOTAL) ? count : 0, 0);
+        maxPerArticle.assign((stats & STAT_MAX) ? count : 0, 0);
+        firstArticle.assign((stats & STAT_FIRST) ? count : 0, NO_ARTICLE);
+    }
+
+    // 复制 from 中第 from_idx 个词条的统计到第 to_idx 个（两边选择的统计相同）
+    void copyEntry(size_t to_idx, const WordStats& from, size_t from_idx) {
+        df[to_idx] = from.df[from_idx];
+        if (!total.empty()) total[to_idx] = from.total[from_idx];
+        if (!maxPerArticle.empty()) maxPerArticle[to_idx] = from.maxPerArticle[from_idx];
+        if (!firstArticle.empty()) firstArticle[to_idx] = from.firstArticle[from_idx];
+    }
+
+    // 把一个批次的统计放到从 start 开始的位置
+    void store(size_t start, const WordStats& part) {
+        for (size_t i = 0; i < part.df.size(); i++) {
+            copyEntry(start + i, part, i);
+        }
+    }
+};
+
+// 按 --columns 的顺序输出一个词条的各统计列（每列前有一个 TAB）
+static void write_stat_columns(ostream& out, const vector<StatColumn>& columns, const WordStats& stats, size_t i) {
+    for (StatColumn column : columns) {
+        switch (column) {
+            case StatColumn::Total: out << "\t" << stats.total[i]; break;
+            case StatColumn::MaxPerArticle: out << "\t" << stats.maxPerArticle[i]; break;
+            case StatColumn::FirstArticle: out << "\t" << stats.firstArticle[i] + 1; break;
+            default: out << "\t" << stats.df[i]; break;
+        }
+    }
+}
+
+// 每个计数器每个词条占用的字节数（用于批次规划）
+static size_t stat_counter_bytes(unsigned stats) {
+    size_t bytes = sizeof(int) + sizeof(uint32_t);                      // 文章数和行戳
+    if (stats & STAT_TOTAL) bytes += sizeof(uint64_t);
+    if (stats & STAT_MAX) bytes += 2 * sizeof(int);                     // 单篇最多次数和本行次数
+    if (stats & STAT_FIRST) bytes += sizeof(uint64_t);
+    return bytes;
+}
+
+template<unsigned Stats = 0>
+class DocumentCounter {
+private:
+    WordStats stats;
+    vector<uint32_t> lastLine;  // 每个词条最后一次计数时的行戳
+    vector<int> lineHits;       // 每个词条在本行中的出现次数（仅 STAT_MAX）
+    uint32_t stamp;             // 当前行戳（0 表示尚未计数）
+    uint64_t line;              // 当前行号（仅 STAT_FIRST）
+
+public:
+    explicit DocumentCounter(size_t pattern_count) : lastLine(pattern_count, 0), stamp(0), line(0) {
+        stats.df.assign(pattern_count, 0);
+        if (Stats & STAT_TOTAL) stats.total.assign(pattern_count, 0);
+        if (Stats & STAT_MAX) {
+            stats.maxPerArticle.assign(pattern_count, 0);
+            lineHits.assign(pattern_count, 0);
+        }
+        if (Stats & STAT_FIRST) stats.firstArticle.assign(pattern_count, NO_ARTICLE);
+    }
+
+    // 开始新的一行（line_no 为全局行号，只有统计第一次出现时才用到）
+    void beginLine(uint64_t line_no = 0) {
+        if (++stamp == 0) {
+            // 行戳回绕，清空后从 1 重新开始
+            fill(lastLine.begin(), lastLine.end(), 0);
+            stamp = 1;
+        }
+        if (Stats & STAT_FIRST) line = line_no;
+    }
+
+    void hit(int idx) {
+        if (lastLine[idx] != stamp) {
+            lastLine[idx] = stamp;
+            stats.df[idx]++;
+            if (Stats & STAT_MAX) lineHits[idx] = 0;
+            if (Stats & STAT_FIRST) stats.firstArticle[idx] = min(stats.firstArticle[idx], line);
+        }
+        if (Stats & STAT_TOTAL) stats.total[idx]++;
+        if (Stats & STAT_MAX) {
+            int hits = ++lineHits[idx];
+            stats.maxPerArticle[idx] = max(stats.maxPerArticle[idx], hits);
+        }
+    }
+
+    const vector<int>& getCounts() const { return stats.df; }
+    const WordStats& getStats() const { return stats; }
+
+    // 从检查点恢复已有的计数（为空时保持为 0）
+    void restore(WordStats&& saved) {
+        if (saved.df.empty()) return;
+        stats.df = move(saved.df);
+        if (Stats & STAT_TOTAL) stats.total = move(saved.total);
+        if (Stats & STAT_MAX) stats.maxPerArticle = move(saved.maxPerArticle);
+        if (Stats & STAT_FIRST) stats.firstArticle = move(saved.firstArticle);
+    }
+
+    // 取走统计结果（计数器之后不再使用）
+    WordStats takeStats() { return move(stats); }
+};
+
+// ============================================================================
+// 扫描进度：每 30 秒输出一次日志，可被多个扫描线程共享
+// 扫描线程在本地累计行数，每 LOG_CHECK_INTERVAL 行汇报一次；另外汇总各扫描线程等待输入的时间
+// ============================================================================
+
+class ScanProgress {
+public:
+    static const size_t LOG_CHECK_INTERVAL = 5000;  // 每 5000 行检查一次时间
+
+private:
+    static const int LOG_INTERVAL_SECONDS = 30;     // 每 30 秒输出一次进度日志
+
+    string label;                    // 日志前缀，如 Batch[1/4]
+    size_t total_lines;
+    chrono::high_resolution_clock::time_point scan_start;
+    chrono::high_resolution_clock::time_point last_log_time;
+    atomic<size_t> lines_processed;  // 已处理的行数
+    atomic<size_t> bytes_processed;  // 已扫描的字节数（用于计算引擎吞吐量）
+    atomic<uint64_t> io_wait_ns;     // 扫描线程等待预读或解压的时间之和
+    atomic<size_t> stolen_slices;    // 其他批次的空闲线程帮忙扫描的切片数
+    size_t lines_at_last_log;        // 上次日志时的行数（用于计算瞬时速度）
+    mutex log_mutex;
+
+public:
+    ScanProgress(const string& log_label, size_t lines, chrono::high_resolution_clock::time_point start)
+        : label(log_label), total_lines(lines), scan_start(start), last_log_time(start),
+          lines_processed(0), bytes_processed(0), io_wait_ns(0), stolen_slices(0), lines_at_last_log(0) {}
+
+    ScanProgress(int batch, int batches, size_t lines, chrono::high_resolution_clock::time_point start)
+        : ScanProgress("Batch[" + to_string(batch + 1) + "/" + to_string(batches) + "]", lines, start) {}
+
+    void add(size_t lines, size_t bytes) {
+        size_t done = lines_processed.fetch_add(lines) + lines;
+        bytes_processed.fetch_add(bytes);
+
+        // 其他线程正在检查时直接跳过
+        unique_lock<mutex> lock(log_mutex, try_to_lock);
+        if (!lock.owns_lock()) return;
+
+        auto current_time = chrono::high_resolution_clock::now();
+        chrono::duration<double> elapsed_since_last_log = current_time - last_log_time;
+        if (elapsed_since_last_log.count() < LOG_INTERVAL_SECONDS) return;
+
+        chrono::duration<double> scan_elapsed = current_time - scan_start;
+        if (total_lines == 0) {
+            // 流式输入事先不知道总行数，只输出已处理的行数和速度
+            lock_guard<mutex> cout_lock(cout_mutex);
+            cout << label << " "
+                 << setfill('0') << setw(2) << (int)(scan_elapsed.count()/60) << ":" << setw(2) << (int)scan_elapsed.count()%60
+                 << " | " << fixed << setprecision(0) << done/1000 << "K"
+                 << " | " << setprecision(1) << (done - lines_at_last_log) / elapsed_since_last_log.count() / 1000 << "K/s"
+                 << ", Avg " << done / scan_elapsed.count() / 1000 << "K/s"
+                 << endl;
+            last_log_time = current_time;
+            lines_at_last_log = done;
+            return;
+        }
+        double progress = done * 100.0 / total_lines;
+        double instant_lines_per_sec = (done - lines_at_last_log) / elapsed_since_last_log.count();
+        double avg_lines_per_sec = done / scan_elapsed.count();
+
+        // ETA
+        size_t remaining_lines = total_lines > done ? total_lines - done : 0;
+        double eta_seconds = remaining_lines / avg_lines_per_sec;
+        int eta_m = (int)(eta_seconds / 60);
+        int eta_s = (int)eta_seconds % 60;
+
+        {
+            lock_guard<mutex> cout_lock(cout_mutex);
+            cout << label << " "
+                 << fixed << setfill(' ') << setw(5) << setprecision(1) << progress << "%"
+                 << " | " << setfill('0') << setw(2) << (int)(scan_elapsed.count()/60) << ":" << setw(2) << (int)scan_elapsed.count()%60
+                 << ", ETA " << setw(2) << eta_m << ":" << setw(2) << eta_s
+                 << " | " << setprecision(0) << done/1000 << "K/" << total_lines/1000 << "K"
+                 << " | " << setprecision(1) << instant_lines_per_sec/1000 << "K/s"
+                 << ", Avg " << avg_lines_per_sec/1000 << "K/s"
+                 << endl;
+        }
+        last_log_time = current_time;
+        lines_at_last_log = done;
+    }
+
+    void addIoWait(double seconds) {
+        io_wait_ns.fetch_add((uint64_t)(seconds * 1e9));
+    }
+
+    void addStolenSlices(size_t slices) {
+        stolen_slices.fetch_add(slices);
+    }
+
+    size_t getBytesProcessed() const { return bytes_processed.load(); }
+    size_t getLinesProcessed() const { return lines_processed.load(); }
+    double getIoWaitSeconds() const { return io_wait_ns.load() / 1e9; }
+    size_t getStolenSlices() const { return stolen_slices.load(); }
+};
+
+// ============================================================================
+// 运行指标与时间线（--metrics-json / --trace / --perf-counters）
+// 指标文件按阶段和批次各输出一条记录，便于不同运行之间直接比较，不必再从日志中用正则提取；
+// 时间线为 Chrome trace 格式（chrome://tracing 或 Perfetto 打开），每个线程一行，
+// 扫描线程按工作单元（切片、分片、数据块）记录，单元之间的空白就是空闲时间
+// ============================================================================
+
+// 追加一个 JSON 字符串（含引号和转义）
+static void append_json_string(string& out, const string& value) {
+    out += '"';
+    for (unsigned char c : value) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += (char)c;
+                }
+        }
+    }
+    out += '"';
+}
+
+// 逐个字段拼出一个 JSON 对象
+class JsonObject {
+private:
+    string body;
+
+    void key(const char* name) {
+        if (!body.empty()) body += ", ";
+        append_json_string(body, name);
+        body += ": ";
+    }
+
+public:
+    JsonObject& add(const char* name, const string& value) {
+        key(name);
+        append_json_string(body, value);
+        return *this;
+    }
+
+    JsonObject& add(const char* name, const char* value) { return add(name, string(value)); }
+
+    JsonObject& add(const char* name, bool value) {
+        key(name);
+        body += value ? "true" : "false";
+        return *this;
+    }
+
+    JsonObject& add(const char* name, double value) {
+        key(name);
+        if (value != value || value > 1e300 || value < -1e300) {
+            body += "null";  // JSON 没有 NaN 和无穷大
+        } else {
+            char number[32];
+            snprintf(number, sizeof(number), "%.9g", value);
+            body += number;
+        }
+        return *this;
+    }
+
+    template<typename T>
+    typename enable_if<is_integral<T>::value && !is_same<T, bool>::value, JsonObject&>::type
+    add(const char* name, T value) {
+        key(name);
+        body += to_string(value);
+        return *this;
+    }
+
+    // 嵌套的对象或数组（已是 JSON 文本）
+    JsonObject& addRaw(const char* name, const string& json) {
+        key(name);
+        body += json;
+        return *this;
+    }
+
+    bool empty() const { return body.empty(); }
+    string str() const { return "{" + body + "}"; }
+};
+
+// 硬件计数器：cycles、instructions、LLC 和 dTLB 读缺失
+// 每个计数器单独打开（不组成一组），某个事件不被支持（如虚拟机中的 dTLB）时其余照常统计；
+// 计数器被复用时按 enabled/running 时间比例换算
+enum PerfCounterId {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_COUNTER_COUNT
+};
+
+static const char* const PERF_COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses"
+};
+
+static int open_perf_counter(PerfCounterId id) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    switch (id) {
+        case PERF_CYCLES: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PERF_INSTRUCTIONS: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PERF_LLC_MISSES: attr.type = PERF_TYPE_HW_CACHE; attr.config = PERF_COUNT_HW_CACHE_LL | read_miss; break;
+        default: attr.type = PERF_TYPE_HW_CACHE; attr.config = PERF_COUNT_HW_CACHE_DTLB | read_miss; break;
+    }
+    // 只统计调用线程（pid = 0, cpu = -1）
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// 一个线程上的一组计数器，构造时打开并开始计数，stop() 读出
+class PerfCounters {
+private:
+    int fds[PERF_COUNTER_COUNT];
+
+public:
+    PerfCounters() {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            fds[i] = open_perf_counter((PerfCounterId)i);
+            if (fds[i] >= 0) {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // 停止计数并读出，valid[i] 表示该计数器可用
+    void stop(uint64_t values[PERF_COUNTER_COUNT], bool valid[PERF_COUNTER_COUNT]) {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            values[i] = 0;
+            valid[i] = false;
+            if (fds[i] < 0) continue;
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t data[3];  // value, time_enabled, time_running
+            if (read(fds[i], data, sizeof(data)) != (ssize_t)sizeof(data)) continue;
+            values[i] = data[2] > 0 && data[2] < data[1]
+                ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+            valid[i] = data[2] > 0;
+        }
+    }
+
+    // 检查本机是否允许打开硬件计数器，不允许时给出原因
+    static bool probe(string& error) {
+        int fd = open_perf_counter(PERF_CYCLES);
+        if (fd < 0) {
+            error = string("perf_event_open failed: ") + strerror(errno);
+            if (errno == EACCES || errno == EPERM) {
+                error += " (check /proc/sys/kernel/perf_event_paranoid)";
+            }
+            return false;
+        }
+        close(fd);
+        return true;
+    }
+};
+
+// 一个批次所有扫描线程的计数器合计
+class ScanCounterTotals {
+private:
+    mutex totals_mutex;
+    uint64_t values[PERF_COUNTER_COUNT];
+    bool valid[PERF_COUNTER_COUNT];
+
+public:
+    ScanCounterTotals() {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            values[i] = 0;
+            valid[i] = false;
+        }
+    }
+
+    void add(const uint64_t thread_values[PERF_COUNTER_COUNT], const bool thread_valid[PERF_COUNTER_COUNT]) {
+        lock_guard<mutex> lock(totals_mutex);
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (!thread_valid[i]) continue;
+            values[i] += thread_values[i];
+            valid[i] = true;
+        }
+    }
+
+    bool any() const {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (valid[i]) return true;
+        }
+        return false;
+    }
+
+    bool has(PerfCounterId id) const { return valid[id]; }
+    uint64_t get(PerfCounterId id) const { return values[id]; }
+
+    // 输出为 JSON 对象，不可用的计数器为 null
+    string json(size_t bytes_scanned) const {
+        JsonObject object;
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (valid[i]) object.add(PERF_COUNTER_NAMES[i], values[i]);
+            else object.addRaw(PERF_COUNTER_NAMES[i], "null");
+        }
+        if (valid[PERF_CYCLES] && valid[PERF_INSTRUCTIONS] && values[PERF_CYCLES] > 0) {
+            object.add("ipc", (double)values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+        }
+        if (valid[PERF_CYCLES] && bytes_scanned > 0) {
+            object.add("cycles_per_byte", (double)values[PERF_CYCLES] / bytes_scanned);
+        }
+        return object.str();
+    }
+};
+
+class RunTelemetry {
+private:
+    string metrics_path;
+    string trace_path;
+    bool perf_enabled;
+    string perf_error;
+    chrono::steady_clock::time_point origin;
+
+    mutex telemetry_mutex;
+    JsonObject run_info;
+    vector<string> phases;           // 每个阶段一条 JSON 记录
+    vector<string> batches;          // 每个批次一条 JSON 记录
+    vector<string> trace_events;
+    int thread_count;
+
+    // 当前线程在时间线中的编号（调用方持有锁）
+    // 用 thread_local 而不是 thread::id：线程结束后 id 会被新线程复用，每个批次的扫描线程应各占一行
+    int threadIdLocked() {
+        static thread_local int tid = 0;
+        if (tid == 0) tid = ++thread_count;
+        return tid;
+    }
+
+    static bool writeFile(const string& path, const string& content) {
+        ofstream file(path, ios::binary | ios::trunc);
+        if (!file.is_open()) {
+            cerr << "Error writing " << path << endl;
+            return false;
+        }
+        file << content;
+        file.close();
+        return !file.fail();
+    }
+
+public:
+    RunTelemetry(const string& metrics, const string& trace, bool perf_counters)
+        : metrics_path(metrics), trace_path(trace), perf_enabled(false), origin(chrono::steady_clock::now()),
+          thread_count(0) {
+        if (perf_counters) {
+            perf_enabled = PerfCounters::probe(perf_error);
+            if (!perf_enabled) {
+                cerr << "Warning: hardware counters unavailable, " << perf_error << endl;
+            }
+        }
+    }
+
+    bool perfEnabled() const { return perf_enabled; }
+    bool tracing() const { return !trace_path.empty(); }
+
+    // 距离启动的秒数
+    double now() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - origin).count();
+    }
+
+    void setRunInfo(const JsonObject& info) {
+        lock_guard<mutex> lock(telemetry_mutex);
+        run_info = info;
+    }
+
+    // 给当前线程命名（时间线中的行名）
+    void nameThread(const string& name) {
+        if (!tracing()) return;
+        lock_guard<mutex> lock(telemetry_mutex);
+        int tid = threadIdLocked();
+        string event = "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " + to_string(tid)
+                     + ", \"args\": {\"name\": ";
+        append_json_string(event, name);
+        event += "}}";
+        trace_events.push_back(move(event));
+    }
+
+    // 在当前线程上记录一段时间（start、end 为 now() 的返回值）
+    void span(const string& name, const char* category, double start, double end,
+              const JsonObject& args = JsonObject()) {
+        if (!tracing()) return;
+        char timing[96];
+        snprintf(timing, sizeof(timing), "\"ts\": %.3f, \"dur\": %.3f", start * 1e6, max(0.0, end - start) * 1e6);
+        string event = "{\"name\": ";
+        append_json_string(event, name);
+        event += ", \"cat\": \"";
+        event += category;
+        event += "\", \"ph\": \"X\", \"pid\": 1, \"tid\": ";
+        lock_guard<mutex> lock(telemetry_mutex);
+        event += to_string(threadIdLocked());
+        event += ", ";
+        event += timing;
+        if (!args.empty()) {
+            event += ", \"args\": " + args.str();
+        }
+        event += "}";
+        trace_events.push_back(move(event));
+    }
+
+    // 记录一个阶段（同时出现在时间线中）
+    void phase(const string& name, double start, double end, JsonObject fields = JsonObject()) {
+        span(name, "phase", start, end, fields);
+        JsonObject record;
+        record.add("phase", name).add("start", start).add("seconds", end - start);
+        string json = record.str();
+        if (!fields.empty()) {
+            json.pop_back();
+            json += ", " + fields.str().substr(1);
+        }
+        lock_guard<mutex> lock(telemetry_mutex);
+        phases.push_back(move(json));
+    }
+
+    void batch(const JsonObject& record) {
+        lock_guard<mutex> lock(telemetry_mutex);
+        batches.push_back(record.str());
+    }
+
+    // 写出指标文件和时间线文件
+    bool write(double total_seconds) {
+        bool ok = true;
+        lock_guard<mutex> lock(telemetry_mutex);
+        if (!metrics_path.empty()) {
+            JsonObject totals;
+            totals.add("seconds", total_seconds)
+                  .add("peak_rss_mb", get_peak_memory_mb())
+                  .add("perf_counters", perf_enabled ? string("enabled") : perf_error.empty() ? string("off") : perf_error);
+            string json = "{\n  \"run\": " + run_info.str() + ",\n  \"phases\": [";
+            for (size_t i = 0; i < phases.size(); i++) {
+                json += (i ? ",\n    " : "\n    ") + phases[i];
+            }
+            json += "\n  ],\n  \"batches\": [";
+            for (size_t i = 0; i < batches.size(); i++) {
+                json += (i ? ",\n    " : "\n    ") + batches[i];
+            }
+            json += "\n  ],\n  \"totals\": " + totals.str() + "\n}\n";
+            if (writeFile(metrics_path, json)) {
+                cout << "Metrics: " << metrics_path << endl;
+            } else {
+                ok = false;
+            }
+        }
+        if (!trace_path.empty()) {
+            string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+            for (size_t i = 0; i < trace_events.size(); i++) {
+                json += (i ? ",\n" : "\n") + trace_events[i];
+            }
+            json += "\n]}\n";
+            if (writeFile(trace_path, json)) {
+                cout << "Trace: " << trace_path << endl;
+            } else {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+};
+
+// 时间线上的一段：构造时开始，析构时结束；没有启用时间线时不做任何事
+class TraceSpan {
+private:
+    RunTelemetry* telemetry;
+    const char* category;
+    string name;
+    double start;
+
+public:
+    TraceSpan(RunTelemetry* run, const char* span_category, const char* label, size_t index)
+        : telemetry(run && run->tracing() ? run : nullptr), category(span_category), start(0.0) {
+        if (!telemetry) return;
+        name = string(label) + " " + to_string(index);
+        start = telemetry->now();
+    }
+
+    ~TraceSpan() {
+        if (telemetry) telemetry->span(name, category, start, telemetry->now());
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// 扫描线程的探针：给线程命名，--perf-counters 时统计本线程扫描期间的硬件计数器并累加到批次合计
+class ScanProbe {
+private:
+    ScanCounterTotals* totals;
+    unique_ptr<PerfCounters> perf;
+
+public:
+    ScanProbe(RunTelemetry* telemetry, ScanCounterTotals& batch_totals, int batch_id, int thread_idx)
+        : totals(&batch_totals) {
+        if (!telemetry) return;
+        // thread_idx < 0 表示在批次线程自身上扫描，沿用原来的线程名
+        if (thread_idx >= 0) {
+            telemetry->nameThread("Batch[" + to_string(batch_id + 1) + "] scan " + to_string(thread_idx));
+        }
+        if (telemetry->perfEnabled()) perf.reset(new PerfCounters());
+    }
+
+    ~ScanProbe() {
+        if (!perf) return;
+        uint64_t values[PERF_COUNTER_COUNT];
+        bool valid[PERF_COUNTER_COUNT];
+        perf->stop(values, valid);
+        totals->add(values, valid);
+    }
+
+    ScanProbe(const ScanProbe&) = delete;
+    ScanProbe& operator=(const ScanProbe&) = delete;
+};
+
+// ============================================================================
+// 批次规划：先按估算的每词条字节数切出第一批，构建后按实测的构建峰值重新规划剩余批次
+// 多个线程同时构建时，第一批实测完成前其他线程等待，避免按错误的估算同时构建多个大自动机
+// 实测值取已完成批次中的最大值，批次只会越切越小，不会因为后面的词条更长而超出预算
+// ============================================================================
+
+class BatchPlanner {
+private:
+    struct BatchRecord {
+        BatchRange range;
+        size_t peak_bytes;      // 构建峰值
+        size_t resident_bytes;  // 构建完成后常驻的字节数
+    };
+
+    size_t total_words;
+    size_t next_start;
+    size_t budget_bytes;            // 每个同时存在的批次可用的内存
+    size_t counter_bytes_per_word;  // 计数器等与自动机无关的每词条开销（精确值）
+    double ac_bytes_per_word;       // 自动机每词条字节数：实测前为估算值，之后为实测最大值
+    size_t min_batches;             // 至少切出的批次数（按词典并行时等于线程数）
+    bool measured;
+    bool probing;                   // 第一批已领取、尚未实测
+    deque<BatchRange> resumed;      // 续跑时先重新处理检查点中未完成的批次
+    vector<BatchRecord> records;
+    mutex planner_mutex;
+    condition_variable measured_cv;
+
+    // 按当前的每词条字节数规划剩余词条，返回下一批的词条数和预计的剩余批次数
+    size_t planNext(size_t& remaining_batches) const {
+        size_t remaining = total_words - next_start;
+        double bytes_per_word = ac_bytes_per_word + counter_bytes_per_word;
+        size_t words_cap = max<size_t>(1, (size_t)(budget_bytes / bytes_per_word));
+        remaining_batches = (remaining + words_cap - 1) / words_cap;
+        if (records.size() < min_batches) {
+            remaining_batches = max(remaining_batches, min_batches - records.size());
+        }
+        return (remaining + remaining_batches - 1) / remaining_batches;
+    }
+
+public:
+    BatchPlanner(size_t words, size_t budget, size_t counter_bytes, size_t estimated_ac_bytes, size_t batches_at_least)
+        : total_words(words), next_start(0), budget_bytes(budget), counter_bytes_per_word(counter_bytes),
+          ac_bytes_per_word((double)estimated_ac_bytes), min_batches(max<size_t>(1, batches_at_least)),
+          measured(false), probing(false) {}
+
+    // 领取下一批；返回 false 表示已全部领取。batch_id 为批次序号，total_batches 为当前预计的总批次数
+    bool next(BatchRange& range, int& batch_id, int& total_batches) {
+        unique_lock<mutex> lock(planner_mutex);
+        measured_cv.wait(lock, [this] { return !probing; });
+        if (next_start >= total_words && resumed.empty()) return false;
+
+        size_t remaining_batches = 0;
+        if (!resumed.empty()) {
+            range = resumed.front();
+            resumed.pop_front();
+            if (next_start < total_words) planNext(remaining_batches);
+            remaining_batches += resumed.size() + 1;
+        } else {
+            size_t size = planNext(remaining_batches);
+            range.start = next_start;
+            range.end = min(total_words, next_start + size);
+            next_start = range.end;
+        }
+
+        BatchRecord record = { range, 0, 0 };
+        records.push_back(record);
+        batch_id = (int)records.size() - 1;
+        total_batches = (int)(records.size() + remaining_batches - 1);
+        if (!measured) probing = true;
+        return true;
+    }
+
+    // 续跑：先依次领取检查点中未完成的批次（范围不变），之后从 planned_end 继续规划
+    void resume(const vector<BatchRange>& pending, size_t planned_end) {
+        lock_guard<mutex> lock(planner_mutex);
+        resumed.assign(pending.begin(), pending.end());
+        next_start = planned_end;
+    }
+
+    // 记录一个批次构建后的实测内存，并据此重新规划
+    void record(int batch_id, size_t peak_bytes, size_t resident_bytes) {
+        {
+            lock_guard<mutex> lock(planner_mutex);
+            BatchRecord& record = records[batch_id];
+            record.peak_bytes = peak_bytes;
+            record.resident_bytes = resident_bytes;
+            size_t words = record.range.end - record.range.start;
+            double bytes_per_word = words > 0 ? (double)peak_bytes / words : 0.0;
+            double previous = ac_bytes_per_word;
+            ac_bytes_per_word = measured ? max(ac_bytes_per_word, bytes_per_word) : bytes_per_word;
+            measured = true;
+            probing = false;
+
+            lock_guard<mutex> cout_lock(cout_mutex);
+            cout << "Batch[" << batch_id + 1 << "] measured AC peak " << fixed << setprecision(1)
+                 << peak_bytes / (1024.0 * 1024.0) << " MB, resident " << resident_bytes / (1024.0 * 1024.0)
+                 << " MB, " << bytes_per_word << " bytes/word";
+            if (ac_bytes_per_word != previous && next_start < total_words) {
+                size_t remaining_batches = 0;
+                size_t size = planNext(remaining_batches);
+                cout << "; re-planned " << total_words - next_start << " remaining words: "
+                     << remaining_batches << " batches of ~" << size << " words ("
+                     << setprecision(1) << ac_bytes_per_word << " bytes/word)";
+            }
+            cout << endl;
+        }
+        measured_cv.notify_all();
+    }
+
+    // 按当前的每词条字节数估算一个批次的自动机构建峰值
+    size_t estimatePeakBytes(const BatchRange& range) {
+        lock_guard<mutex> lock(planner_mutex);
+        return (size_t)(ac_bytes_per_word * (range.end - range.start));
+    }
+
+    size_t getBatchCount() const { return records.size(); }
+
+    // 输出最终的批次划分和实测数据
+    void printSummary() const {
+        size_t max_peak = 0;
+        size_t total_peak = 0;
+        size_t planned_words = 0;
+        for (const auto& record : records) {
+            max_peak = max(max_peak, record.peak_bytes);
+            total_peak += record.peak_bytes;
+            planned_words += record.range.end - record.range.start;
+        }
+        cout << "Final plan: " << records.size() << " batches, budget " << budget_bytes / (1024 * 1024)
+             << " MB/batch, counters " << counter_bytes_per_word << " bytes/word" << endl;
+        for (size_t i = 0; i < records.size(); i++) {
+            const BatchRecord& record = records[i];
+            size_t words = record.range.end - record.range.start;
+            cout << "  Batch[" << i + 1 << "] words " << words << fixed << setprecision(1)
+                 << ", AC peak " << record.peak_bytes / (1024.0 * 1024.0) << " MB"
+                 << ", resident " << record.resident_bytes / (1024.0 * 1024.0) << " MB"
+                 << ", " << (words > 0 ? (double)record.peak_bytes / words : 0.0) << " bytes/word" << endl;
+        }
+        if (planned_words > 0) {
+            cout << "  Max AC peak " << fixed << setprecision(1) << max_peak / (1024.0 * 1024.0) << " MB, average "
+                 << (double)total_peak / planned_words << " bytes/word" << endl;
+        }
+    }
+};
+
+// ============================================================================
+// 运行时内存调控
+// 扫描前的内存规划只是一个快照，同一台机器上的其他任务（OpenCC、合并脚本）可能在扫描中途占用大量内存。
+// 后台线程定期采样内存余量和内存压力（PSI），内存紧张时减少同时运行的批次数，并推迟新的自动机构建，
+// 直到内存回落；压力消失后逐步恢复并发。每次调整都输出日志
+// 已经开始的批次不会被打断，减少并发只影响之后领取的批次
+// ============================================================================
+
+const int GOVERNOR_INTERVAL_MS = 500;       // 采样间隔
+const int GOVERNOR_HOLD_SAMPLES = 4;        // 两次调整并发数之间至少间隔的采样次数（内存告急时不受限制）
+const double PSI_THROTTLE_PERCENT = 10.0;   // some avg10 达到此值时减少并发
+const double PSI_CRITICAL_PERCENT = 5.0;    // full avg10 达到此值时并发降到 1
+const double PSI_RECOVER_PERCENT = 2.0;     // some avg10 低于此值且余量充足时恢复并发
+const int GOVERNOR_MAX_BUILD_DELAY_S = 60;  // 没有其他批次可以等待释放内存时，构建最多推迟的时间
+
+class MemoryGovernor {
+private:
+    size_t reserve_mb;          // 低水位：余量低于此值时减少并发，低于一半时并发降到 1
+    int max_slots;              // 最多同时运行的批次数
+    int allowed_slots;          // 当前允许同时运行的批次数
+    int active_slots;           // 占用名额的批次数
+    int waiting_builds;         // 其中正在等待构建的批次数
+    size_t headroom_mb;
+    double some_avg10;
+    double full_avg10;
+    bool has_pressure;          // 系统是否提供 PSI
+    int samples_since_change;
+    bool stopping;
+    mutex governor_mutex;
+    condition_variable changed_cv;
+    thread sampler;
+
+    void sample() {
+        size_t headroom = get_memory_headroom_mb();
+        double some = 0.0;
+        double full = 0.0;
+        bool pressure = read_memory_pressure(some, full);
+
+        lock_guard<mutex> lock(governor_mutex);
+        headroom_mb = headroom;
+        some_avg10 = some;
+        full_avg10 = full;
+        has_pressure = pressure;
+        samples_since_change++;
+
+        bool critical = headroom_mb < reserve_mb / 2 || full_avg10 >= PSI_CRITICAL_PERCENT;
+        bool tight = headroom_mb < reserve_mb || some_avg10 >= PSI_THROTTLE_PERCENT;
+        bool relaxed = headroom_mb > reserve_mb * 2 && some_avg10 < PSI_RECOVER_PERCENT;
+
+        int previous = allowed_slots;
+        if (critical && allowed_slots > 1) {
+            allowed_slots = 1;
+        } else if (tight && allowed_slots > 1 && samples_since_change >= GOVERNOR_HOLD_SAMPLES) {
+            allowed_slots--;
+        } else if (relaxed && allowed_slots < max_slots && samples_since_change >= GOVERNOR_HOLD_SAMPLES) {
+            allowed_slots++;
+        }
+        if (allowed_slots != previous) {
+            samples_since_change = 0;
+            lock_guard<mutex> cout_lock(cout_mutex);
+            cout << "Memory governor: headroom " << headroom_mb << " MB";
+            if (has_pressure) {
+                cout << ", PSI some " << fixed << setprecision(1) << some_avg10 << "% full " << full_avg10 << "%";
+            }
+            cout << (allowed_slots < previous ? (critical ? " (critical)" : " (tight)") : " (recovered)")
+                 << ", concurrent batches " << previous << " -> " << allowed_slots
+                 << " (" << active_slots << " running)" << endl;
+        }
+        changed_cv.notify_all();
+    }
+
+    void run() {
+        unique_lock<mutex> lock(governor_mutex);
+        while (!stopping) {
+            changed_cv.wait_for(lock, chrono::milliseconds(GOVERNOR_INTERVAL_MS));
+            if (stopping) break;
+            lock.unlock();
+            sample();
+            lock.lock();
+        }
+    }
+
+public:
+    MemoryGovernor(size_t reserve, int slots)
+        : reserve_mb(reserve), max_slots(max(1, slots)), allowed_slots(max(1, slots)), active_slots(0), waiting_builds(0),
+          headroom_mb(0), some_avg10(0.0), full_avg10(0.0), has_pressure(false),
+          samples_since_change(GOVERNOR_HOLD_SAMPLES), stopping(false) {
+        headroom_mb = get_memory_headroom_mb();
+        has_pressure = read_memory_pressure(some_avg10, full_avg10);
+        cout << "Memory governor: headroom " << headroom_mb << " MB, low watermark " << reserve_mb << " MB, "
+             << (has_pressure ? "PSI available" : "PSI unavailable") << ", up to " << max_slots
+             << " concurrent batch(es)" << endl;
+        sampler = thread(&MemoryGovernor::run, this);
+    }
+
+    ~MemoryGovernor() {
+        {
+            lock_guard<mutex> lock(governor_mutex);
+            stopping = true;
+        }
+        changed_cv.notify_all();
+        sampler.join();
+    }
+
+    MemoryGovernor(const MemoryGovernor&) = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+    // 占用一个批次名额，名额用完时等待其他批次结束或内存回落
+    void acquireSlot() {
+        unique_lock<mutex> lock(governor_mutex);
+        changed_cv.wait(lock, [this] { return active_slots < allowed_slots; });
+        active_slots++;
+    }
+
+    void releaseSlot() {
+        {
+            lock_guard<mutex> lock(governor_mutex);
+            active_slots--;
+        }
+        changed_cv.notify_all();
+    }
+
+    // 构建自动机前等待足够的余量（预计构建峰值 + 低水位）
+    // 有其他批次在扫描时一直等到它们释放内存；否则最多等待 GOVERNOR_MAX_BUILD_DELAY_S 秒后照常构建
+    void awaitBuild(int batch_id, size_t expected_bytes) {
+        size_t need_mb = expected_bytes / (1024 * 1024) + reserve_mb;
+        unique_lock<mutex> lock(governor_mutex);
+        if (headroom_mb >= need_mb) return;
+
+        {
+            lock_guard<mutex> cout_lock(cout_mutex);
+            cout << "Memory governor: delaying Batch[" << batch_id + 1 << "] AC build (needs ~"
+                 << expected_bytes / (1024 * 1024) << " MB + " << reserve_mb << " MB reserve, headroom "
+                 << headroom_mb << " MB, " << active_slots << " batch(es) running)" << endl;
+        }
+        auto start = chrono::steady_clock::now();
+        bool timed_out = false;
+        waiting_builds++;
+        while (headroom_mb < need_mb) {
+            bool others_running = active_slots - waiting_builds > 0;
+            if (!others_running
+                && chrono::steady_clock::now() - start >= chrono::seconds(GOVERNOR_MAX_BUILD_DELAY_S)) {
+                timed_out = true;
+                break;
+            }
+            changed_cv.wait_for(lock, chrono::milliseconds(GOVERNOR_INTERVAL_MS));
+        }
+        waiting_builds--;
+        chrono::duration<double> waited = chrono::steady_clock::now() - start;
+        lock_guard<mutex> cout_lock(cout_mutex);
+        cout << "Memory governor: Batch[" << batch_id + 1 << "] AC build "
+             << (timed_out ? "proceeding without enough headroom" : "resumed") << " after "
+             << fixed << setprecision(1) << waited.count() << " s (headroom " << headroom_mb << " MB)" << endl;
+    }
+};
+
+// ============================================================================
+// 语料指纹：各输入文件的大小和均匀抽样的 17 段内容（含开头和结尾，每段 64 KB）
+// 每个输入最多读取约 1 MB，只用于检查点（另外加上修改时间）；抽样之外的改动不会改变指纹，
+// 结果缓存因此改用 corpus_content_hash 对全部内容做哈希
+// ============================================================================
+
+const size_t CORPUS_SAMPLE_BYTES = 64 * 1024;
+const size_t CORPUS_SAMPLES = 17;
+const size_t CORPUS_HASH_BLOCK = 4 << 20;
+
+static uint64_t corpus_fingerprint(const vector<string>& paths) {
+    uint64_t hash = HASH_SEED;
+    vector<char> buffer(CORPUS_SAMPLE_BYTES);
+    for (const auto& path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) continue;
+        uint64_t size = (uint64_t)st.st_size;
+        hash = hash_bytes((const char*)&size, sizeof(size), hash);
+        ifstream file(path, ios::binary);
+        uint64_t span = size > CORPUS_SAMPLE_BYTES ? size - CORPUS_SAMPLE_BYTES : 0;
+        for (size_t i = 0; i < CORPUS_SAMPLES; i++) {
+            file.clear();
+            file.seekg((streamoff)(span * i / (CORPUS_SAMPLES - 1)));
+            file.read(buffer.data(), buffer.size());
+            hash = hash_bytes(buffer.data(), (size_t)file.gcount(), hash);
+        }
+    }
+    return hash;
+}
+
+// 全部输入文件内容的哈希（依次为每个文件的大小和内容），不含修改时间，重新下载的同一份快照结果相同
+// 需要顺序读一遍语料，bytes 返回读取的总字节数；文件无法打开时返回 false
+static bool corpus_content_hash(const vector<string>& paths, uint64_t& hash, uint64_t& bytes) {
+    hash = HASH_SEED;
+    bytes = 0;
+    vector<char> buffer(CORPUS_HASH_BLOCK);
+    for (const auto& path : paths) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return false;
+        uint64_t size = 0;
+        uint64_t content = HASH_SEED;
+        while (file) {
+            file.read(buffer.data(), buffer.size());
+            size_t n = (size_t)file.gcount();
+            if (n == 0) break;
+            content = hash_words(buffer.data(), n, content);
+            size += n;
+        }
+        hash = hash_bytes((const char*)&size, sizeof(size), hash);
+        hash = hash_bytes((const char*)&content, sizeof(content), hash);
+        bytes += size;
+    }
+    return true;
+}
+
+// ============================================================================
+// 检查点与续跑（--resume）
+// 长时间的运行按间隔把进度写入输出文件旁的 <output>.ckpt：已领取的每个批次的词条范围，
+// 已完成批次的统计和输出文件长度，未完成批次已扫描到的行号和此前的全部计数
+// 续跑时跳过已完成的批次，未完成的批次从记录的行号继续，输出文件截回已完成批次写入的长度
+// 头部记录词典、输入文件（语料指纹和修改时间）和影响结果的选项的指纹，不一致时拒绝续跑
+// 文件先写到 .tmp 再改名，写到一半被中断时旧的检查点仍然完整
+// ============================================================================
+
+const char CHECKPOINT_MAGIC[8] = { 'W', 'F', 'C', 'K', 'P', 'T', '\0', '\0' };
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t batch_count;
+    uint64_t fingerprint;           // 见 run_fingerprint
+    uint64_t word_count;
+    uint64_t output_bytes;          // 已完成批次写入输出文件的总长度
+};
+
+struct CheckpointBatchHeader {
+    uint64_t start;
+    uint64_t end;
+    uint64_t resume_line;           // 此行之前的文本已经计数
+    uint32_t done;
+    uint32_t stats;                 // 保存了哪些统计：0 为没有计数，否则为 STAT_* | CHECKPOINT_HAS_DF
+    uint64_t shard_columns;         // 已完成的分片数（--per-shard）
+};
+
+const uint32_t CHECKPOINT_HAS_DF = 0x100;
+
+// 一个批次的检查点
+struct BatchCheckpoint {
+    BatchRange range;
+    bool done;
+    uint64_t resume_line;
+    WordStats stats;
+    vector<vector<int>> shard_counts;   // 已完成分片的文章数
+};
+
+// 检查点指纹：词表、语料指纹和各输入文件的修改时间，以及影响扫描方式和输出格式的选项
+static uint64_t run_fingerprint(uint64_t dict_fingerprint, const vector<string>& paths, const string& options_key) {
+    uint64_t hash = hash_bytes((const char*)&dict_fingerprint, sizeof(dict_fingerprint));
+    hash = hash_bytes(options_key.data(), options_key.size(), hash);
+    uint64_t corpus = corpus_fingerprint(paths);
+    hash = hash_bytes((const char*)&corpus, sizeof(corpus), hash);
+    for (const auto& path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) continue;
+        uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+        hash = hash_bytes((const char*)&mtime, sizeof(mtime), hash);
+    }
+    return hash;
+}
+
+class CheckpointStore {
+private:
+    string path;
+    uint64_t fingerprint;
+    size_t word_count;
+    double interval_seconds;
+    uint64_t output_bytes;
+    map<size_t, BatchCheckpoint> batches;  // 按批次的起始词条编号
+    mutex store_mutex;
+
+    template<typename T>
+    static void writeArray(ofstream& file, const vector<T>& values) {
+        file.write((const char*)values.data(), values.size() * sizeof(T));
+    }
+
+    template<typename T>
+    static bool readArray(ifstream& file, vector<T>& values, size_t count) {
+        values.resize(count);
+        file.read((char*)values.data(), count * sizeof(T));
+        return file.gcount() == (streamsize)(count * sizeof(T));
+    }
+
+    // 写出全部批次（调用者持有 store_mutex）
+    bool save() {
+        string tmp_path = path + ".tmp";
+        ofstream file(tmp_path, ios::binary | ios::trunc);
+        if (!file.is_open()) {
+            cerr << "Error opening file: " << tmp_path << endl;
+            return false;
+        }
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        header.version = CHECKPOINT_VERSION;
+        header.batch_count = (uint32_t)batches.size();
+        header.fingerprint = fingerprint;
+        header.word_count = word_count;
+        header.output_bytes = output_bytes;
+        file.write((const char*)&header, sizeof(header));
+
+        for (const auto& entry : batches) {
+            const BatchCheckpoint& batch = entry.second;
+            CheckpointBatchHeader record;
+            memset(&record, 0, sizeof(record));
+            record.start = batch.range.start;
+            record.end = batch.range.end;
+            record.resume_line = batch.resume_line;
+            record.done = batch.done ? 1 : 0;
+            if (!batch.stats.df.empty()) {
+                record.stats = CHECKPOINT_HAS_DF
+                    | (batch.stats.total.empty() ? 0 : STAT_TOTAL)
+                    | (batch.stats.maxPerArticle.empty() ? 0 : STAT_MAX)
+                    | (batch.stats.firstArticle.empty() ? 0 : STAT_FIRST);
+            }
+            record.shard_columns = batch.shard_counts.size();
+            file.write((const char*)&record, sizeof(record));
+            writeArray(file, batch.stats.df);
+            writeArray(file, batch.stats.total);
+            writeArray(file, batch.stats.maxPerArticle);
+            writeArray(file, batch.stats.firstArticle);
+            for (const auto& counts : batch.shard_counts) {
+                writeArray(file, counts);
+            }
+        }
+        file.close();
+        if (file.fail() || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            cerr << "Error writing checkpoint: " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    CheckpointStore(const string& file_path, uint64_t run_fingerprint, size_t words, double interval)
+        : path(file_path), fingerprint(run_fingerprint), word_count(words), interval_seconds(interval), output_bytes(0) {}
+
+    const string& getPath() const { return path; }
+    double getInterval() const { return interval_seconds; }
+    uint64_t getOutputBytes() const { return output_bytes; }
+
+    // 读取已有的检查点；文件不存在时 found 为 false，格式错误或指纹不一致时返回 false 并给出原因
+    bool load(bool& found, string& error) {
+        found = false;
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return true;
+        found = true;
+
+        CheckpointHeader header;
+        file.read((char*)&header, sizeof(header));
+        if (file.gcount() != (streamsize)sizeof(header) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+            error = "not a WikiFilter checkpoint";
+            return false;
+        }
+        if (header.version != CHECKPOINT_VERSION) {
+            error = "unsupported checkpoint version " + to_string(header.version);
+            return false;
+        }
+        if (header.fingerprint != fingerprint || header.word_count != word_count) {
+            error = "dictionary, input files or options changed since the checkpoint was written";
+            return false;
+        }
+        output_bytes = header.output_bytes;
+
+        for (uint32_t i = 0; i < header.batch_count; i++) {
+            CheckpointBatchHeader record;
+            file.read((char*)&record, sizeof(record));
+            if (file.gcount() != (streamsize)sizeof(record) || record.start >= record.end || record.end > word_count) {
+                error = "corrupt checkpoint";
+                return false;
+            }
+            BatchCheckpoint batch;
+            batch.range.start = record.start;
+            batch.range.end = record.end;
+            batch.done = record.done != 0;
+            batch.resume_line = record.resume_line;
+            size_t n = record.end - record.start;
+            bool ok = true;
+            if (record.stats & CHECKPOINT_HAS_DF) ok = ok && readArray(file, batch.stats.df, n);
+            if (record.stats & STAT_TOTAL) ok = ok && readArray(file, batch.stats.total, n);
+            if (record.stats & STAT_MAX) ok = ok && readArray(file, batch.stats.maxPerArticle, n);
+            if (record.stats & STAT_FIRST) ok = ok && readArray(file, batch.stats.firstArticle, n);
+            batch.shard_counts.resize(record.shard_columns);
+            for (auto& counts : batch.shard_counts) {
+                ok = ok && readArray(file, counts, n);
+            }
+            if (!ok) {
+                error = "truncated checkpoint";
+                return false;
+            }
+            batches[batch.range.start] = move(batch);
+        }
+        return true;
+    }
+
+    // 已完成的批次
+    vector<const BatchCheckpoint*> completed() const {
+        vector<const BatchCheckpoint*> result;
+        for (const auto& entry : batches) {
+            if (entry.second.done) result.push_back(&entry.second);
+        }
+        return result;
+    }
+
+    // 已领取但未完成的批次（续跑时先重新处理）
+    vector<BatchRange> pending() const {
+        vector<BatchRange> result;
+        for (const auto& entry : batches) {
+            if (!entry.second.done) result.push_back(entry.second.range);
+        }
+        return result;
+    }
+
+    // 已领取的词条范围的末尾，之后的词条由批次规划继续切分
+    size_t plannedEnd() const {
+        return batches.empty() ? 0 : batches.rbegin()->second.range.end;
+    }
+
+    // 开始处理一个批次：新批次记录下范围，续跑的批次取出已保存的计数，返回应从哪一行继续
+    uint64_t begin(const BatchRange& range, WordStats& stats, vector<vector<int>>& shard_counts) {
+        lock_guard<mutex> lock(store_mutex);
+        auto it = batches.find(range.start);
+        if (it != batches.end()) {
+            stats = it->second.stats;
+            shard_counts = it->second.shard_counts;
+            return it->second.resume_line;
+        }
+        BatchCheckpoint& batch = batches[range.start];
+        batch.range = range;
+        batch.done = false;
+        batch.resume_line = 0;
+        save();
+        return 0;
+    }
+
+    // 记录批次扫描到 resume_line 之前的计数
+    void update(const BatchRange& range, uint64_t resume_line, WordStats&& stats,
+                const vector<vector<int>>& shard_counts, size_t shard_columns) {
+        lock_guard<mutex> lock(store_mutex);
+        BatchCheckpoint& batch = batches[range.start];
+        batch.resume_line = resume_line;
+        batch.stats = move(stats);
+        batch.shard_counts.assign(shard_counts.begin(), shard_counts.begin() + shard_columns);
+        save();
+    }
+
+    // 分块优先调度：同时记录多个批次的进度，只写一次文件
+    void updateAll(const vector<BatchRange>& ranges, const vector<uint64_t>& resume_lines, vector<WordStats>&& stats) {
+        lock_guard<mutex> lock(store_mutex);
+        for (size_t i = 0; i < ranges.size(); i++) {
+            BatchCheckpoint& batch = batches[ranges[i].start];
+            batch.resume_line = resume_lines[i];
+            batch.stats = move(stats[i]);
+        }
+        save();
+    }
+
+    // 批次的结果已写入输出文件（调用者持有输出文件的锁，output_size 为写入后的长度）
+    // 保留批次的统计，续跑时用于 --partial 和 --cache；分片列已写入输出，不再保留
+    void complete(const BatchRange& range, const WordStats& stats, uint64_t output_size) {
+        lock_guard<mutex> lock(store_mutex);
+        BatchCheckpoint& batch = batches[range.start];
+        batch.done = true;
+        batch.stats = stats;
+        batch.shard_counts.clear();
+        output_bytes = output_size;
+        save();
+    }
+
+    // 全部完成后删除检查点
+    void remove() {
+        lock_guard<mutex> lock(store_mutex);
+        unlink(path.c_str());
+    }
+};
+
+// 一个批次扫描中的检查点：到达间隔后由扫描线程交出已扫描部分的计数
+// 多个线程共享一个自动机时，各线程在处理完当前的切片（分片）后停下，此时已领取的工作单元都已扫描完，
+// 由最后停下的线程汇总各线程的计数写出，然后一起继续；没有工作可领的线程调用 leave() 退出
+class ScanCheckpoint {
+private:
+    CheckpointStore& store;
+    BatchRange range;
+    int batch_id;
+    atomic<bool> requested;
+    chrono::steady_clock::time_point next_due;
+    mutex gate_mutex;
+    condition_variable gate_cv;
+    int active;
+    int waiting;
+    uint64_t generation;
+
+    template<typename Save>
+    void runRound(Save& save) {
+        save();
+        waiting = 0;
+        requested = false;
+        next_due = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>(store.getInterval()));
+        generation++;
+        gate_cv.notify_all();
+    }
+
+public:
+    ScanCheckpoint(CheckpointStore& checkpoint_store, const BatchRange& batch_range, int batch_idx, int threads)
+        : store(checkpoint_store), range(batch_range), batch_id(batch_idx), requested(false),
+          next_due(chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+              chrono::duration<double>(checkpoint_store.getInterval()))),
+          active(max(1, threads)), waiting(0), generation(0) {}
+
+    // 是否到了写检查点的时间（在两个工作单元之间调用）
+    bool due() {
+        if (!requested && chrono::steady_clock::now() >= next_due) {
+            requested = true;
+        }
+        return requested;
+    }
+
+    // 停下等待其他线程，最后一个到达的线程调用 save() 写出检查点
+    template<typename Save>
+    void arrive(Save save) {
+        unique_lock<mutex> lock(gate_mutex);
+        if (!requested) return;
+        if (++waiting == active) {
+            runRound(save);
+            return;
+        }
+        uint64_t round = generation;
+        gate_cv.wait(lock, [&] { return generation != round; });
+    }
+
+    // 线程中途加入扫描（按词典并行时其他批次的空闲线程），之后同样在切片之间参与检查点
+    void join() {
+        lock_guard<mutex> lock(gate_mutex);
+        active++;
+    }
+
+    // 线程没有更多工作，不再参与检查点；正在等待的线程由它代为写出
+    template<typename Save>
+    void leave(Save save) {
+        unique_lock<mutex> lock(gate_mutex);
+        active--;
+        if (requested && active > 0 && waiting == active) {
+            runRound(save);
+        }
+    }
+
+    // 交给 CheckpointStore 保存
+    void save(uint64_t resume_line, WordStats&& stats, const vector<vector<int>>& shard_counts, size_t shard_columns) {
+        store.update(range, resume_line, move(stats), shard_counts, shard_columns);
+        lock_guard<mutex> lock(cout_mutex);
+        cout << "Checkpoint: Batch[" << batch_id + 1 << "] scanned up to line " << resume_line
+             << ", saved to " << store.getPath() << endl;
+    }
+
+    // 分块优先调度：所有批次一起保存，line 为已扫描完的切片之后的第一行
+    void saveAll(const vector<BatchRange>& ranges, const vector<uint64_t>& resume_lines, vector<WordStats>&& stats,
+                 uint64_t line) {
+        store.updateAll(ranges, resume_lines, move(stats));
+        lock_guard<mutex> lock(cout_mutex);
+        cout << "Checkpoint: " << ranges.size() << " batches scanned up to line " << line
+             << ", saved to " << store.getPath() << endl;
+    }
+};
+
+// ============================================================================
+// 切片扫描与切片窃取
+// 一个批次的自动机按切片扫描全部输入：切片按顺序领取，参与的线程各自计数，批次结束时汇总。
+// 已领取的切片总是从头连续的一段，检查点只需记录领取到的位置，预读也按切片顺序进行。
+// 按词典并行时每个线程扫描自己的批次；领不到新批次的线程不再空等，而是加入还剩最多切片的批次
+// 一起领取，最后几个批次由所有线程共同扫完，不会只剩一个线程独自扫描整个语料
+// ============================================================================
+
+// 可以中途加入的切片扫描
+class SliceWork {
+public:
+    virtual ~SliceWork() {}
+
+    // 还没有领取的切片数
+    virtual size_t unclaimed() const = 0;
+
+    // 中途加入，返回计数器编号；切片已领取完时返回 -1
+    virtual int join() = 0;
+
+    // 领取并扫描切片直到领取完，返回扫描的切片数；probe_idx 见 ScanProbe
+    virtual size_t run(int slot, int probe_idx) = 0;
+};
+
+template<unsigned Stats>
+class SliceScan : public SliceWork {
+private:
+    const BatchAutomaton& ac;
+    const InputCorpus& corpus;
+    RunTelemetry* telemetry;
+    int batch_id;
+    size_t batch_words;
+    ScanProgress& progress;
+    ScanCounterTotals& scan_counters;
+    ScanCheckpoint* checkpoint;
+    uint64_t resume_line;
+    size_t slice_count;
+    atomic<size_t> next_slice;
+    unique_ptr<SliceReadahead> readahead;
+    int owners;                                           // 从一开始就参与的线程数，之后加入的是来帮忙的线程
+    WordStats stats;                                      // 续跑时为检查点中已有的计数
+    vector<unique_ptr<DocumentCounter<Stats>>> counters;  // 每个参与的线程一份，由 state_mutex 保护
+    int participants;                                     // 还在扫描的线程数
+    mutex state_mutex;
+    condition_variable done_cv;
+
+    // 所有参与的线程都停在切片之间，已领取的切片都已扫描完
+    void save() {
+        WordStats snapshot;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            snapshot = stats;
+            for (const auto& counter : counters) {
+                if (counter) snapshot.merge(counter->getStats());
+            }
+        }
+        uint64_t line = max<uint64_t>(resume_line, corpus.getSliceFirstLine(min(next_slice.load(), slice_count)));
+        vector<vector<int>> shard_counts;
+        checkpoint->save(line, move(snapshot), shard_counts, 0);
+    }
+
+public:
+    // threads 个线程从一开始参与（计数器编号 0 ~ threads-1）
+    // 续跑时从 resume_line 所在的切片开始，该切片中更早的行跳过
+    SliceScan(const BatchAutomaton& automaton, const InputCorpus& input, const FilterOptions& options, int batch,
+              size_t words, ScanProgress& scan_progress, ScanCounterTotals& totals, ScanCheckpoint* scan_checkpoint,
+              uint64_t from_line, WordStats&& resumed, int threads)
+        : ac(automaton), corpus(input), telemetry(options.telemetry.get()), batch_id(batch), batch_words(words),
+          progress(scan_progress), scan_counters(totals), checkpoint(scan_checkpoint), resume_line(from_line),
+          slice_count(input.getSliceCount()), next_slice(input.sliceOfLine(from_line)), owners(max(1, threads)),
+          stats(move(resumed)), counters(max(1, threads)), participants(max(1, threads)) {
+        // 放不进内存时参与的线程共用一个预读窗口，按切片顺序提前读入后面的分块
+        if (corpus.hasReadahead()) {
+            readahead.reset(new SliceReadahead(corpus, next_slice.load()));
+        }
+    }
+
+    size_t unclaimed() const override {
+        size_t next = next_slice.load();
+        return next < slice_count ? slice_count - next : 0;
+    }
+
+    int join() override {
+        int slot = 0;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if (unclaimed() == 0) return -1;
+            slot = (int)counters.size();
+            counters.emplace_back();
+            participants++;
+        }
+        if (checkpoint) {
+            checkpoint->join();
+        }
+        return slot;
+    }
+
+    size_t run(int slot, int probe_idx) override {
+        ScanProbe probe(telemetry, scan_counters, batch_id, probe_idx);
+        unique_ptr<DocumentCounter<Stats>> owned(new DocumentCounter<Stats>(batch_words));
+        DocumentCounter<Stats>& counter = *owned;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            counters[slot] = move(owned);
+        }
+        auto hit = [&counter](int idx) { counter.hit(idx); };
+        size_t local_lines = 0;
+        size_t local_bytes = 0;
+        size_t scanned = 0;
+        double io_wait = 0.0;
+
+        while (true) {
+            if (checkpoint && checkpoint->due()) {
+                checkpoint->arrive([this]() { save(); });
+            }
+            size_t slice_idx = next_slice.fetch_add(1);
+            if (slice_idx >= slice_count) break;
+
+            if (readahead) {
+                io_wait += readahead->acquire(slice_idx);
+            }
+            TraceSpan unit(telemetry, "scan", "slice", slice_idx);
+            corpus.processSlice(slice_idx, [&](const char* line_text, size_t line_len, size_t, size_t global_line) -> bool {
+                if (global_line < resume_line) return true;
+                counter.beginLine(global_line);
+                ac.search(line_text, line_len, hit);
+
+                local_lines++;
+                local_bytes += line_len;
+                if (local_lines == ScanProgress::LOG_CHECK_INTERVAL) {
+                    progress.add(local_lines, local_bytes);
+                    local_lines = 0;
+                    local_bytes = 0;
+                }
+                return true;
+            });
+            if (readahead) {
+                readahead->finish(slice_idx);
+            }
+            scanned++;
+        }
+        if (checkpoint) {
+            checkpoint->leave([this]() { save(); });
+        }
+        progress.add(local_lines, local_bytes);
+        progress.addIoWait(io_wait);
+        if (slot >= owners) {
+            progress.addStolenSlices(scanned);
+        }
+        {
+            lock_guard<mutex> lock(state_mutex);
+            participants--;
+        }
+        done_cv.notify_all();
+        return scanned;
+    }
+
+    // 等所有参与的线程扫完，汇总计数
+    WordStats finish() {
+        unique_lock<mutex> lock(state_mutex);
+        done_cv.wait(lock, [this] { return participants == 0; });
+        for (const auto& counter : counters) {
+            stats.merge(counter->getStats());
+        }
+        counters.clear();
+        return move(stats);
+    }
+};
+
+// 按词典并行时的切片窃取：登记正在扫描的批次，领不到新批次的线程从中挑选还剩最多切片的批次加入
+// 同时统计各线程帮忙和空闲的时间，扫描结束后输出收尾阶段的负载情况
+class TileScheduler {
+private:
+    struct WorkerRecord {
+        double help_seconds = 0.0;   // 扫描其他批次的时间
+        double idle_seconds = 0.0;   // 等待可加入的批次的时间
+        size_t stolen_slices = 0;
+        double exit_time = 0.0;      // 退出的时间（相对开始），之后直到所有线程结束都算空闲
+    };
+
+    chrono::steady_clock::time_point start;
+    mutex state_mutex;
+    condition_variable state_cv;
+    vector<SliceWork*> open;         // 切片还没领取完的批次
+    int starting;                    // 正在领取批次或构建自动机、还没开始扫描的线程数
+    double tail_start;               // 第一个线程领不到新批次的时间，之后为收尾阶段
+    vector<WorkerRecord> workers;
+
+    double now() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+public:
+    explicit TileScheduler(int threads)
+        : start(chrono::steady_clock::now()), starting(0), tail_start(-1.0), workers(threads) {}
+
+    // 领取批次之前调用：在它开始扫描或确认没有批次之前，空闲的线程不会退出
+    void expect() {
+        lock_guard<mutex> lock(state_mutex);
+        starting++;
+    }
+
+    // 没有领到批次
+    void cancel() {
+        lock_guard<mutex> lock(state_mutex);
+        starting--;
+        if (tail_start < 0) tail_start = now();
+        state_cv.notify_all();
+    }
+
+    // 批次的自动机已构建，开始扫描，其他线程可以加入
+    void publish(SliceWork* work) {
+        lock_guard<mutex> lock(state_mutex);
+        starting--;
+        open.push_back(work);
+        state_cv.notify_all();
+    }
+
+    // 批次的切片已领取完，不再接受加入（之后批次等已加入的线程扫完）
+    void retire(SliceWork* work) {
+        lock_guard<mutex> lock(state_mutex);
+        open.erase(find(open.begin(), open.end(), work));
+        state_cv.notify_all();
+    }
+
+    // 领不到新批次的线程反复加入还剩最多切片的批次，直到所有批次的切片都已领取
+    // 在持有 state_mutex 时加入，retire() 之后批次才会等待参与的线程并销毁，因此这里的批次一定有效
+    void help(int worker_idx) {
+        WorkerRecord& record = workers[worker_idx];
+        while (true) {
+            SliceWork* target = nullptr;
+            int slot = -1;
+            {
+                unique_lock<mutex> lock(state_mutex);
+                double wait_begin = now();
+                while (true) {
+                    size_t best = 0;
+                    target = nullptr;
+                    for (SliceWork* work : open) {
+                        size_t left = work->unclaimed();
+                        if (left > best) {
+                            best = left;
+                            target = work;
+                        }
+                    }
+                    if (target && (slot = target->join()) >= 0) break;
+                    if (target) continue;
+                    if (starting == 0) {
+                        record.exit_time = now();
+                        record.idle_seconds += record.exit_time - wait_begin;
+                        return;
+                    }
+                    state_cv.wait(lock);
+                }
+                record.idle_seconds += now() - wait_begin;
+            }
+            double help_begin = now();
+            record.stolen_slices += target->run(slot, -1);
+            record.help_seconds += now() - help_begin;
+        }
+    }
+
+    struct Summary {
+        double wall_seconds = 0.0;
+        double tail_seconds = 0.0;   // 第一个线程领不到新批次之后的时间
+        double idle_seconds = 0.0;   // 所有线程空闲时间之和
+        size_t stolen_slices = 0;
+    };
+
+    // 在所有线程退出后调用
+    Summary summarize() const {
+        Summary summary;
+        summary.wall_seconds = now();
+        summary.tail_seconds = tail_start >= 0 ? summary.wall_seconds - tail_start : 0.0;
+        for (const auto& record : workers) {
+            summary.idle_seconds += record.idle_seconds + max(0.0, summary.wall_seconds - record.exit_time);
+            summary.stolen_slices += record.stolen_slices;
+        }
+        return summary;
+    }
+
+    void printSummary() const {
+        Summary summary = summarize();
+        double capacity = summary.wall_seconds * workers.size();
+        cout << "Work stealing: " << summary.stolen_slices << " slices stolen, tail " << fixed << setprecision(2)
+             << summary.tail_seconds << "s after the first thread ran out of batches, idle " << summary.idle_seconds
+             << "s (" << setprecision(1) << (capacity > 0 ? summary.idle_seconds * 100.0 / capacity : 0.0)
+             << "% of " << workers.size() << " threads x " << setprecision(2) << summary.wall_seconds << "s)" << endl;
+        for (size_t i = 0; i < workers.size(); i++) {
+            const WorkerRecord& record = workers[i];
+            cout << "  Worker[" << i + 1 << "] helped " << record.help_seconds << "s (" << record.stolen_slices
+                 << " slices), idle " << record.idle_seconds + max(0.0, summary.wall_seconds - record.exit_time)
+                 << "s" << endl;
+        }
+    }
+};
+
+// ============================================================================
+// 使用 AC 自动机处理一个批次的词条（使用分块加载器）
+// scan_threads > 1 时为数据并行模式：所有线程共享这一个自动机，
+// 从队列中领取按行对齐的切片扫描，各自计数，最后汇总；
+// 需要分片计数时改为以整个分片为单位领取，每个分片由一个线程计数
+// 流式输入由读取线程解压并填充数据块环，扫描线程从环中领取数据块
+// 返回 false 表示输入读取失败（此时不写出结果）
+// ============================================================================
+
+const size_t STREAM_BLOCK_BYTES = 4 * 1024 * 1024;  // 流式输入每个数据块的大小
+
+// 扫描全部输入，统计本批次词条的 WordStats（--per-shard 时另外记录每个分片的文章数）
+// Stats 为 --columns 选择的统计掩码，每种组合实例化一份，扫描循环中不判断选择了哪些列
+// checkpoint 非空时按间隔写出检查点；续跑时 stats、shard_counts 为检查点中 resume_line 之前的计数
+// tiles 非空时（按词典并行）本线程按切片扫描，并允许领不到批次的其他线程加入
+// 返回 false 表示流式输入读取失败
+template<unsigned Stats>
+static bool scan_batch(const BatchAutomaton& ac, const InputCorpus& corpus, const FilterOptions& options,
+                       int batch_id, int scan_threads, size_t batch_words, ScanProgress& progress,
+                       ScanCounterTotals& scan_counters, WordStats& stats, vector<vector<int>>& shard_counts,
+                       ScanCheckpoint* checkpoint, uint64_t resume_line, TileScheduler* tiles)
+{
+    RunTelemetry* telemetry = options.telemetry.get();
+    size_t shard_count = corpus.getShardCount();
+
+    if (corpus.isStreamed()) {
+        // 流式输入：一个读取线程负责解压和按行切块，扫描线程领取数据块
+        int consumers = max(1, scan_threads);
+        atomic<bool> read_ok(true);
+
+        auto consume = [&](StreamReader& reader, DocumentCounter<Stats>& counter) {
+            auto hit = [&counter](int idx) { counter.hit(idx); };
+            size_t local_lines = 0;
+            size_t local_bytes = 0;
+            auto scan_line = [&](const char* line_text, size_t line_len, size_t, size_t global_line) -> bool {
+                counter.beginLine(global_line);
+                ac.search(line_text, line_len, hit);
+
+                local_lines++;
+                local_bytes += line_len;
+                if (local_lines == ScanProgress::LOG_CHECK_INTERVAL) {
+                    progress.add(local_lines, local_bytes);
+                    local_lines = 0;
+                    local_bytes = 0;
+                }
+                return true;
+            };
+            while (StreamBlock* block = reader.acquire()) {
+                TraceSpan unit(telemetry, "scan", "block at line", block->first_line);
+                StreamingFileLoader::processLines(block->data.data(), block->size, block->shard, block->first_line, scan_line);
+                reader.recycle(block);
+            }
+            progress.add(local_lines, local_bytes);
+        };
+
+        vector<thread> threads;
+        if (options.per_shard) {
+            // 以输入为工作单元：每个线程领取一个输入，用自己的读取线程解压
+            // 各输入的行号都从 0 开始，第一次出现的行号在汇总时加上前面输入的行数
+            shard_counts.resize(shard_count);
+            vector<WordStats> shard_stats(shard_count);
+            vector<size_t> shard_lines(shard_count, 0);
+            atomic<size_t> next_shard(0);
+            auto scanner = [&](int thread_idx) {
+                ScanProbe probe(telemetry, scan_counters, batch_id, thread_idx);
+                while (true) {
+                    size_t shard_idx = next_shard.fetch_add(1);
+                    if (shard_idx >= shard_count) break;
+
+                    TraceSpan unit(telemetry, "scan", "shard", shard_idx);
+                    StreamReader reader(corpus.getPaths(), shard_idx, shard_idx + 1, STREAM_BLOCK_BYTES, 3);
+                    reader.start();
+                    DocumentCounter<Stats> counter(batch_words);
+                    consume(reader, counter);
+                    if (!reader.finish()) read_ok = false;
+                    progress.addIoWait(reader.getWaitSeconds());
+                    shard_lines[shard_idx] = reader.getLineCount();
+                    shard_stats[shard_idx] = counter.takeStats();
+                }
+            };
+            for (int i = 0; i < consumers; i++) {
+                threads.emplace_back(scanner, i);
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+
+            uint64_t line_base = 0;
+            for (size_t shard_idx = 0; shard_idx < shard_count; shard_idx++) {
+                WordStats& part = shard_stats[shard_idx];
+                for (uint64_t& first : part.firstArticle) {
+                    if (first != NO_ARTICLE) first += line_base;
+                }
+                line_base += shard_lines[shard_idx];
+                stats.merge(part);
+                shard_counts[shard_idx] = move(part.df);
+                part = WordStats();
+            }
+        } else {
+            // 所有输入依次进入同一个环，扫描线程各自计数，最后汇总
+            StreamReader reader(corpus.getPaths(), 0, shard_count, STREAM_BLOCK_BYTES, (size_t)consumers * 2 + 2);
+            reader.start();
+            vector<unique_ptr<DocumentCounter<Stats>>> thread_counters(consumers);
+            for (int i = 0; i < consumers; i++) {
+                thread_counters[i].reset(new DocumentCounter<Stats>(batch_words));
+            }
+            for (int i = 1; i < consumers; i++) {
+                threads.emplace_back([&, i]() {
+                    ScanProbe probe(telemetry, scan_counters, batch_id, i);
+                    consume(reader, *thread_counters[i]);
+                });
+            }
+            {
+                ScanProbe probe(telemetry, scan_counters, batch_id, -1);
+                consume(reader, *thread_counters[0]);
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            if (!reader.finish()) read_ok = false;
+            progress.addIoWait(reader.getWaitSeconds());
+
+            for (const auto& counter : thread_counters) {
+                stats.merge(counter->getStats());
+            }
+        }
+        return read_ok;
+    } else if (scan_threads <= 1 && !tiles) {
+        // 使用流式处理依次遍历所有分片的所有行
+        // 续跑时 stats 和 shard_counts 为检查点中已有的计数，从 resume_line 继续
+        DocumentCounter<Stats> counter(batch_words);
+        counter.restore(move(stats));
+        vector<int> shard_base;  // --per-shard：当前分片开始时的累计文章数
+        if (options.per_shard) {
+            shard_base.assign(batch_words, 0);
+            for (const auto& counts : shard_counts) {
+                for (size_t i = 0; i < batch_words; i++) {
+                    shard_base[i] += counts[i];
+                }
+            }
+        }
+        auto hit = [&counter](int idx) { counter.hit(idx); };
+        size_t local_lines = 0;
+        size_t local_bytes = 0;
+        auto scan_line = [&](const char* line_text, size_t line_len, size_t, size_t global_line) -> bool {
+            if (line_len == 0 || global_line < resume_line) return true;
+
+            // 计数（每行最多计1次）
+            counter.beginLine(global_line);
+            ac.search(line_text, line_len, hit);
+
+            local_lines++;
+            local_bytes += line_len;
+            if (local_lines == ScanProgress::LOG_CHECK_INTERVAL) {
+                progress.add(local_lines, local_bytes);
+                local_lines = 0;
+                local_bytes = 0;
+                if (checkpoint && checkpoint->due()) {
+                    checkpoint->arrive([&]() {
+                        WordStats snapshot = counter.getStats();
+                        checkpoint->save(global_line + 1, move(snapshot), shard_counts, shard_counts.size());
+                    });
+                }
+            }
+
+            return true;  // 继续处理
+        };
+        // --per-shard 时从第一个没有记录的分片开始（检查点可能恰好在分片末尾）
+        size_t first_shard = options.per_shard ? shard_counts.size() : corpus.shardOfLine(resume_line);
+        ScanProbe probe(telemetry, scan_counters, batch_id, -1);
+        ReadaheadWindow window;
+        for (size_t shard_idx = first_shard; shard_idx < shard_count; shard_idx++) {
+            TraceSpan unit(telemetry, "scan", "shard", shard_idx);
+            corpus.streamShard(shard_idx, scan_line, resume_line, &window);
+            if (options.per_shard) {
+                vector<int> counts = counter.getCounts();
+                for (size_t i = 0; i < batch_words; i++) {
+                    counts[i] -= shard_base[i];
+                }
+                shard_base = counter.getCounts();
+                shard_counts.push_back(move(counts));
+            }
+        }
+        progress.add(local_lines, local_bytes);
+        progress.addIoWait(window.wait_seconds);
+        stats = counter.takeStats();
+    } else if (options.per_shard) {
+        // 分片并行：以分片为工作单元，每个分片由一个线程完整计数
+        // 检查点只在分片之间写出，续跑时从第一个没有记录的分片开始
+        size_t first_shard = shard_counts.size();
+        shard_counts.resize(shard_count);
+        atomic<size_t> next_shard(first_shard);
+        mutex stats_mutex;
+        auto save = [&]() {
+            size_t done = min(next_shard.load(), shard_count);
+            WordStats snapshot = stats;
+            checkpoint->save(corpus.getShardFirstLine(done), move(snapshot), shard_counts, done);
+        };
+
+        auto scanner = [&](int thread_idx) {
+            ScanProbe probe(telemetry, scan_counters, batch_id, thread_idx);
+            ReadaheadWindow window;
+            size_t local_lines = 0;
+            size_t local_bytes = 0;
+
+            while (true) {
+                if (checkpoint && checkpoint->due()) {
+                    checkpoint->arrive(save);
+                }
+                size_t shard_idx = next_shard.fetch_add(1);
+                if (shard_idx >= shard_count) break;
+
+                TraceSpan unit(telemetry, "scan", "shard", shard_idx);
+                DocumentCounter<Stats> counter(batch_words);
+                auto hit = [&counter](int idx) { counter.hit(idx); };
+                corpus.streamShard(shard_idx, [&](const char* line_text, size_t line_len, size_t, size_t global_line) -> bool {
+                    counter.beginLine(global_line);
+                    ac.search(line_text, line_len, hit);
+
+                    local_lines++;
+                    local_bytes += line_len;
+                    if (local_lines == ScanProgress::LOG_CHECK_INTERVAL) {
+                        progress.add(local_lines, local_bytes);
+                        local_lines = 0;
+                        local_bytes = 0;
+                    }
+                    return true;
+                }, 0, &window);
+                shard_counts[shard_idx] = counter.getCounts();
+                lock_guard<mutex> lock(stats_mutex);
+                stats.merge(counter.getStats());
+            }
+            if (checkpoint) {
+                checkpoint->leave(save);
+            }
+            progress.add(local_lines, local_bytes);
+            progress.addIoWait(window.wait_seconds);
+        };
+
+        vector<thread> threads;
+        for (int i = 0; i < scan_threads; i++) {
+            threads.emplace_back(scanner, i);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+    } else {
+        // 数据并行：每个线程独立计数，避免原子操作和伪共享，最后汇总
+        // 按词典并行时只有本线程从一开始扫描，切片领取完之前其他批次的空闲线程可以加入
+        SliceScan<Stats> scan(ac, corpus, options, batch_id, batch_words, progress, scan_counters,
+                              checkpoint, resume_line, move(stats), tiles ? 1 : scan_threads);
+        if (tiles) {
+            tiles->publish(&scan);
+            scan.run(0, -1);
+            tiles->retire(&scan);
+        } else {
+            vector<thread> threads;
+            for (int i = 0; i < scan_threads; i++) {
+                threads.emplace_back([&scan, i]() { scan.run(i, i); });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+        stats = scan.finish();
+    }
+    return true;
+}
+
+// 追加一个批次的结果：按 --columns 的顺序输出各统计列，--per-shard 时再追加每个分片的文章数
+// 有检查点时在同一把锁内记录批次完成；返回有匹配的词条数，match_total 为所有词条的行计数之和
+static int write_batch_rows(const WordList& words, const BatchRange& range, const FilterOptions& options,
+                            const WordStats& stats, const vector<vector<int>>& shard_counts,
+                            const string& output_path, CheckpointStore* checkpoint, uint64_t& match_total)
+{
+    stringstream ss;
+    int match_count = 0;
+    match_total = 0;
+    for (size_t i = range.start; i < range.end; i++) {
+        size_t word = i - range.start;
+        int count = stats.df[word];
+        match_total += count;
+        if (count > 0) {
+            ss << words[i];
+            write_stat_columns(ss, options.columns, stats, word);
+            for (const auto& counts : shard_counts) {
+                ss << "\t" << counts[word];
+            }
+            ss << "\n";
+            match_count++;
+        }
+    }
+
+    lock_guard<mutex> lock(file_mutex);
+    ofstream file(output_path, ios::app);
+    if (file.is_open()) {
+        file << ss.str();
+        file.close();
+    }
+    // 与写出在同一把锁内记录完成，检查点中的输出长度总是对应已完成的批次
+    struct stat st;
+    if (checkpoint && stat(output_path.c_str(), &st) == 0) {
+        checkpoint->complete(range, stats, (uint64_t)st.st_size);
+    }
+    return match_count;
+}
+
+bool process_batch_with_ac(
+    const WordList& words,
+    const BatchRange& range,
+    const InputCorpus& corpus,
+    const string& output_path,
+    int batch_id,
+    int total_batches,
+    const FilterOptions& options,
+    int scan_threads = 1,
+    const IndexFile* index = nullptr,
+    WordStats* word_stats = nullptr,
+    BatchPlanner* planner = nullptr,
+    CheckpointStore* checkpoint = nullptr,
+    TileScheduler* tiles = nullptr)
+{
+    auto batch_start = chrono::high_resolution_clock::now();
+    RunTelemetry* telemetry = options.telemetry.get();
+    double build_begin = telemetry ? telemetry->now() : 0.0;
+    ScanCounterTotals scan_counters;  // --perf-counters 时所有扫描线程的硬件计数器合计
+
+    // 1. 构建 AC 自动机（有预编译索引时直接使用索引中的自动机）
+    //    按词典并行时各线程同时构建自己的批次，单线程构建；共享一个自动机时由所有扫描线程一起构建
+    int build_threads = options.build_threads > 0 ? options.build_threads : max(1, scan_threads);
+    unique_ptr<BatchAutomaton> ac_ptr(index ? new BatchAutomaton(*index)
+                                            : new BatchAutomaton(words, range, options.engine, options.folding.get(),
+                                                                 build_threads));
+    const BatchAutomaton& ac = *ac_ptr;
+    if (planner) {
+        planner->record(batch_id, ac.getBuildPeakBytes(), ac.memoryBytes());
+    }
+
+    // 2. 为本批次词条创建计数器
+    size_t batch_words = range.end - range.start;
+    size_t shard_count = corpus.getShardCount();
+    vector<vector<int>> shard_counts;  // 仅 --per-shard 时使用，每个分片一列
+
+    // 有检查点时记录本批次；续跑的批次取出检查点中已有的计数，从记录的行继续扫描
+    WordStats stats;
+    uint64_t resume_line = 0;
+    unique_ptr<ScanCheckpoint> scan_checkpoint;
+    if (checkpoint) {
+        resume_line = checkpoint->begin(range, stats, shard_counts);
+        scan_checkpoint.reset(new ScanCheckpoint(*checkpoint, range, batch_id, scan_threads));
+    }
+
+    // 3. 流式扫描所有行（每个分块处理完后释放内存）
+    auto scan_start = chrono::high_resolution_clock::now();
+    chrono::duration<double> ac_build_time = scan_start - batch_start;  // AC构建时间
+    double scan_begin = telemetry ? telemetry->now() : 0.0;
+    ScanProgress progress(batch_id, total_batches, corpus.getLineCount(), scan_start);
+
+    // 首次打印：显示AC构建时间和内存
+    {
+        lock_guard<mutex> lock(cout_mutex);
+        size_t process_mem_mb = get_process_memory_mb();
+        size_t base_mem_mb = g_base_memory_mb.load();
+        size_t ac_total_mb = (process_mem_mb > base_mem_mb) ? (process_mem_mb - base_mem_mb) : 0;
+        cout << "Batch[" << batch_id + 1 << "/" << total_batches << "] "
+             << "AC build time: " << fixed << setprecision(2) << ac_build_time.count() << "s";
+        if (!index && build_threads > 1) {
+            cout << " (" << build_threads << " threads)";
+        }
+        cout << ", words: " << batch_words << ", ";
+        ac.describe(cout);
+        cout << ", MEM: " << process_mem_mb << " MB"
+             << " (+" << ac_total_mb << " MB for all AC)";
+        if (corpus.isStreamed()) {
+            cout << ", streaming " << shard_count << " input(s) with " << max(1, scan_threads) << " scan thread(s)";
+        } else if (scan_threads > 1) {
+            if (options.per_shard) {
+                cout << ", scanning " << shard_count << " shards with " << scan_threads << " threads";
+            } else {
+                cout << ", scanning " << corpus.getSliceCount() << " slices with " << scan_threads << " threads";
+            }
+        }
+        if (resume_line > 0) {
+            cout << ", resuming at line " << resume_line;
+        }
+        cout << ", starting scan..." << endl;
+    }
+
+    static bool (*const scanners[STAT_MASK_COUNT])(const BatchAutomaton&, const InputCorpus&, const FilterOptions&,
+                                                   int, int, size_t, ScanProgress&, ScanCounterTotals&,
+                                                   WordStats&, vector<vector<int>>&, ScanCheckpoint*, uint64_t,
+                                                   TileScheduler*) = {
+        scan_batch<0>, scan_batch<1>, scan_batch<2>, scan_batch<3>,
+        scan_batch<4>, scan_batch<5>, scan_batch<6>, scan_batch<7>,
+    };
+    if (!scanners[stat_mask(options.columns)](ac, corpus, options, batch_id, scan_threads, batch_words,
+                                              progress, scan_counters, stats, shard_counts,
+                                              scan_checkpoint.get(), resume_line, tiles)) {
+        lock_guard<mutex> lock(cout_mutex);
+        cerr << "Batch[" << batch_id + 1 << "/" << total_batches << "] input stream failed, no output written" << endl;
+        return false;
+    }
+    double scan_end = telemetry ? telemetry->now() : 0.0;
+
+    // 按词条编号记录统计，供写出二进制部分结果和更新结果缓存（各批次的词条范围互不重叠）
+    if (word_stats) {
+        word_stats->store(range.start, stats);
+    }
+
+    // 4. 输出结果并写入文件
+    uint64_t match_total = 0;  // 所有词条的行计数之和
+    int match_count = write_batch_rows(words, range, options, stats, shard_counts, output_path, checkpoint, match_total);
+
+    auto batch_end = chrono::high_resolution_clock::now();
+    chrono::duration<double> scan_duration = batch_end - scan_start;
+    double scan_mb_per_sec = scan_duration.count() > 0
+        ? progress.getBytesProcessed() / (1024.0 * 1024.0) / scan_duration.count() : 0.0;
+
+    {
+        lock_guard<mutex> lock(cout_mutex);
+        cout << "Batch[" << batch_id + 1 << "/" << total_batches << "] "
+             << "words: " << (range.end - range.start)
+             << ", matched: " << match_count
+             << ", AC build: " << fixed << setprecision(2) << ac_build_time.count() << "s"
+             << ", scan: " << scan_duration.count() << "s";
+        if (corpus.hasReadahead() || corpus.isStreamed()) {
+            cout << ", io wait: " << progress.getIoWaitSeconds() << "s";
+        }
+        if (progress.getStolenSlices() > 0) {
+            cout << ", slices stolen: " << progress.getStolenSlices();
+        }
+        cout << " (" << engine_name(ac.getEngine()) << ", " << setprecision(1) << scan_mb_per_sec << " MB/s";
+        if (scan_counters.has(PERF_CYCLES) && scan_counters.has(PERF_INSTRUCTIONS) && scan_counters.get(PERF_CYCLES) > 0) {
+            cout << ", IPC " << setprecision(2)
+                 << (double)scan_counters.get(PERF_INSTRUCTIONS) / scan_counters.get(PERF_CYCLES);
+        }
+        cout << ")" << endl;
+    }
+
+    if (telemetry) {
+        double batch_end_time = telemetry->now();
+        string label = "Batch[" + to_string(batch_id + 1) + "]";
+        telemetry->span(label + " build", "batch", build_begin, scan_begin);
+        telemetry->span(label + " scan", "batch", scan_begin, scan_end);
+        telemetry->span(label + " output", "batch", scan_end, batch_end_time);
+
+        size_t bytes_scanned = progress.getBytesProcessed();
+        JsonObject record;
+        record.add("batch", batch_id + 1)
+              .add("words", batch_words)
+              .add("engine", engine_name(ac.getEngine()))
+              .add("states", ac.getStateCount())
+              .add("dense_states", ac.getDenseStateCount())
+              .add("edges", ac.getEdgeCount())
+              .add("ac_bytes", ac.memoryBytes())
+              .add("ac_build_peak_bytes", ac.getBuildPeakBytes())
+              .add("build_seconds", scan_begin - build_begin)
+              .add("scan_seconds", scan_end - scan_begin)
+              .add("io_wait_seconds", progress.getIoWaitSeconds())
+              .add("stolen_slices", progress.getStolenSlices())
+              .add("output_seconds", batch_end_time - scan_end)
+              .add("scan_threads", max(1, scan_threads))
+              .add("build_threads", index ? 0 : build_threads)
+              .add("bytes_scanned", bytes_scanned)
+              .add("lines_scanned", progress.getLinesProcessed())
+              .add("bytes_per_second", scan_end > scan_begin ? bytes_scanned / (scan_end - scan_begin) : 0.0)
+              .add("matched_words", match_count)
+              .add("match_total", match_total)
+              .add("peak_rss_mb", get_peak_memory_mb());
+        if (telemetry->perfEnabled()) {
+            record.addRaw("counters", scan_counters.json(bytes_scanned));
+        }
+        telemetry->batch(record);
+    }
+    return true;
+}
+
+// ============================================================================
+// 分块优先调度（--schedule=chunk）
+// 批次优先时每个批次都把语料完整扫描一遍，语料放不进内存时读盘量为批次数 × 语料大小；
+// 分块优先先依次构建所有批次的自动机，再把语料扫描一遍：线程领取切片后依次用每个批次的自动机扫描，
+// 分块中的切片全部扫描完才释放，语料只读一遍
+// 自动机放不进内存预算时，较早构建的自动机写入输出文件旁的临时索引文件再只读映射回来（文件随即删除），
+// 由页缓存按需换入；classic 引擎不能写入索引文件，只能常驻
+// 每个扫描线程为每个批次各有一份计数器，最后汇总；检查点在切片之间写出，所有批次一起保存
+// ============================================================================
+
+// 分块优先调度中的一个批次
+struct ScheduledBatch {
+    BatchRange range;
+    int batch_id = 0;
+    unique_ptr<IndexFile> spill;     // 换出到临时索引文件后的映射（先于 ac 声明，后于 ac 析构）
+    unique_ptr<BatchAutomaton> ac;
+    double build_seconds = 0.0;
+    size_t build_peak_bytes = 0;
+    WordStats stats;                 // 续跑时为检查点中的计数，扫描结束后为全部计数
+    uint64_t resume_line = 0;        // 续跑时从该行开始计数
+};
+
+// 把批次的自动机写入临时索引文件，再只读映射回来替换内存中的自动机
+static bool spill_automaton(ScheduledBatch& batch, const string& path, string& error) {
+    {
+        IndexWriter writer(path);
+        if (!writer.isOpen()) {
+            error = "cannot open " + path;
+            return false;
+        }
+        if (!batch.ac->save(writer) || !writer.finish()) {
+            unlink(path.c_str());
+            error = "cannot write " + path;
+            return false;
+        }
+    }
+    unique_ptr<IndexFile> index(new IndexFile());
+    bool opened = index->open(path, error, false);  // 刚写出，不必读一遍核对校验和
+    unlink(path.c_str());  // 映射保持文件内容，进程退出后自动回收
+    if (!opened) return false;
+
+    batch.ac.reset(new BatchAutomaton(*index));
+    batch.spill = move(index);
+    return true;
+}
+
+// 扫描一遍语料，每个切片依次交给所有批次的自动机，统计结果汇总到各批次的 stats
+// 与 scan_batch 一样按 Stats 实例化；续跑时各批次跳过自己的 resume_line 之前的行
+template<unsigned Stats>
+static void scan_chunk_major(vector<ScheduledBatch>& batches, const InputCorpus& corpus, const FilterOptions& options,
+                             int scan_threads, ScanProgress& progress, ScanCounterTotals& scan_counters,
+                             ScanCheckpoint* checkpoint)
+{
+    RunTelemetry* telemetry = options.telemetry.get();
+    int threads = max(1, scan_threads);
+    size_t batch_count = batches.size();
+    uint64_t first_line = numeric_limits<uint64_t>::max();
+    vector<BatchRange> ranges;
+    for (const auto& batch : batches) {
+        first_line = min(first_line, batch.resume_line);
+        ranges.push_back(batch.range);
+    }
+
+    size_t slice_count = corpus.getSliceCount();
+    size_t first_slice = corpus.sliceOfLine(first_line);
+    atomic<size_t> next_slice(first_slice);
+    unique_ptr<SliceReadahead> readahead;
+    if (corpus.hasReadahead()) {
+        readahead.reset(new SliceReadahead(corpus, first_slice));
+    }
+
+    // 每个线程为每个批次各有一份计数器
+    vector<vector<unique_ptr<DocumentCounter<Stats>>>> thread_counters(threads);
+    for (auto& counters : thread_counters) {
+        for (const auto& batch : batches) {
+            counters.emplace_back(new DocumentCounter<Stats>(batch.range.end - batch.range.start));
+        }
+    }
+
+    auto save = [&]() {
+        // 所有线程都停在切片之间，已领取的切片都已扫描完
+        uint64_t line = corpus.getSliceFirstLine(min(next_slice.load(), slice_count));
+        vector<uint64_t> lines;
+        vector<WordStats> snapshots;
+        for (size_t b = 0; b < batch_count; b++) {
+            WordStats snapshot = batches[b].stats;
+            for (const auto& counters : thread_counters) {
+                snapshot.merge(counters[b]->getStats());
+            }
+            lines.push_back(max<uint64_t>(batches[b].resume_line, line));
+            snapshots.push_back(move(snapshot));
+        }
+        checkpoint->saveAll(ranges, lines, move(snapshots), line);
+    };
+
+    auto scanner = [&](int thread_idx) {
+        ScanProbe probe(telemetry, scan_counters, batches.front().batch_id, thread_idx);
+        auto& counters = thread_counters[thread_idx];
+        size_t local_lines = 0;
+        size_t local_bytes = 0;
+        double io_wait = 0.0;
+
+        while (true) {
+            if (checkpoint && checkpoint->due()) {
+                checkpoint->arrive(save);
+            }
+            size_t slice_idx = next_slice.fetch_add(1);
+            if (slice_idx >= slice_count) break;
+
+            if (readahead) {
+                io_wait += readahead->acquire(slice_idx);
+            }
+            TraceSpan unit(telemetry, "scan", "slice", slice_idx);
+            for (size_t b = 0; b < batch_count; b++) {
+                const BatchAutomaton& ac = *batches[b].ac;
+                DocumentCounter<Stats>& counter = *counters[b];
+                uint64_t resume_line = batches[b].resume_line;
+                auto hit = [&counter](int idx) { counter.hit(idx); };
+                corpus.processSlice(slice_idx, [&](const char* line_text, size_t line_len, size_t, size_t global_line) -> bool {
+                    // 进度按语料计：只在第一个批次的扫描中累计行数和字节数
+                    if (b == 0 && global_line >= first_line) {
+                        local_lines++;
+                        local_bytes += line_len;
+                        if (local_lines == ScanProgress::LOG_CHECK_INTERVAL) {
+                            progress.add(local_lines, local_bytes);
+                            local_lines = 0;
+                            local_bytes = 0;
+                        }
+                    }
+                    if (global_line < resume_line) return true;
+                    counter.beginLine(global_line);
+                    ac.search(line_text, line_len, hit);
+                    return true;
+                });
+            }
+            if (readahead) {
+                readahead->finish(slice_idx);
+            }
+        }
+        if (checkpoint) {
+            checkpoint->leave(save);
+        }
+        progress.add(local_lines, local_bytes);
+        progress.addIoWait(io_wait);
+    };
+
+    vector<thread> workers;
+    for (int i = 1; i < threads; i++) {
+        workers.emplace_back(scanner, i);
+    }
+    scanner(0);
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    for (size_t b = 0; b < batch_count; b++) {
+        for (const auto& counters : thread_counters) {
+            batches[b].stats.merge(counters[b]->getStats());
+        }
+    }
+}
+
+// 分块优先处理全部批次：依次构建所有批次的自动机，常驻的自动机超出 resident_budget 时
+// 把较晚构建的常驻自动机换出，然后扫描一遍语料并按批次顺序写出结果
+// 返回 false 表示自动机换出失败
+static bool process_batches_chunk_major(const WordList& words, const InputCorpus& corpus,
+                                        const string& output_path, const FilterOptions& options, int num_threads,
+                                        size_t resident_budget, BatchPlanner& planner, WordStats* word_stats,
+                                        CheckpointStore* checkpoint)
+{
+    RunTelemetry* telemetry = options.telemetry.get();
+    int build_threads = options.build_threads > 0 ? options.build_threads : max(1, num_threads);
+    bool can_spill = options.engine != SearchEngine::Classic;
+    vector<ScheduledBatch> batches;
+    size_t resident_bytes = 0;
+    size_t spilled_bytes = 0;
+
+    // 把最晚构建的常驻自动机换出，直到常驻部分加上 extra_bytes 不超过预算
+    auto spill_until = [&](size_t extra_bytes) -> bool {
+        for (size_t i = batches.size(); i-- > 0 && resident_bytes + extra_bytes > resident_budget;) {
+            ScheduledBatch& batch = batches[i];
+            if (batch.spill) continue;
+            size_t bytes = batch.ac->memoryBytes();
+            string path = output_path + ".batch" + to_string(batch.batch_id + 1) + ".idx";
+            string error;
+            if (!spill_automaton(batch, path, error)) {
+                cerr << "Error spilling Batch[" << batch.batch_id + 1 << "] automaton: " << error << endl;
+                return false;
+            }
+            resident_bytes -= bytes;
+            spilled_bytes += bytes;
+            lock_guard<mutex> lock(cout_mutex);
+            cout << "Batch[" << batch.batch_id + 1 << "] automaton spilled to a temporary index ("
+                 << bytes / (1024 * 1024) << " MB), paged in from the page cache while scanning" << endl;
+        }
+        return true;
+    };
+
+    // 1. 依次构建所有批次的自动机；构建前为构建峰值腾出空间
+    BatchRange range;
+    int batch_idx = 0;
+    int num_batches = 0;
+    while (planner.next(range, batch_idx, num_batches)) {
+        if (can_spill && !spill_until(planner.estimatePeakBytes(range))) {
+            return false;
+        }
+        auto build_start = chrono::high_resolution_clock::now();
+        double build_begin = telemetry ? telemetry->now() : 0.0;
+
+        ScheduledBatch batch;
+        batch.range = range;
+        batch.batch_id = batch_idx;
+        batch.ac.reset(new BatchAutomaton(words, range, options.engine, options.folding.get(), build_threads));
+        batch.build_peak_bytes = batch.ac->getBuildPeakBytes();
+        planner.record(batch_idx, batch.build_peak_bytes, batch.ac->memoryBytes());
+        resident_bytes += batch.ac->memoryBytes();
+        if (checkpoint) {
+            vector<vector<int>> shard_counts;  // 分块优先不支持 --per-shard
+            batch.resume_line = checkpoint->begin(range, batch.stats, shard_counts);
+        }
+        batch.build_seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - build_start).count();
+        if (telemetry) {
+            telemetry->span("Batch[" + to_string(batch_idx + 1) + "] build", "batch", build_begin, telemetry->now());
+        }
+
+        {
+            lock_guard<mutex> lock(cout_mutex);
+            size_t process_mem_mb = get_process_memory_mb();
+            size_t base_mem_mb = g_base_memory_mb.load();
+            cout << "Batch[" << batch_idx + 1 << "/" << num_batches << "] "
+                 << "AC build time: " << fixed << setprecision(2) << batch.build_seconds << "s";
+            if (build_threads > 1) {
+                cout << " (" << build_threads << " threads)";
+            }
+            cout << ", words: " << range.end - range.start << ", ";
+            batch.ac->describe(cout);
+            cout << ", MEM: " << process_mem_mb << " MB"
+                 << " (+" << (process_mem_mb > base_mem_mb ? process_mem_mb - base_mem_mb : 0) << " MB for all AC)";
+            if (batch.resume_line > 0) {
+                cout << ", resuming at line " << batch.resume_line;
+            }
+            cout << endl;
+        }
+        batches.push_back(move(batch));
+    }
+    if (batches.empty()) return true;
+    if (can_spill && !spill_until(0)) {
+        return false;
+    }
+
+    // 2. 扫描一遍语料
+    ScanCounterTotals scan_counters;
+    unique_ptr<ScanCheckpoint> scan_checkpoint;
+    if (checkpoint) {
+        scan_checkpoint.reset(new ScanCheckpoint(*checkpoint, batches.front().range, batches.front().batch_id, num_threads));
+    }
+    auto scan_start = chrono::high_resolution_clock::now();
+    double scan_begin = telemetry ? telemetry->now() : 0.0;
+    string label = "Chunk-major[" + to_string(batches.size()) + " batches]";
+    ScanProgress progress(label, corpus.getLineCount(), scan_start);
+    {
+        lock_guard<mutex> lock(cout_mutex);
+        cout << label << " " << resident_bytes / (1024 * 1024) << " MB resident, " << spilled_bytes / (1024 * 1024)
+             << " MB spilled, scanning " << corpus.getSliceCount() << " slices in " << corpus.getChunkCount()
+             << " chunks with " << max(1, num_threads) << " thread(s), starting scan..." << endl;
+    }
+
+    static void (*const scanners[STAT_MASK_COUNT])(vector<ScheduledBatch>&, const InputCorpus&, const FilterOptions&,
+                                                   int, ScanProgress&, ScanCounterTotals&, ScanCheckpoint*) = {
+        scan_chunk_major<0>, scan_chunk_major<1>, scan_chunk_major<2>, scan_chunk_major<3>,
+        scan_chunk_major<4>, scan_chunk_major<5>, scan_chunk_major<6>, scan_chunk_major<7>,
+    };
+    scanners[stat_mask(options.columns)](batches, corpus, options, num_threads, progress, scan_counters,
+                                         scan_checkpoint.get());
+
+    double scan_end = telemetry ? telemetry->now() : 0.0;
+    chrono::duration<double> scan_duration = chrono::high_resolution_clock::now() - scan_start;
+    double scan_mb_per_sec = scan_duration.count() > 0
+        ? progress.getBytesProcessed() / (1024.0 * 1024.0) / scan_duration.count() : 0.0;
+    {
+        lock_guard<mutex> lock(cout_mutex);
+        cout << label << " scan: " << fixed << setprecision(2) << scan_duration.count() << "s";
+        if (corpus.hasReadahead()) {
+            cout << ", io wait: " << progress.getIoWaitSeconds() << "s";
+        }
+        cout << " (" << engine_name(options.engine) << ", " << setprecision(1) << scan_mb_per_sec << " MB/s";
+        if (scan_counters.has(PERF_CYCLES) && scan_counters.has(PERF_INSTRUCTIONS) && scan_counters.get(PERF_CYCLES) > 0) {
+            cout << ", IPC " << setprecision(2)
+                 << (double)scan_counters.get(PERF_INSTRUCTIONS) / scan_counters.get(PERF_CYCLES);
+        }
+        cout << ")" << endl;
+    }
+
+    // 3. 按批次顺序写出结果
+    for (auto& batch : batches) {
+        double output_begin = telemetry ? telemetry->now() : 0.0;
+        vector<vector<int>> shard_counts;
+        uint64_t match_total = 0;
+        int match_count = write_batch_rows(words, batch.range, options, batch.stats, shard_counts,
+                                           output_path, checkpoint, match_total);
+        if (word_stats) {
+            word_stats->store(batch.range.start, batch.stats);
+        }
+        {
+            lock_guard<mutex> lock(cout_mutex);
+            cout << "Batch[" << batch.batch_id + 1 << "/" << batches.size() << "] "
+                 << "words: " << batch.range.end - batch.range.start
+                 << ", matched: " << match_count
+                 << ", AC build: " << fixed << setprecision(2) << batch.build_seconds << "s"
+                 << (batch.spill ? " (spilled)" : "") << endl;
+        }
+        if (telemetry) {
+            JsonObject record;
+            record.add("batch", batch.batch_id + 1)
+                  .add("schedule", "chunk")
+                  .add("words", batch.range.end - batch.range.start)
+                  .add("engine", engine_name(batch.ac->getEngine()))
+                  .add("states", batch.ac->getStateCount())
+                  .add("dense_states", batch.ac->getDenseStateCount())
+                  .add("edges", batch.ac->getEdgeCount())
+                  .add("ac_bytes", batch.ac->memoryBytes())
+                  .add("ac_build_peak_bytes", batch.build_peak_bytes)
+                  .add("spilled", batch.spill != nullptr)
+                  .add("build_seconds", batch.build_seconds)
+                  .add("scan_seconds", scan_end - scan_begin)
+                  .add("io_wait_seconds", progress.getIoWaitSeconds())
+                  .add("output_seconds", telemetry->now() - output_begin)
+                  .add("scan_threads", max(1, num_threads))
+                  .add("build_threads", build_threads)
+                  .add("bytes_scanned", progress.getBytesProcessed())
+                  .add("lines_scanned", progress.getLinesProcessed())
+                  .add("bytes_per_second", scan_end > scan_begin ? progress.getBytesProcessed() / (scan_end - scan_begin) : 0.0)
+                  .add("matched_words", match_count)
+                  .add("match_total", match_total)
+                  .add("peak_rss_mb", get_peak_memory_mb());
+            if (telemetry->perfEnabled()) {
+                record.addRaw("counters", scan_counters.json(progress.getBytesProcessed()));
+            }
+            telemetry->batch(record);
+        }
+    }
+    if (telemetry) {
+        telemetry->span(label + " scan", "batch", scan_begin, scan_end);
+    }
+    return true;
+}
+
+// ============================================================================
+// 读取词典：每行一个词条，去除空白字符，过滤单字节词条
+// 整个文件一次读入一块内存，就地删除空白字符并把词条紧凑地排在一起，这块内存直接作为词表的字符串池，
+// 不为每个词条单独分配；空白字符用 SIMD 一次检查 16 个字节，词典很大时按行切成几段由多个线程同时整理
+// ============================================================================
+
+const size_t DICT_PARSE_BYTES_PER_THREAD = 16 * 1024 * 1024;  // 词典每多这么多字节增加一个整理线程
+
+// 空白字符，与 C locale 的 isspace 相同：空格、\t、\n、\v、\f、\r
+static inline bool is_dict_space(unsigned char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+#ifdef __SSE2__
+// 16 个字节中空白字符的位置（SSE2，x86-64 都支持）
+static inline unsigned dict_space_mask(const char* text) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)text);
+    __m128i control = _mm_sub_epi8(chunk, _mm_set1_epi8('\t'));
+    control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8('\r' - '\t')), control);
+    __m128i space = _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(control, space));
+}
+#endif
+
+// 就地整理 data 的 [begin, end)（end 之前的最后一个字节是换行符或文件末尾）：删除空白字符，
+// 每行剩下的字节为一个词条，不超过 1 个字节的丢弃；词条依次紧凑地写回 begin 开始的位置，
+// ends 追加每个词条的结束位置（相对 begin），返回写回的字节数
+// 写回位置总在读取位置之前，还没读取的字节不会被覆盖
+static size_t compact_dictionary(char* data, size_t begin, size_t end, vector<uint64_t>& ends) {
+    size_t out = begin;
+    size_t word_start = begin;
+    auto end_line = [&]() {
+        if (out - word_start > 1) {
+            ends.push_back(out - begin);
+            word_start = out;
+        } else {
+            out = word_start;
+        }
+    };
+    size_t pos = begin;
+#ifdef __SSE2__
+    // 每次检查 16 个字节，两个空白字符之间的一段整体移动
+    auto keep = [&](size_t from, size_t to) {
+        if (out != from) memmove(data + out, data + from, to - from);
+        out += to - from;
+    };
+    for (; pos + 16 <= end; pos += 16) {
+        unsigned mask = dict_space_mask(data + pos);
+        size_t run = pos;
+        while (mask) {
+            size_t space = pos + __builtin_ctz(mask);
+            keep(run, space);
+            if (data[space] == '\n') end_line();
+            run = space + 1;
+            mask &= mask - 1;
+        }
+        keep(run, pos + 16);
+    }
+#endif
+    for (; pos < end; pos++) {
+        char c = data[pos];
+        if (c == '\n') {
+            end_line();
+        } else if (!is_dict_space((unsigned char)c)) {
+            data[out++] = c;
+        }
+    }
+    end_line();  // 最后一行没有换行符
+    return out - begin;
+}
+
+static bool load_dictionary(const string& txt_path, WordList& words) {
+    ifstream txt_file(txt_path, ios::binary | ios::ate);
+    if (!txt_file.is_open()) {
+        cerr << "Error opening file: " << txt_path << endl;
+        return false;
+    }
+    size_t size = (size_t)txt_file.tellg();
+    vector<char> bytes(size);
+    txt_file.seekg(0, ios::beg);
+    txt_file.read(bytes.data(), size);
+    if ((size_t)txt_file.gcount() != size) {
+        cerr << "Error reading file: " << txt_path << endl;
+        return false;
+    }
+    txt_file.close();
+
+    // 按行切段，各线程就地整理自己的一段
+    int threads = (int)max<size_t>(1, min<size_t>(thread::hardware_concurrency(), size / DICT_PARSE_BYTES_PER_THREAD));
+    vector<size_t> bounds(threads + 1, size);
+    bounds[0] = 0;
+    for (int t = 1; t < threads; t++) {
+        size_t pos = max(bounds[t - 1], size * t / threads);
+        const char* newline = (const char*)memchr(bytes.data() + pos, '\n', size - pos);
+        bounds[t] = newline ? (size_t)(newline - bytes.data()) + 1 : size;
+    }
+    vector<vector<uint64_t>> ends(threads);
+    vector<size_t> kept(threads, 0);
+    run_threads(threads, [&](int t) {
+        kept[t] = compact_dictionary(bytes.data(), bounds[t], bounds[t + 1], ends[t]);
+    });
+
+    // 各段依次前移拼接（目标位置不在段之后，前移不会覆盖后面还没移动的段）
+    size_t count = 0;
+    for (const auto& segment : ends) {
+        count += segment.size();
+    }
+    vector<uint64_t> offsets;
+    offsets.reserve(count + 1);
+    offsets.push_back(0);
+    size_t out = 0;
+    for (int t = 0; t < threads; t++) {
+        if (out != bounds[t]) {
+            memmove(bytes.data() + out, bytes.data() + bounds[t], kept[t]);
+        }
+        for (uint64_t word_end : ends[t]) {
+            offsets.push_back(out + word_end);
+        }
+        out += kept[t];
+    }
+    bytes.resize(out);
+    bytes.shrink_to_fit();
+    words.assign(move(offsets), move(bytes));
+    return true;
+}
+
+// ============================================================================
+// 打开预编译索引：校验源词典未变化，词表直接使用索引文件中的词表段
+// ============================================================================
+
+static bool open_index(const string& index_path, const string& dict_path, uint64_t normalization,
+                       IndexFile& index, WordList& words) {
+    string error;
+    if (!index.open(index_path, error)) {
+        cerr << "Error loading index " << index_path << ": " << error << endl;
+        return false;
+    }
+
+    uint64_t checksum = 0;
+    uint64_t dict_size = 0;
+    if (!checksum_file(dict_path, checksum, dict_size)) {
+        cerr << "Error opening file: " << dict_path << endl;
+        return false;
+    }
+    const IndexHeader& header = index.getHeader();
+    if (header.engine != (uint32_t)SearchEngine::Codepoint) {
+        cerr << "Error: index " << index_path << " was compiled with the removed dense engine, "
+             << "run 'compile' again" << endl;
+        return false;
+    }
+    if (header.dict_size != dict_size || header.dict_checksum != checksum) {
+        cerr << "Error: index " << index_path << " was compiled from a different dictionary, "
+             << "run 'compile' again" << endl;
+        return false;
+    }
+    if (header.normalization != normalization) {
+        cerr << "Error: index " << index_path << " was compiled with different --normalize rules, "
+             << "run 'compile' again" << endl;
+        return false;
+    }
+
+    if (!words.attach(index)) {
+        cerr << "Error loading index " << index_path << ": corrupt word table" << endl;
+        return false;
+    }
+
+    cout << "Loaded index: " << index_path << " (" << index.getSize() / (1024 * 1024) << " MB, engine: "
+         << engine_name(SearchEngine::Codepoint) << ")" << endl;
+    return true;
+}
+
+// ============================================================================
+// 按归一化后的形式去重：每个形式只保留第一次出现的词条
+// 输出的词条做映射表和全角转换，但保留大小写
+// ============================================================================
+
+static void normalize_dictionary(WordList& words, const CharFolding& folding) {
+    unordered_set<string> seen;
+    seen.reserve(words.size());
+    WordListBuilder kept;
+    for (size_t i = 0; i < words.size(); i++) {
+        string word = words[i].str();
+        if (seen.insert(folding.apply(word)).second) {
+            kept.add(folding.apply(word, false));
+        }
+    }
+    cout << "Normalization: " << words.size() << " words -> " << seen.size() << " normalized forms" << endl;
+    kept.finish(words);
+}
+
+// 读取词典（或预编译索引中的词表），按 --normalize 归一化
+static bool load_words(const string& dict_path, const FilterOptions& options,
+                       unique_ptr<IndexFile>& index, WordList& words) {
+    if (!options.index_path.empty()) {
+        // 索引中的词表在编译时已经归一化
+        index.reset(new IndexFile());
+        return open_index(options.index_path, dict_path, options.folding ? options.folding->fingerprint() : 0,
+                          *index, words);
+    }
+    if (!load_dictionary(dict_path, words)) {
+        return false;
+    }
+    if (options.folding) {
+        normalize_dictionary(words, *options.folding);
+    }
+    return true;
+}
+
+// ============================================================================
+// compile 模式：构建整个词典的自动机并写入索引文件
+// ============================================================================
+
+static int compile_index(const string& dict_path, const string& index_path, const FilterOptions& options) {
+    auto start = chrono::high_resolution_clock::now();
+
+    if (options.engine == SearchEngine::Classic) {
+        cerr << "Error: the classic engine cannot be compiled, use --engine=codepoint" << endl;
+        return 1;
+    }
+
+    uint64_t checksum = 0;
+    uint64_t dict_size = 0;
+    WordList words;
+    if (!checksum_file(dict_path, checksum, dict_size) || !load_dictionary(dict_path, words)) {
+        return -1;
+    }
+    if (options.folding) {
+        normalize_dictionary(words, *options.folding);
+    }
+    cout << "Dictionary size: " << words.size() << " words" << endl;
+
+    BatchRange range;
+    range.start = 0;
+    range.end = words.size();
+    int build_threads = options.build_threads > 0 ? options.build_threads
+                                                  : max(1, (int)thread::hardware_concurrency());
+    BatchAutomaton ac(words, range, options.engine, options.folding.get(), build_threads);
+    auto built = chrono::high_resolution_clock::now();
+    chrono::duration<double> build_time = built - start;
+    cout << "AC build time: " << fixed << setprecision(2) << build_time.count() << "s (" << build_threads
+         << " thread(s)), ";
+    ac.describe(cout);
+    cout << endl;
+
+    IndexWriter writer(index_path);
+    if (!writer.isOpen()) {
+        cerr << "Error opening file: " << index_path << endl;
+        return -1;
+    }
+    IndexHeader& header = writer.getHeader();
+    header.dict_size = dict_size;
+    header.dict_checksum = checksum;
+    header.word_count = words.size();
+    header.normalization = options.folding ? options.folding->fingerprint() : 0;
+
+    words.save(writer);
+    ac.save(writer);
+    if (!writer.finish()) {
+        cerr << "Error writing index: " << index_path << endl;
+        return -1;
+    }
+
+    chrono::duration<double> total = chrono::high_resolution_clock::now() - start;
+    cout << "Index written: " << index_path << " (" << writer.getSize() / (1024 * 1024) << " MB) in "
+         << total.count() << " seconds" << endl;
+    return 0;
+}
 
-            // 统计该分块的行数
-            size_t lines = 0;
-            for (size_t i = 0; i < chunk_end; i++) {
-                if (buffer[i] == '\n') lines++;
-            }
+// ============================================================================
+// 二进制部分结果：按词条编号存储的计数，供 merge 子命令合并
+// 文件布局：PartialHeader + 按词条编号升序排列的 PartialEntry（只存计数大于 0 的词条）
+// 词条编号是词表中的下标，头部记录词表指纹，只有词表完全相同的部分结果才能互相合并
+// ============================================================================
 
-            // 记录边界信息
-            ChunkBoundary boundary;
-            boundary.start_offset = current_offset;
-            boundary.end_offset = current_offset + chunk_end;
-            boundary.line_count = lines;
-            boundaries.push_back(boundary);
+const char PARTIAL_MAGIC[8] = { 'W', 'F', 'P', 'A', 'R', 'T', '\0', '\0' };
+const uint32_t PARTIAL_VERSION = 1;
 
-            total_lines += lines;
-            chunk_id++;
+struct PartialHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t dict_fingerprint;      // 词表指纹，见 dictionary_fingerprint
+    uint64_t word_count;
+    uint64_t entry_count;
+};
 
-            cout << "  Chunk " << chunk_id << ": "
-                 << chunk_end / (1024 * 1024) << " MB, "
-                 << lines << " lines" << endl;
+struct PartialEntry {
+    uint32_t word_id;
+    uint32_t count;
+};
 
-            // 移动到下一个分块
-            current_offset = current_offset + chunk_end;
-            file.seekg(current_offset, ios::beg);
+// 词表指纹：词条及其顺序都参与计算，与词典来自文本还是预编译索引无关
+static uint64_t dictionary_fingerprint(const WordList& words) {
+    uint64_t hash = HASH_SEED;
+    for (size_t i = 0; i < words.size(); i++) {
+        WordRef word = words[i];
+        hash = hash_bytes(word.data(), word.size(), hash);
+        hash = hash_bytes("\n", 1, hash);
+    }
+    return hash;
+}
+
+// 标记词典中重复出现的词条（每个词条只保留第一次出现的编号）
+// 重复词条的计数完全相同，合并时只取一份，否则按字符串合并会重复累加
+static vector<bool> mark_duplicate_words(const WordList& words) {
+    vector<uint32_t> order(words.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = (uint32_t)i;
+    }
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return words[a] < words[b]; });
+    vector<bool> duplicate(words.size(), false);
+    for (size_t i = 1; i < order.size(); i++) {
+        if (words[order[i]] == words[order[i - 1]]) {
+            duplicate[order[i]] = true;
         }
+    }
+    return duplicate;
+}
 
-        file.close();
-        cout << "Total lines: " << total_lines << ", chunks: " << boundaries.size() << endl;
-        return true;
+// 写出部分结果，counts 以词条编号为下标
+static bool write_partial(const string& path, uint64_t fingerprint, const vector<int>& counts) {
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cerr << "Error opening file: " << path << endl;
+        return false;
     }
 
-    // 获取总行数
-    size_t getLineCount() const { return total_lines; }
+    PartialHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC));
+    header.version = PARTIAL_VERSION;
+    header.dict_fingerprint = fingerprint;
+    header.word_count = counts.size();
+    for (int count : counts) {
+        if (count > 0) header.entry_count++;
+    }
+    file.write((const char*)&header, sizeof(header));
+
+    vector<PartialEntry> buffer;
+    buffer.reserve(64 * 1024);
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] == 0) continue;
+        buffer.push_back(PartialEntry{ (uint32_t)i, (uint32_t)counts[i] });
+        if (buffer.size() == buffer.capacity()) {
+            file.write((const char*)buffer.data(), buffer.size() * sizeof(PartialEntry));
+            buffer.clear();
+        }
+    }
+    file.write((const char*)buffer.data(), buffer.size() * sizeof(PartialEntry));
+    file.close();
+    if (file.fail()) {
+        cerr << "Error writing partial result: " << path << endl;
+        return false;
+    }
+    cout << "Partial result: " << path << " (" << header.entry_count << " entries)" << endl;
+    return true;
+}
 
-    // 获取分块数量
-    size_t getChunkCount() const { return boundaries.size(); }
+// 判断文件是否为二进制部分结果（其余输入按 CSV 处理）
+static bool is_partial_file(const string& path) {
+    ifstream file(path, ios::binary);
+    char magic[sizeof(PARTIAL_MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    return file.gcount() == (streamsize)sizeof(magic) && memcmp(magic, PARTIAL_MAGIC, sizeof(magic)) == 0;
+}
 
-    // 流式处理所有行（每个分块处理完后释放内存）
-    void streamProcess(function<bool(const char*, size_t, size_t, size_t)> callback) {
-        // 如果文件已缓存，从缓存读取
-        if (file_cached && !cached_file.empty()) {
-            size_t processed_lines = 0;
-            size_t chunk_idx = 0;
-            char* data = cached_file.data();
-            size_t chunk_bytes = file_size;
-
-            // 处理每一行
-            size_t line_start = 0;
-            for (size_t i = 0; i < chunk_bytes; i++) {
-                if (data[i] == '\n') {
-                    data[i] = '\0';
-                    size_t line_len = i - line_start;
-
-                    if (line_len > 0) {
-                        if (!callback(data + line_start, line_len, chunk_idx, processed_lines)) {
-                            return;
-                        }
-                    }
+// 顺序读取部分结果，每次读入一块，内存占用与文件大小无关
+class PartialReader {
+private:
+    string file_path;
+    ifstream file;
+    PartialHeader header;
+    vector<PartialEntry> buffer;
+    size_t buffer_pos;
+    uint64_t remaining;         // 尚未读入缓冲区的条目数
+    int64_t last_id;
 
-                    processed_lines++;
-                    line_start = i + 1;
-                }
-            }
-            return;
-        }
+public:
+    PartialReader() : buffer_pos(0), remaining(0), last_id(-1) {
+        memset(&header, 0, sizeof(header));
+    }
 
-        // 从文件读取（原逻辑）
-        ifstream file(file_path, ios::binary);
+    bool open(const string& path, string& error) {
+        file_path = path;
+        file.open(path, ios::binary);
         if (!file.is_open()) {
-            cerr << "Error reopening file: " << file_path << endl;
-            return;
+            error = "cannot open " + path;
+            return false;
+        }
+        file.read((char*)&header, sizeof(header));
+        if (file.gcount() != (streamsize)sizeof(header)
+            || memcmp(header.magic, PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC)) != 0) {
+            error = "not a WikiFilter partial result";
+            return false;
+        }
+        if (header.version != PARTIAL_VERSION) {
+            error = "unsupported partial result version " + to_string(header.version);
+            return false;
         }
+        remaining = header.entry_count;
+        return true;
+    }
 
-        size_t processed_lines = 0;
+    const PartialHeader& getHeader() const { return header; }
 
-        for (size_t chunk_idx = 0; chunk_idx < boundaries.size(); chunk_idx++) {
-            const auto& boundary = boundaries[chunk_idx];
-            size_t chunk_bytes = boundary.end_offset - boundary.start_offset;
-
-            // 只为当前分块分配内存
-            vector<char> buffer(chunk_bytes + 1);
-
-            // 读取当前分块
-            file.seekg(boundary.start_offset, ios::beg);
-            file.read(buffer.data(), chunk_bytes);
-            buffer[chunk_bytes] = '\0';
-
-            // 处理每一行
-            size_t line_start = 0;
-            for (size_t i = 0; i < chunk_bytes; i++) {
-                if (buffer[i] == '\n') {
-                    buffer[i] = '\0';
-                    size_t line_len = i - line_start;
-
-                    if (line_len > 0) {
-                        if (!callback(buffer.data() + line_start, line_len, chunk_idx, processed_lines)) {
-                            return;  // 停止处理
-                        }
-                    }
+    const string& getPath() const { return file_path; }
 
-                    processed_lines++;
-                    line_start = i + 1;
-                }
+    // 读取下一个条目，读完或文件损坏时返回 false（损坏时 error 非空）
+    bool next(PartialEntry& entry, string& error) {
+        if (buffer_pos == buffer.size()) {
+            if (remaining == 0) return false;
+            size_t n = (size_t)min<uint64_t>(remaining, 64 * 1024);
+            buffer.resize(n);
+            file.read((char*)buffer.data(), n * sizeof(PartialEntry));
+            if ((size_t)file.gcount() != n * sizeof(PartialEntry)) {
+                error = "truncated partial result " + file_path;
+                return false;
             }
-
-            // buffer 在循环结束后自动释放，内存被回收
+            remaining -= n;
+            buffer_pos = 0;
+        }
+        entry = buffer[buffer_pos++];
+        if ((int64_t)entry.word_id <= last_id || entry.word_id >= header.word_count) {
+            error = "corrupt partial result " + file_path;
+            return false;
         }
+        last_id = entry.word_id;
+        return true;
+    }
+};
 
-        file.close();
+// ============================================================================
+// merge 模式：合并任意数量的部分结果和 CSV，输出与 merge_csv.py 相同的三个文件
+//   <prefix>.csv       词条<TAB>合计（每行一个词条）
+//   <prefix>.txt       合计大于阈值的词条，按字符顺序排序
+//   <prefix>.freq.csv  词频分布直方图
+// 二进制部分结果按词条编号 k 路归并，只在内存中保留每个输入的一块缓冲；
+// CSV 没有编号，按词条字符串累加（取第一个 TAB 后的一列，兼容 --per-shard 的多列输出）
+// ============================================================================
+
+// 与 Python 的 repr(float) 相同：能准确还原的最短表示，整数值补 .0
+static string format_ratio(double value) {
+    char buffer[32];
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (strtod(buffer, nullptr) == value) break;
+    }
+    string text = buffer;
+    if (text.find_first_of(".e") == string::npos) {
+        text += ".0";
     }
+    return text;
+}
 
-    // 获取单个分块的内存占用估算
-    size_t getChunkMemoryMB() const {
-        if (boundaries.empty()) return 0;
-        size_t max_chunk = 0;
-        for (const auto& b : boundaries) {
-            size_t chunk_size = b.end_offset - b.start_offset;
-            if (chunk_size > max_chunk) max_chunk = chunk_size;
+// 合并结果的输出：逐个接收 (词条, 合计)，边写 .csv 边统计直方图和阈值词条
+class MergeOutput {
+private:
+    string prefix;
+    long long threshold;
+    ofstream csv_file;
+    vector<WordRef> selected;           // 合计大于阈值的词条（指向词表或累加表中的字符串）
+    map<uint64_t, uint64_t> histogram;  // 合计 -> 词条数
+    uint64_t key_count;
+
+public:
+    MergeOutput(const string& output_prefix, long long output_threshold)
+        : prefix(output_prefix), threshold(output_threshold), key_count(0) {}
+
+    // word 必须在 finish 之前保持有效
+    bool add(const WordRef& word, uint64_t count) {
+        if (key_count == 0) {
+            csv_file.open(prefix + ".csv", ios::out | ios::trunc);
+            if (!csv_file.is_open()) {
+                cerr << "Error opening file: " << prefix << ".csv" << endl;
+                return false;
+            }
         }
-        return max_chunk / (1024 * 1024);
+        key_count++;
+        csv_file << word << "\t" << count << "\n";
+        if ((long long)count > threshold) {
+            selected.push_back(word);
+        }
+        histogram[count]++;
+        return true;
     }
 
-    // 缓存整个文件到内存（当只有1个chunk时调用）
-    bool cacheEntireFile() {
-        if (boundaries.size() != 1) {
-            return false;  // 只缓存单chunk文件
+    bool finish() {
+        cout << "Contains " << key_count << " keys" << endl;
+        if (key_count == 0) return true;  // 与 merge_csv.py 相同，没有词条时不输出文件
+        csv_file.close();
+
+        sort(selected.begin(), selected.end());
+        ofstream txt_file(prefix + ".txt", ios::out | ios::trunc);
+        for (const WordRef& word : selected) {
+            txt_file << word << "\n";
         }
+        txt_file.close();
+
+        ofstream freq_file(prefix + ".freq.csv", ios::out | ios::trunc);
+        freq_file << "词频, 词条数, 累积比例\n";
+        uint64_t count_sum = 0;
+        for (const auto& bucket : histogram) {
+            count_sum += bucket.second;
+            freq_file << bucket.first << ", " << bucket.second << ", "
+                      << format_ratio((double)count_sum / (double)key_count) << "\n";
+        }
+        freq_file.close();
 
-        ifstream file(file_path, ios::binary);
-        if (!file.is_open()) {
-            cerr << "Error opening file for caching: " << file_path << endl;
+        if (csv_file.fail() || txt_file.fail() || freq_file.fail()) {
+            cerr << "Error writing merge output: " << prefix << endl;
             return false;
         }
-
-        cached_file.resize(file_size + 1);
-        file.read(cached_file.data(), file_size);
-        cached_file[file_size] = '\0';
-        file.close();
-
-        file_cached = true;
-        cout << "File cached in memory (" << file_size / (1024 * 1024) << " MB)" << endl;
+        cout << "Output dict " << selected.size() << " " << selected.size() * 100 / key_count << " %" << endl;
         return true;
     }
-
-    // 检查文件是否已缓存
-    bool isFileCached() const { return file_cached; }
 };
 
-// ============================================================================
-// 使用 AC 自动机处理一个批次的词条（使用分块加载器）
-// ============================================================================
+// 按词条字符串累加 CSV（以及与 CSV 混合输入时的部分结果），保持首次出现的顺序
+class CsvAccumulator {
+private:
+    unordered_map<string, size_t> slots;
+    vector<const string*> keys;
+    vector<uint64_t> totals;
 
-void process_batch_with_ac(
-    const vector<string>& words,
-    const BatchRange& range,
-    StreamingFileLoader& file_loader,
-    const string& output_path,
-    int batch_id,
-    int total_batches)
-{
-    auto batch_start = chrono::high_resolution_clock::now();
+public:
+    void add(const string& word, uint64_t count) {
+        auto inserted = slots.emplace(word, keys.size());
+        if (inserted.second) {
+            keys.push_back(&inserted.first->first);
+            totals.push_back(count);
+        } else {
+            totals[inserted.first->second] += count;
+        }
+    }
 
-    // 1. 构建 AC 自动机
-    AhoCorasick ac;
-    for (size_t i = range.start; i < range.end; i++) {
-        ac.insert(words[i], i - range.start);
+    bool readFile(const string& path) {
+        ifstream file(path);
+        if (!file.is_open()) {
+            cerr << "Error opening file: " << path << endl;
+            return false;
+        }
+        string line;
+        while (getline(file, line)) {
+            size_t tab = line.find('\t');
+            if (tab == string::npos) {
+                if (line.size() > 1) {
+                    cerr << "Error: in line content " << line << endl;
+                }
+                continue;
+            }
+            add(line.substr(0, tab), strtoull(line.c_str() + tab + 1, nullptr, 10));
+        }
+        return true;
     }
-    ac.buildFailureLinks();
 
-    // 2. 为本批次词条创建计数器
-    vector<atomic<int>> line_counts(range.end - range.start);
-    for (auto& count : line_counts) {
-        count = 0;
+    bool emit(MergeOutput& output) const {
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (!output.add(*keys[i], totals[i])) return false;
+        }
+        return true;
     }
+};
 
-    // 3. 流式扫描所有行（每个分块处理完后释放内存）
-    auto scan_start = chrono::high_resolution_clock::now();
-    chrono::duration<double> ac_build_time = scan_start - batch_start;  // AC构建时间
-    auto last_log_time = scan_start;
-    size_t lines_processed = 0;  // 已处理的行数
-    size_t lines_at_last_log = 0;  // 上次日志时的行数（用于计算瞬时速度）
-    const int LOG_INTERVAL_SECONDS = 30;  // 每 30 秒输出一次进度日志
-    const size_t LOG_CHECK_INTERVAL = 5000;  // 每 5000 行检查一次时间
+static int merge_results(const string& output_prefix, const vector<string>& input_paths, const FilterOptions& options) {
+    auto start = chrono::high_resolution_clock::now();
 
-    size_t total_lines = file_loader.getLineCount();  // 获取总行数
+    // 1. 区分二进制部分结果和 CSV
+    vector<unique_ptr<PartialReader>> partials;
+    vector<string> csv_paths;
+    for (const auto& path : input_paths) {
+        cout << path << endl;
+        if (!is_partial_file(path)) {
+            csv_paths.push_back(path);
+            continue;
+        }
+        unique_ptr<PartialReader> reader(new PartialReader());
+        string error;
+        if (!reader->open(path, error)) {
+            cerr << "Error loading partial result " << path << ": " << error << endl;
+            return -1;
+        }
+        if (!partials.empty() && reader->getHeader().dict_fingerprint != partials[0]->getHeader().dict_fingerprint) {
+            cerr << "Error: " << path << " and " << partials[0]->getPath()
+                 << " were produced with different dictionaries" << endl;
+            return -1;
+        }
+        partials.push_back(move(reader));
+    }
 
-    // 首次打印：显示AC构建时间和内存
+    // 2. 部分结果需要词表才能还原词条
+    WordList words;
+    unique_ptr<IndexFile> index;
+    if (!partials.empty()) {
+        if (options.dict_path.empty()) {
+            cerr << "Error: binary partial results need --dict=FILE (the dictionary used for scanning)" << endl;
+            return 1;
+        }
+        if (!load_words(options.dict_path, options, index, words)) {
+            return -1;
+        }
+        if (dictionary_fingerprint(words) != partials[0]->getHeader().dict_fingerprint) {
+            cerr << "Error: partial results were produced with a different dictionary than "
+                 << options.dict_path << endl;
+            return -1;
+        }
+    }
+    vector<bool> duplicate = mark_duplicate_words(words);
+
+    // 3. 按词条编号 k 路归并部分结果：只有部分结果时直接流式输出，否则先并入 CSV 累加表
+    MergeOutput output(output_prefix, options.threshold);
+    CsvAccumulator accumulator;
+    bool streaming = csv_paths.empty();
     {
-        lock_guard<mutex> lock(cout_mutex);
-        size_t process_mem_mb = get_process_memory_mb();
-        size_t base_mem_mb = g_base_memory_mb.load();
-        size_t ac_total_mb = (process_mem_mb > base_mem_mb) ? (process_mem_mb - base_mem_mb) : 0;
-        cout << "Batch[" << batch_id + 1 << "/" << total_batches << "] "
-             << "AC build time: " << fixed << setprecision(2) << ac_build_time.count() << "s"
-             << ", words: " << (range.end - range.start)
-             << ", MEM: " << process_mem_mb << " MB"
-             << " (+" << ac_total_mb << " MB for all AC)"
-             << ", starting scan..." << endl;
-    }
-
-    // 使用流式处理遍历所有行
-    file_loader.streamProcess([&](const char* line_text, size_t line_len, size_t chunk_idx, size_t global_line) -> bool {
-        if (line_len == 0) return true;
-
-        // 获取本行匹配的所有词条
-        vector<int> matches = ac.search(line_text, line_len);
-
-        // 计数（每行最多计1次）
-        for (int idx : matches) {
-            line_counts[idx]++;
-        }
-
-        lines_processed++;
-
-        // 定期检查是否需要输出日志
-        if (lines_processed % LOG_CHECK_INTERVAL == 0) {
-            auto current_time = chrono::high_resolution_clock::now();
-            chrono::duration<double> elapsed_since_last_log = current_time - last_log_time;
-
-            if (elapsed_since_last_log.count() >= LOG_INTERVAL_SECONDS) {
-                chrono::duration<double> scan_elapsed = current_time - scan_start;
-                double progress = lines_processed * 100.0 / total_lines;
-                double instant_lines_per_sec = (lines_processed - lines_at_last_log) / elapsed_since_last_log.count();
-                double avg_lines_per_sec = lines_processed / scan_elapsed.count();
-
-                // ETA
-                size_t remaining_lines = total_lines - lines_processed;
-                double eta_seconds = remaining_lines / avg_lines_per_sec;
-                int eta_m = (int)(eta_seconds / 60);
-                int eta_s = (int)eta_seconds % 60;
-
-                {
-                    lock_guard<mutex> lock(cout_mutex);
-                    cout << "Batch[" << batch_id + 1 << "/" << total_batches << "] "
-                         << fixed << setfill(' ') << setw(5) << setprecision(1) << progress << "%"
-                         << " | " << setfill('0') << setw(2) << (int)(scan_elapsed.count()/60) << ":" << setw(2) << (int)scan_elapsed.count()%60
-                         << ", ETA " << setw(2) << eta_m << ":" << setw(2) << eta_s
-                         << " | " << setprecision(0) << lines_processed/1000 << "K/" << total_lines/1000 << "K"
-                         << " | " << setprecision(1) << instant_lines_per_sec/1000 << "K/s"
-                         << ", Avg " << avg_lines_per_sec/1000 << "K/s"
-                         << endl;
+        typedef pair<uint32_t, size_t> HeapItem;  // (词条编号, 输入序号)
+        priority_queue<HeapItem, vector<HeapItem>, greater<HeapItem>> heap;
+        vector<PartialEntry> current(partials.size());
+        string error;
+        for (size_t i = 0; i < partials.size(); i++) {
+            if (partials[i]->next(current[i], error)) {
+                heap.push(HeapItem(current[i].word_id, i));
+            }
+        }
+        while (!heap.empty() && error.empty()) {
+            uint32_t word_id = heap.top().first;
+            uint64_t total = 0;
+            while (!heap.empty() && heap.top().first == word_id) {
+                size_t i = heap.top().second;
+                heap.pop();
+                total += current[i].count;
+                if (partials[i]->next(current[i], error)) {
+                    heap.push(HeapItem(current[i].word_id, i));
                 }
-                last_log_time = current_time;
-                lines_at_last_log = lines_processed;
             }
+            if (duplicate[word_id]) {
+                continue;
+            } else if (streaming) {
+                if (!output.add(words[word_id], total)) return -1;
+            } else {
+                accumulator.add(words[word_id].str(), total);
+            }
+        }
+        if (!error.empty()) {
+            cerr << "Error: " << error << endl;
+            return -1;
         }
+    }
 
-        return true;  // 继续处理
-    });
+    // 4. 累加 CSV
+    for (const auto& path : csv_paths) {
+        if (!accumulator.readFile(path)) {
+            return -1;
+        }
+    }
+    if (!streaming && !accumulator.emit(output)) {
+        return -1;
+    }
+    if (!output.finish()) {
+        return -1;
+    }
 
-    // 4. 输出结果
-    stringstream ss;
-    int match_count = 0;
-    for (size_t i = range.start; i < range.end; i++) {
-        int count = line_counts[i - range.start].load();
-        if (count > 0) {
-            ss << words[i] << "\t" << count << "\n";
-            match_count++;
+    chrono::duration<double> total = chrono::high_resolution_clock::now() - start;
+    cout << "Merged " << input_paths.size() << " inputs (" << partials.size() << " partial, "
+         << csv_paths.size() << " csv) in " << fixed << setprecision(2) << total.count() << " seconds" << endl;
+    return 0;
+}
+
+// ============================================================================
+// 结果缓存（--cache）：同一份语料上每个词条的统计结果
+// 语料快照数周不变，词典每次只改动几千条：已缓存的词条直接取结果，只用新词条构建自动机扫描，
+// 最后输出完整的结果并把新词条加入缓存（缓存中本次词典没有的词条保留）
+// 缓存按语料全文哈希、归一化规则和统计列区分，任何一项不同时整个缓存作废
+// 文件布局：ResultCacheHeader + 词条偏移（词条数 + 1 个 uint64）+ 按字节序排列的词条 + 各统计列数组
+// ============================================================================
+
+const char CACHE_MAGIC[8] = { 'W', 'F', 'C', 'A', 'C', 'H', 'E', '\0' };
+const uint32_t CACHE_VERSION = 2;
+
+struct ResultCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t stats;                 // 缓存了哪些统计（STAT_* 的组合，文章数总是缓存）
+    uint64_t corpus_fingerprint;    // 见 corpus_content_hash
+    uint64_t normalization;         // 归一化规则的指纹，未归一化为 0
+    uint64_t word_count;
+    uint64_t byte_count;            // 所有词条的总字节数
+};
+
+class ResultCache {
+private:
+    string path;
+    ResultCacheHeader key;          // 本次运行的语料哈希、归一化规则和统计列
+    vector<uint64_t> offsets;       // 第 i 个词条为 bytes[offsets[i], offsets[i + 1])
+    vector<char> bytes;
+    WordStats stats;
+
+    int compareAt(size_t i, const WordRef& word) const {
+        return WordRef(bytes.data() + offsets[i], offsets[i + 1] - offsets[i]).compare(word);
+    }
+
+    template<typename T>
+    static bool readArray(ifstream& file, vector<T>& values, size_t count) {
+        values.resize(count);
+        file.read((char*)values.data(), count * sizeof(T));
+        return file.gcount() == (streamsize)(count * sizeof(T));
+    }
+
+    template<typename T>
+    static void writeArray(ofstream& file, const vector<T>& values) {
+        file.write((const char*)values.data(), values.size() * sizeof(T));
+    }
+
+public:
+    ResultCache(const string& cache_path, uint64_t corpus, uint64_t normalization, unsigned stat_mask) : path(cache_path) {
+        memset(&key, 0, sizeof(key));
+        memcpy(key.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        key.version = CACHE_VERSION;
+        key.stats = stat_mask;
+        key.corpus_fingerprint = corpus;
+        key.normalization = normalization;
+        offsets.push_back(0);
+        stats.assign(0, stat_mask);
+    }
+
+    const string& getPath() const { return path; }
+    size_t size() const { return offsets.size() - 1; }
+    const WordStats& getStats() const { return stats; }
+
+    // 读取缓存；文件不存在或与本次运行不匹配时缓存为空，并输出原因
+    void load() {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) {
+            cout << "Result cache: " << path << " not found, counting all words" << endl;
+            return;
+        }
+        ResultCacheHeader header;
+        file.read((char*)&header, sizeof(header));
+        if (file.gcount() != (streamsize)sizeof(header) || memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+            || header.version != CACHE_VERSION) {
+            cout << "Result cache: " << path << " is not a WikiFilter result cache of this version, ignored" << endl;
+            return;
+        }
+        if (header.corpus_fingerprint != key.corpus_fingerprint) {
+            cout << "Result cache: corpus changed since " << path << " was written, counting all words" << endl;
+            return;
+        }
+        if (header.normalization != key.normalization || header.stats != key.stats) {
+            cout << "Result cache: " << path << " was written with different --normalize or --columns, counting all words" << endl;
+            return;
+        }
+        size_t n = header.word_count;
+        WordStats loaded;
+        loaded.assign(0, key.stats);
+        bool ok = readArray(file, offsets, n + 1) && offsets[n] == header.byte_count
+               && readArray(file, bytes, header.byte_count) && readArray(file, loaded.df, n);
+        if (ok && (key.stats & STAT_TOTAL)) ok = readArray(file, loaded.total, n);
+        if (ok && (key.stats & STAT_MAX)) ok = readArray(file, loaded.maxPerArticle, n);
+        if (ok && (key.stats & STAT_FIRST)) ok = readArray(file, loaded.firstArticle, n);
+        if (!ok) {
+            cout << "Result cache: " << path << " is truncated, counting all words" << endl;
+            offsets.assign(1, 0);
+            bytes.clear();
+            return;
         }
+        stats = move(loaded);
+        cout << "Result cache: " << path << " has " << n << " words" << endl;
     }
 
-    // 5. 写入文件
-    {
-        lock_guard<mutex> lock(file_mutex);
-        ofstream file(output_path, ios::app);
-        if (file.is_open()) {
-            file << ss.str();
-            file.close();
+    // 查找词条，返回缓存中的编号，没有时返回 -1
+    int64_t find(const WordRef& word) const {
+        size_t low = 0;
+        size_t high = size();
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            int cmp = compareAt(mid, word);
+            if (cmp == 0) return (int64_t)mid;
+            if (cmp < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
         }
+        return -1;
     }
 
-    auto batch_end = chrono::high_resolution_clock::now();
-    chrono::duration<double> scan_duration = batch_end - scan_start;
+    // 写出新的缓存：本次词典的词条取 results 中的结果（以词典编号为下标），缓存中其余的词条保留
+    bool update(const WordList& words, const WordStats& results) {
+        vector<uint32_t> order(words.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = (uint32_t)i;
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return words[a] < words[b]; });
+        order.erase(unique(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return words[a] == words[b]; }),
+                    order.end());
+
+        // 按字节序归并本次词典和旧缓存
+        vector<uint64_t> merged_offsets(1, 0);
+        vector<char> merged_bytes;
+        WordStats merged;
+        size_t capacity = order.size() + size();
+        merged.assign(capacity, key.stats);
+        size_t count = 0;
+        size_t old = 0;
+        auto append = [&](const char* data, size_t length) {
+            merged_bytes.insert(merged_bytes.end(), data, data + length);
+            merged_offsets.push_back(merged_bytes.size());
+        };
+        for (size_t k = 0; k <= order.size(); k++) {
+            // 先放入排在这个词条之前的旧词条，与之相同的旧词条被新结果替换
+            while (old < size() && (k == order.size() || compareAt(old, words[order[k]]) <= 0)) {
+                if (k < order.size() && compareAt(old, words[order[k]]) == 0) {
+                    old++;
+                    break;
+                }
+                append(bytes.data() + offsets[old], offsets[old + 1] - offsets[old]);
+                merged.copyEntry(count++, stats, old++);
+            }
+            if (k == order.size()) break;
+            WordRef word = words[order[k]];
+            append(word.data(), word.size());
+            merged.copyEntry(count++, results, order[k]);
+        }
+        merged.df.resize(count);
+        if (!merged.total.empty()) merged.total.resize(count);
+        if (!merged.maxPerArticle.empty()) merged.maxPerArticle.resize(count);
+        if (!merged.firstArticle.empty()) merged.firstArticle.resize(count);
 
-    {
-        lock_guard<mutex> lock(cout_mutex);
-        cout << "Batch[" << batch_id + 1 << "/" << total_batches << "] "
-             << "words: " << (range.end - range.start)
-             << ", matched: " << match_count
-             << ", AC build: " << fixed << setprecision(2) << ac_build_time.count() << "s"
-             << ", scan: " << scan_duration.count() << "s" << endl;
+        string tmp_path = path + ".tmp";
+        ofstream file(tmp_path, ios::binary | ios::trunc);
+        if (!file.is_open()) {
+            cerr << "Error opening file: " << tmp_path << endl;
+            return false;
+        }
+        ResultCacheHeader header = key;
+        header.word_count = count;
+        header.byte_count = merged_bytes.size();
+        file.write((const char*)&header, sizeof(header));
+        writeArray(file, merged_offsets);
+        writeArray(file, merged_bytes);
+        writeArray(file, merged.df);
+        writeArray(file, merged.total);
+        writeArray(file, merged.maxPerArticle);
+        writeArray(file, merged.firstArticle);
+        file.close();
+        if (file.fail() || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            cerr << "Error writing result cache: " << path << endl;
+            return false;
+        }
+        cout << "Result cache: " << path << " updated, " << count << " words" << endl;
+        return true;
+    }
+};
+
+// 把取自缓存的词条（文章数大于 0）追加到输出文件，格式与批次的输出相同
+static bool append_cached_rows(const string& output_path, const WordList& words, const WordStats& stats,
+                               const vector<bool>& cached, const vector<StatColumn>& columns) {
+    ofstream file(output_path, ios::app);
+    if (!file.is_open()) {
+        cerr << "Error opening file: " << output_path << endl;
+        return false;
+    }
+    stringstream ss;
+    for (size_t i = 0; i < words.size(); i++) {
+        if (!cached[i] || stats.df[i] == 0) continue;
+        ss << words[i];
+        write_stat_columns(ss, columns, stats, i);
+        ss << "\n";
     }
+    file << ss.str();
+    file.close();
+    return !file.fail();
 }
 
 // ============================================================================
 // 处理文件（主处理逻辑）
 // ============================================================================
 
-static int process_files(const string& raw_path, const string& txt_path, int num_threads) {
+// 默认输出文件：单个输入为 <输入>.filted.csv（压缩文件去掉 .zst/.gz/.xz 后缀，标准输入为 stdin.filted.csv），
+// 多个输入为第一个输入所在目录下的 merged.filted.csv
+static string default_output_path(const vector<string>& raw_paths) {
+    if (raw_paths.size() == 1) {
+        string path = raw_paths[0] == "-" ? "stdin" : raw_paths[0];
+        const char* suffixes[] = { ".zst", ".gz", ".xz" };
+        for (const char* suffix : suffixes) {
+            size_t n = strlen(suffix);
+            if (path.size() > n && path.compare(path.size() - n, n, suffix) == 0) {
+                path.resize(path.size() - n);
+                break;
+            }
+        }
+        return path + ".filted.csv";
+    }
+    size_t slash = raw_paths[0].find_last_of('/');
+    string dir = slash == string::npos ? "." : raw_paths[0].substr(0, slash);
+    return dir + "/merged.filted.csv";
+}
+
+static int process_files(const vector<string>& raw_paths, const string& txt_path, int num_threads, const FilterOptions& options) {
     auto total_start = chrono::high_resolution_clock::now();
+    RunTelemetry* telemetry = options.telemetry.get();
+    double phase_start = telemetry ? telemetry->now() : 0.0;
+    if (telemetry) {
+        telemetry->nameThread("main");
+    }
 
     // ========================================================================
     // 第一步：读取词典（先获知词条数量，才能准确预估内存需求）
     // ========================================================================
-    ifstream txt_file(txt_path);
-    const string output_path = raw_path + ".filted.csv";
+    const string output_path = options.output_path.empty() ? default_output_path(raw_paths) : options.output_path;
 
-    // 清空输出文件
-    {
+    // 清空输出文件（续跑时在核对检查点之后再截断到已完成批次的长度）
+    if (!options.resume) {
         ofstream output_file(output_path, ios_base::out);
         output_file.close();
     }
 
-    // 设置 UTF-8 locale
-    const char* utf8_locales[] = {
-        "en_US.UTF-8", "en_US.utf8", "en_GB.UTF-8", "en_GB.utf8",
-        "C.UTF-8", "C.utf8", "POSIX.UTF-8",
-        "zh_CN.UTF-8", "zh_CN.utf8", "zh_TW.UTF-8", "zh_TW.utf8",
-        "zh_HK.UTF-8", "zh_HK.utf8", "zh_SG.UTF-8", "zh_SG.utf8",
-        "ja_JP.UTF-8", "ja_JP.utf8",
-        "ko_KR.UTF-8", "ko_KR.utf8",
-        nullptr
-    };
-    bool locale_set = false;
-    for (int i = 0; utf8_locales[i] != nullptr; ++i) {
-        try {
-            locale utf8_loc(utf8_locales[i]);
-            txt_file.imbue(utf8_loc);
-            locale_set = true;
-            break;
-        } catch (const std::runtime_error& e) {
-            continue;
-        }
-    }
-    if (!locale_set) {
-        cerr << "Warning: No UTF-8 locale available, using classic locale" << endl;
-    }
-
-    if (!txt_file.is_open()) {
-        cerr << "Error opening file: " << txt_path << endl;
+    // 读取词典，或从预编译索引中取出词表
+    WordList words;
+    unique_ptr<IndexFile> index;
+    if (!load_words(txt_path, options, index, words)) {
         return -1;
     }
 
-    // 读取词典
-    string word;
-    vector<string> words;
-    while (getline(txt_file, word)) {
-        // 去除空白字符（比regex_replace快10倍以上）
-        size_t write_pos = 0;
-        for (size_t i = 0; i < word.size(); i++) {
-            if (!isspace((unsigned char)word[i])) {
-                word[write_pos++] = word[i];
+    size_t total_words = words.size();
+    cout << "Dictionary size: " << total_words << " words" << endl;
+
+    // --cache：取自缓存的词条直接使用结果，words 只保留需要扫描的词条，完整的词典移到 dict_words
+    unique_ptr<ResultCache> cache;
+    WordList dict_words;
+    vector<bool> cached;            // 词典中的词条是否取自缓存
+    vector<uint32_t> scan_ids;      // words 中每个词条在词典中的编号
+    WordStats dict_stats;           // 以词典编号为下标的完整结果
+    if (!options.cache_path.empty()) {
+        for (const auto& raw_path : raw_paths) {
+            if (raw_path == "-") {
+                cerr << "Error: --cache needs input files, not standard input" << endl;
+                return -1;
+            }
+        }
+        if (index || options.per_shard) {
+            cerr << "Error: --cache cannot be combined with " << (index ? "--index" : "--per-shard") << endl;
+            return -1;
+        }
+        unsigned mask = stat_mask(options.columns);
+        auto hash_start = chrono::high_resolution_clock::now();
+        uint64_t corpus_hash, corpus_bytes;
+        if (!corpus_content_hash(raw_paths, corpus_hash, corpus_bytes)) {
+            cerr << "Error: cannot read input files for --cache" << endl;
+            return -1;
+        }
+        chrono::duration<double> hash_time = chrono::high_resolution_clock::now() - hash_start;
+        cout << "Result cache: hashed " << corpus_bytes / (1024 * 1024) << " MB of input in "
+             << fixed << setprecision(2) << hash_time.count() << " seconds" << endl;
+        cache.reset(new ResultCache(options.cache_path, corpus_hash,
+                                    options.folding ? options.folding->fingerprint() : 0, mask));
+        cache->load();
+        dict_words = move(words);
+        dict_stats.assign(dict_words.size(), mask);
+        cached.assign(dict_words.size(), false);
+        WordListBuilder scan_words;
+        for (size_t i = 0; i < dict_words.size(); i++) {
+            int64_t cache_idx = cache->find(dict_words[i]);
+            if (cache_idx >= 0) {
+                dict_stats.copyEntry(i, cache->getStats(), (size_t)cache_idx);
+                cached[i] = true;
+            } else {
+                scan_ids.push_back((uint32_t)i);
+                scan_words.add(dict_words[i]);
             }
         }
-        word.resize(write_pos);
-        if (word.length() > 1) {
-            words.push_back(move(word));  // 移动语义避免拷贝
+        scan_words.finish(words);
+        total_words = words.size();
+        cout << "Result cache: " << dict_words.size() - total_words << " of " << dict_words.size()
+             << " words cached, counting " << total_words << " words" << endl;
+
+        if (words.empty()) {
+            ofstream output_file(output_path, ios_base::out);
+            output_file.close();
+            if (!append_cached_rows(output_path, dict_words, dict_stats, cached, options.columns)) {
+                return -1;
+            }
+            if (!options.partial_path.empty()
+                && !write_partial(options.partial_path, dictionary_fingerprint(dict_words), dict_stats.df)) {
+                return -1;
+            }
+            cout << "All words found in the result cache, nothing to scan" << endl;
+            cout << "Output: " << output_path << endl;
+            return 0;
         }
     }
-    txt_file.close();
-
-    size_t total_words = words.size();
-    cout << "Dictionary size: " << total_words << " words" << endl;
+    if (telemetry) {
+        double phase_end = telemetry->now();
+        telemetry->phase("dictionary", phase_start, phase_end, JsonObject()
+            .add("words", total_words)
+            .add("source", index ? options.index_path : txt_path)
+            .add("rss_mb", get_process_memory_mb()));
+        phase_start = phase_end;
+    }
     cout << "[MEM] After loading dictionary: " << get_process_memory_mb() << " MB" << endl;
 
     // ========================================================================
@@ -742,55 +6495,95 @@ static int process_files(const string& raw_path, const string& txt_path, int num
     
     // ========================================================================
     // 第三步：先获取文件大小，再确定 chunk 大小
+    // 文本通过 mmap 读取，数据由页缓存提供；chunk 只决定本进程驻留的映射窗口大小
     // ========================================================================
     
-    // 获取文件大小
+    // 获取文件大小（多个输入时为所有分片之和；压缩文件为压缩后的大小，标准输入计为 0）
     size_t file_size = 0;
-    {
+    for (const auto& raw_path : raw_paths) {
+        if (raw_path == "-") continue;
         ifstream file(raw_path, ios::binary | ios::ate);
         if (!file.is_open()) {
             cerr << "Error opening file: " << raw_path << endl;
             return -1;
         }
-        file_size = file.tellg();
+        file_size += file.tellg();
         file.close();
     }
     size_t file_size_mb = file_size / (1024 * 1024);
-    cout << "Input file size: " << file_size_mb << " MB" << endl;
+    cout << "Input file size: " << file_size_mb << " MB";
+    if (raw_paths.size() > 1) {
+        cout << " (" << raw_paths.size() << " shards)";
+    }
+    cout << endl;
     
     // 设置 chunk 大小（使用 80% 的可用 chunk 内存，留 20% 缓冲）
+    // 预读时每个扫描线程同时驻留 readahead_depth 个分块，可用内存按分块数平分；
+    // 平分后不到最小分块大小时减少预读的分块数
     const size_t MIN_CHUNK_MB = 50;
-    size_t chunk_mb = (size_t)(available_for_chunk_mb * 0.8);
-    chunk_mb = max(MIN_CHUNK_MB, chunk_mb);
+    size_t chunk_budget_mb = (size_t)(available_for_chunk_mb * 0.8);
+    size_t readahead_depth = (size_t)max(1, options.readahead);
+    while (readahead_depth > 1 && chunk_budget_mb / readahead_depth < MIN_CHUNK_MB) {
+        readahead_depth--;
+    }
+    size_t chunk_mb = max(MIN_CHUNK_MB, chunk_budget_mb / readahead_depth);
     
     // 如果文件大小小于可用chunk内存，直接使用文件大小作为chunk大小
-    // 这样可以一次性加载整个文件到内存
+    // 这样整个映射可以一直驻留，不必反复释放和缺页，也不需要预读
     if (file_size_mb <= available_for_chunk_mb && file_size_mb > 0) {
         chunk_mb = file_size_mb + 1;  // +1 确保边界情况
-        cout << "File fits in available memory, loading entire file as single chunk" << endl;
+        readahead_depth = 1;
+        cout << "File fits in available memory, keeping entire mapping resident" << endl;
     }
     
     cout << "Memory plan: AC=" << estimated_ac_mem_mb << "MB, Reserve=" << RESERVE_MB 
-         << "MB, Chunk=" << chunk_mb << "MB (available: " << available_for_chunk_mb << "MB)" << endl;
+         << "MB, Chunk=" << chunk_mb << "MB";
+    if (readahead_depth > 1) {
+        cout << " x " << readahead_depth << " buffers";
+    }
+    cout << " (available: " << available_for_chunk_mb << "MB)" << endl;
     
     size_t chunk_size = chunk_mb * 1024 * 1024;
 
     // ========================================================================
     // 第四步：扫描文件分块边界（不加载内容到内存）
     // ========================================================================
-    StreamingFileLoader file_loader(raw_path, chunk_size);
-    if (!file_loader.scanBoundaries()) {
-        cerr << "Error scanning file: " << raw_path << endl;
+    // 切片大小：每个线程约 16 个切片以均衡负载，限制在 64 KB ~ 8 MB 之间
+    const size_t MIN_SLICE_BYTES = 64 * 1024;
+    const size_t MAX_SLICE_BYTES = 8 * 1024 * 1024;
+    size_t slice_size = min(MAX_SLICE_BYTES, max(MIN_SLICE_BYTES, file_size / ((size_t)num_threads * 16)));
+    if (telemetry) {
+        phase_start = telemetry->now();
+    }
+    InputCorpus corpus;
+    if (!corpus.open(raw_paths, chunk_size, slice_size, readahead_depth)) {
+        cerr << "Error scanning input files" << endl;
         return -1;
     }
 
     cout << "[MEM] After scanning file: " << get_process_memory_mb() << " MB" << endl;
-    cout << "[StreamingFileLoader] chunk size: " << file_loader.getChunkMemoryMB() << " MB" << endl;
+    cout << "[StreamingFileLoader] chunk size: " << corpus.getChunkMemoryMB() << " MB" << endl;
+
+    // 如果所有输入能完全驻留，提前预读
+    corpus.prefetchEntireFile();
+    if (telemetry) {
+        double phase_end = telemetry->now();
+        telemetry->phase("open_input", phase_start, phase_end, JsonObject()
+            .add("shards", corpus.getShardCount())
+            .add("streamed", corpus.isStreamed())
+            .add("bytes", file_size)
+            .add("lines", corpus.getLineCount())
+            .add("slices", corpus.getSliceCount())
+            .add("chunk_mb", corpus.getChunkMemoryMB())
+            .add("readahead_chunks", corpus.hasReadahead() ? corpus.getReadaheadDepth() : 0));
+    }
 
-    // 如果只有1个chunk（文件能完全加载），缓存整个文件避免重复IO
-    if (file_loader.getChunkCount() == 1) {
-        file_loader.cacheEntireFile();
-        cout << "[MEM] After caching file: " << get_process_memory_mb() << " MB" << endl;
+    if (options.per_shard) {
+        cout << "Output columns: word, total";
+        for (size_t i = 0; i < corpus.getShardCount(); i++) {
+            cout << ", " << corpus.getPaths()[i];
+        }
+        cout << endl;
     }
 
     // ========================================================================
@@ -800,105 +6593,332 @@ static int process_files(const string& raw_path, const string& txt_path, int num
     // 计算可用于 AC 自动机的内存（实际值，基于当前可用内存）
     size_t current_available_mb = get_available_memory_mb();
     size_t usable_mem_mb = 0;
-    if (current_available_mb > file_loader.getChunkMemoryMB() + RESERVE_MB) {
-        usable_mem_mb = current_available_mb - file_loader.getChunkMemoryMB() - RESERVE_MB;
+    size_t resident_chunk_mb = corpus.getChunkMemoryMB() * corpus.getReadaheadDepth();
+    if (current_available_mb > resident_chunk_mb + RESERVE_MB) {
+        usable_mem_mb = current_available_mb - resident_chunk_mb - RESERVE_MB;
     } else {
         usable_mem_mb = 512;  // 保守值
     }
 
-    // 计算单个 AC 自动机最多能容纳多少词条
-    size_t max_words_per_ac = (usable_mem_mb * 1024 * 1024) / EST_BYTES_PER_WORD;
-
-    // 根据线程数和内存计算批次
-    size_t num_batches;
-    size_t words_per_batch;
-
-    if (num_threads == 1) {
-        // 单线程模式：构建尽可能大的 AC 自动机，减少扫描次数
-        if (total_words <= max_words_per_ac) {
-            num_batches = 1;
-            words_per_batch = total_words;
-            cout << "Single-thread mode: All words fit in one AC automaton" << endl;
+    // 每个词条与自动机无关的开销：每个计数器 8 字节（计数 + 行戳）加上 --columns 选择的统计，
+    // --per-shard 时每个分片另有一列计数
+    size_t shard_bytes_per_word = options.per_shard ? corpus.getShardCount() * sizeof(int) : 0;
+    size_t stat_bytes_per_word = stat_counter_bytes(stat_mask(options.columns));
+    size_t counter_bytes_per_word = stat_bytes_per_word + shard_bytes_per_word;
+
+    // 预编译索引只有一个自动机，多线程时只能按文本切片并行
+    // 流式输入只能读一遍，同样只用一个自动机，多线程时共享扫描
+    bool corpus_split = options.split == ParallelSplit::Corpus || index || corpus.isStreamed();
+    bool single_batch = index || corpus.isStreamed();
+    bool dict_parallel = num_threads > 1 && !corpus_split;
+
+    // 按词典并行时多个批次同时存在，预算平分；数据并行时每个线程各有一份计数器
+    size_t concurrent_batches = dict_parallel ? (size_t)num_threads : 1;
+    if (corpus_split && num_threads > 1) {
+        counter_bytes_per_word = (size_t)num_threads * stat_bytes_per_word + shard_bytes_per_word;
+    }
+    size_t budget_bytes = usable_mem_mb * 1024 * 1024 / concurrent_batches;
+
+    if (index) {
+        cout << "Precompiled index: All words in one AC automaton" << endl;
+    } else if (corpus.isStreamed()) {
+        cout << "Streamed input: All words in one AC automaton (single pass)" << endl;
+        if (total_words * (EST_BYTES_PER_WORD + counter_bytes_per_word) > budget_bytes) {
+            cout << "Warning: dictionary exceeds the estimated memory budget (" << budget_bytes / (1024 * 1024)
+                 << " MB), decompress the input to a file to allow batching" << endl;
+        }
+    }
+    if (single_batch) {
+        budget_bytes = numeric_limits<size_t>::max() / 2;  // 只有一个批次，不按内存切分
+    }
+    size_t estimated_words_cap = max<size_t>(1, budget_bytes / (EST_BYTES_PER_WORD + counter_bytes_per_word));
+    size_t estimated_batches = single_batch ? 1
+        : max(concurrent_batches, (total_words + estimated_words_cap - 1) / estimated_words_cap);
+
+    // 选择扫描顺序：批次优先时语料放不进内存的部分每个批次都要重新读一遍（批次数 × 语料）；
+    // 分块优先时语料只读一遍，但所有线程要为全部词条各准备一份计数器，自动机放不进剩余内存的部分
+    // 写入临时文件，每个分块都要重新换入（语料 + 换出的自动机 × 分块数）。按预计读盘量较少的一种
+    bool chunk_major = false;
+    size_t chunk_counter_bytes = total_words * (size_t)num_threads * stat_bytes_per_word;
+    size_t chunk_ac_budget = 0;  // 分块优先时所有自动机常驻可用的内存
+    if (options.schedule != ScanSchedule::Batch && !single_batch) {
+        size_t usable_bytes = usable_mem_mb * 1024 * 1024;
+        chunk_ac_budget = usable_bytes > chunk_counter_bytes ? usable_bytes - chunk_counter_bytes : 0;
+        double estimated_ac_bytes = (double)total_words * EST_BYTES_PER_WORD;
+        double spilled_bytes = max(0.0, estimated_ac_bytes - (double)chunk_ac_budget);
+        size_t chunks = corpus.getChunkCount();
+        double batch_io = (chunks > 1 ? (double)estimated_batches : 1.0) * file_size;
+        double chunk_io = (double)file_size + spilled_bytes * chunks;
+        bool can_spill = options.engine != SearchEngine::Classic;
+
+        if (options.per_shard) {
+            if (options.schedule == ScanSchedule::Chunk) {
+                cout << "--schedule=chunk does not support --per-shard, using batch-major" << endl;
+            }
+        } else if (options.schedule == ScanSchedule::Chunk) {
+            chunk_major = true;
+            if (!can_spill && spilled_bytes > 0) {
+                cout << "Warning: the classic engine cannot spill automata, all batches stay resident" << endl;
+            }
         } else {
-            num_batches = (total_words + max_words_per_ac - 1) / max_words_per_ac;
-            words_per_batch = (total_words + num_batches - 1) / num_batches;
-            cout << "Single-thread mode: Split into " << num_batches << " batches" << endl;
+            chunk_major = estimated_batches > 1 && chunks > 1 && (can_spill || spilled_bytes == 0)
+                       && chunk_io < batch_io;
+        }
+        if (estimated_batches > 1 || chunk_major) {
+            cout << "Schedule: " << (chunk_major ? "chunk-major" : "batch-major") << " (estimated reads: batch-major "
+                 << (size_t)(batch_io / (1024 * 1024)) << " MB, chunk-major " << (size_t)(chunk_io / (1024 * 1024))
+                 << " MB with " << (size_t)(spilled_bytes / (1024 * 1024)) << " MB of automata spilled, "
+                 << chunks << " chunks)" << endl;
         }
-    } else {
-        // 多线程模式：根据内存限制计算批次数，确保至少等于线程数
-        size_t batches_by_memory = (total_words + max_words_per_ac - 1) / max_words_per_ac;
-        num_batches = max(batches_by_memory, (size_t)num_threads);
-        words_per_batch = (total_words + num_batches - 1) / num_batches;
     }
+    if (chunk_major) {
+        // 批次依次构建，所有线程共享扫描；计数器已从预算中扣除，批次大小只受构建峰值限制
+        // 检查点按批次记录，与批次优先通用，指纹仍按 --split
+        dict_parallel = false;
+        concurrent_batches = 1;
+        counter_bytes_per_word = 0;
+        budget_bytes = max<size_t>(chunk_ac_budget, 1);
+        estimated_words_cap = max<size_t>(1, budget_bytes / EST_BYTES_PER_WORD);
+        estimated_batches = (total_words + estimated_words_cap - 1) / estimated_words_cap;
+    }
+
+    // 初始规划按估算值，第一批构建后按实测值重新规划
+    BatchPlanner planner(total_words, budget_bytes, counter_bytes_per_word, EST_BYTES_PER_WORD,
+                         dict_parallel ? (size_t)num_threads : 1);
+    if (!single_batch) {
+        cout << "Initial plan: ~" << estimated_batches << " batches, ~"
+             << (total_words + estimated_batches - 1) / estimated_batches << " words/batch (estimated "
+             << EST_BYTES_PER_WORD << " + " << counter_bytes_per_word << " bytes/word, budget "
+             << budget_bytes / (1024 * 1024) << " MB/batch), re-planned after the first AC build" << endl;
+    }
+    cout << "Using " << num_threads << " thread(s), engine: " << engine_name(options.engine);
+    if (chunk_major) {
+        cout << ", schedule: chunk-major";
+    } else if (num_threads > 1) {
+        cout << ", split: " << (corpus_split ? "corpus" : "dictionary");
+    }
+    cout << endl;
 
-    // 估算每批内存
-    size_t estimated_mem_per_batch_mb = (words_per_batch * EST_BYTES_PER_WORD) / (1024 * 1024);
+    // 按词典并行时的切片窃取，扫描结束后输出各线程的空闲情况
+    unique_ptr<TileScheduler> tiles;
 
-    cout << "Batch strategy: " << num_batches << " batches, "
-         << words_per_batch << " words/batch (max)" << endl;
-    cout << "Estimated memory per batch: ~" << estimated_mem_per_batch_mb << " MB" << endl;
-    cout << "Using " << num_threads << " thread(s)" << endl;
+    // 批次优先且有多个批次时启动运行时内存调控：内存紧张时减少同时运行的批次，推迟新的自动机构建
+    unique_ptr<MemoryGovernor> governor;
+    if (!single_batch && !chunk_major) {
+        governor.reset(new MemoryGovernor(RESERVE_MB, (int)concurrent_batches));
+    }
 
     // 6. 批次处理
-    vector<BatchRange> batches;
-    for (size_t i = 0; i < num_batches; i++) {
-        BatchRange range;
-        range.start = i * words_per_batch;
-        range.end = min((i + 1) * words_per_batch, total_words);
-        if (range.start >= total_words) break;
-        batches.push_back(range);
+    if (telemetry) {
+        phase_start = telemetry->now();
+    }
+
+    // --partial 和 --cache 时按词条编号收集所有批次的统计
+    WordStats results;
+    if (!options.partial_path.empty() || cache) {
+        results.assign(total_words, stat_mask(options.columns));
     }
-    num_batches = batches.size();  // 更新实际批次数
 
-    if (num_threads == 1) {
+    // 检查点：指纹包含影响扫描方式和输出格式的选项，续跑必须使用相同的线程数和选项
+    // 流式输入只能读一遍，不写检查点
+    unique_ptr<CheckpointStore> checkpoint;
+    if (options.checkpoint_interval > 0 && !corpus.isStreamed()) {
+        string key = "threads=" + to_string(num_threads) + " split=" + (corpus_split ? "corpus" : "dict")
+                   + " per_shard=" + to_string(options.per_shard) + " columns=";
+        for (StatColumn column : options.columns) {
+            key += string(stat_column_name(column)) + ",";
+        }
+        key += " normalize=" + to_string(options.folding ? options.folding->fingerprint() : 0);
+        uint64_t fingerprint = run_fingerprint(dictionary_fingerprint(words), corpus.getPaths(), key);
+        checkpoint.reset(new CheckpointStore(output_path + ".ckpt", fingerprint, total_words, options.checkpoint_interval));
+    }
+    if (options.resume) {
+        if (!checkpoint) {
+            cerr << "Error: --resume needs seekable input files and checkpoints (--checkpoint-interval > 0)" << endl;
+            return -1;
+        }
+        bool found = false;
+        string error;
+        if (!checkpoint->load(found, error)) {
+            cerr << "Error: cannot resume from " << checkpoint->getPath() << ": " << error << endl;
+            return -1;
+        }
+        struct stat st;
+        uint64_t output_bytes = checkpoint->getOutputBytes();
+        if (found && (stat(output_path.c_str(), &st) != 0 || (uint64_t)st.st_size < output_bytes)) {
+            cerr << "Error: cannot resume from " << checkpoint->getPath() << ": " << output_path
+                 << " is shorter than recorded" << endl;
+            return -1;
+        }
+        if (truncate(output_path.c_str(), output_bytes) != 0) {
+            ofstream output_file(output_path, ios_base::out);
+            output_file.close();
+        }
+        if (found) {
+            size_t done_words = 0;
+            for (const BatchCheckpoint* batch : checkpoint->completed()) {
+                done_words += batch->range.end - batch->range.start;
+                if (!results.df.empty()) {
+                    results.store(batch->range.start, batch->stats);
+                }
+            }
+            vector<BatchRange> pending = checkpoint->pending();
+            planner.resume(pending, checkpoint->plannedEnd());
+            cout << "Resuming from " << checkpoint->getPath() << ": " << checkpoint->completed().size()
+                 << " batch(es) done (" << done_words << " words), " << pending.size()
+                 << " unfinished, " << total_words - checkpoint->plannedEnd() << " words not started" << endl;
+        } else {
+            cout << "No checkpoint at " << checkpoint->getPath() << ", starting from the beginning" << endl;
+        }
+    }
+
+    if (chunk_major) {
+        // 分块优先：先构建所有批次的自动机，再由所有线程共享扫描一遍语料
+        g_base_memory_mb.store(get_process_memory_mb());
+        if (!process_batches_chunk_major(words, corpus, output_path, options, num_threads, chunk_ac_budget, planner,
+                                         results.df.empty() ? nullptr : &results, checkpoint.get())) {
+            return -1;
+        }
+    } else if (!dict_parallel) {
         // 单线程模式：顺序处理，减少缓存热身开销
+        // 数据并行模式：批次依次处理，每个批次内由所有线程共享自动机扫描切片
         // 记录基准内存
         g_base_memory_mb.store(get_process_memory_mb());
-        
-        for (size_t batch_idx = 0; batch_idx < num_batches; batch_idx++) {
-            process_batch_with_ac(
+
+        BatchRange range;
+        int batch_idx = 0;
+        int num_batches = 0;
+        while (planner.next(range, batch_idx, num_batches)) {
+            if (governor) {
+                governor->awaitBuild(batch_idx, planner.estimatePeakBytes(range));
+            }
+            bool ok = process_batch_with_ac(
                 words,
-                batches[batch_idx],
-                file_loader,
+                range,
+                corpus,
                 output_path,
                 batch_idx,
-                num_batches
+                num_batches,
+                options,
+                num_threads,
+                index.get(),
+                results.df.empty() ? nullptr : &results,
+                &planner,
+                checkpoint.get()
             );
+            if (!ok) {
+                return -1;
+            }
         }
     } else {
         // 多线程模式：使用线程池处理批次
         // 记录基准内存（所有batch开始前的内存）
         g_base_memory_mb.store(get_process_memory_mb());
-        
-        atomic<size_t> next_batch(0);
 
-        auto worker = [&]() {
-            while (true) {
-                size_t batch_idx = next_batch.fetch_add(1);
-                if (batch_idx >= num_batches) break;
+        atomic<bool> failed(false);
+
+        // 各批次按切片扫描，领不到新批次的线程加入其他批次（--per-shard 时仍由一个线程按分片扫描整个批次）
+        if (!options.per_shard) {
+            tiles.reset(new TileScheduler(num_threads));
+        }
 
-                process_batch_with_ac(
+        auto worker = [&](int worker_idx) {
+            if (telemetry) {
+                telemetry->nameThread("worker " + to_string(worker_idx));
+            }
+            BatchRange range;
+            int batch_idx = 0;
+            int num_batches = 0;
+            while (true) {
+                if (tiles) tiles->expect();
+                governor->acquireSlot();
+                if (!planner.next(range, batch_idx, num_batches)) {
+                    governor->releaseSlot();
+                    if (tiles) tiles->cancel();
+                    break;
+                }
+                governor->awaitBuild(batch_idx, planner.estimatePeakBytes(range));
+                bool ok = process_batch_with_ac(
                     words,
-                    batches[batch_idx],
-                    file_loader,
+                    range,
+                    corpus,
                     output_path,
                     batch_idx,
-                    num_batches
+                    num_batches,
+                    options,
+                    1,
+                    nullptr,
+                    results.df.empty() ? nullptr : &results,
+                    &planner,
+                    checkpoint.get(),
+                    tiles.get()
                 );
+                governor->releaseSlot();
+                if (!ok) failed = true;
             }
+            if (tiles) tiles->help(worker_idx);
         };
 
         vector<thread> threads;
         for (int i = 0; i < num_threads; i++) {
-            threads.emplace_back(worker);
+            threads.emplace_back(worker, i);
         }
 
         for (auto& t : threads) {
             t.join();
         }
+        if (failed) {
+            return -1;
+        }
+    }
+
+    planner.printSummary();
+    if (tiles) {
+        tiles->printSummary();
+    }
+    if (telemetry) {
+        double phase_end = telemetry->now();
+        JsonObject attributes;
+        attributes.add("batches", planner.getBatchCount())
+                  .add("split", corpus_split ? "corpus" : "dictionary")
+                  .add("schedule", chunk_major ? "chunk" : "batch");
+        if (tiles) {
+            TileScheduler::Summary summary = tiles->summarize();
+            attributes.add("stolen_slices", summary.stolen_slices)
+                      .add("tail_seconds", summary.tail_seconds)
+                      .add("idle_seconds", summary.idle_seconds);
+        }
+        telemetry->phase("batches", phase_start, phase_end, attributes);
+        phase_start = phase_end;
+    }
+
+    // --cache：补上取自缓存的词条，部分结果和缓存都按完整的词典
+    if (cache) {
+        for (size_t i = 0; i < scan_ids.size(); i++) {
+            dict_stats.copyEntry(scan_ids[i], results, i);
+        }
+        if (!append_cached_rows(output_path, dict_words, dict_stats, cached, options.columns)) {
+            return -1;
+        }
+    }
+    if (!options.partial_path.empty()
+        && !write_partial(options.partial_path, dictionary_fingerprint(cache ? dict_words : words),
+                          cache ? dict_stats.df : results.df)) {
+        return -1;
+    }
+    if (telemetry && !options.partial_path.empty()) {
+        telemetry->phase("write_partial", phase_start, telemetry->now(), JsonObject()
+            .add("path", options.partial_path));
+    }
+    // 检查点删除后再更新缓存：续跑按缓存更新前的词条划分批次
+    if (checkpoint) {
+        checkpoint->remove();
+    }
+    if (cache && !cache->update(dict_words, dict_stats)) {
+        return -1;
     }
 
-    // 7. 清理（ChunkedFileLoader 会自动在析构时释放内存）
+    // 7. 清理（InputCorpus 中的各个 StreamingFileLoader 会在析构时解除映射）
 
     auto total_end = chrono::high_resolution_clock::now();
     chrono::duration<double> total_duration = total_end - total_start;
@@ -907,28 +6927,856 @@ static int process_files(const string& raw_path, const string& txt_path, int num
     cout << "Completed in " << total_duration.count() << " seconds" << endl;
     cout << "Output: " << output_path << endl;
 
+    if (telemetry) {
+        string inputs;
+        for (const auto& raw_path : raw_paths) {
+            if (!inputs.empty()) inputs += ", ";
+            append_json_string(inputs, raw_path);
+        }
+        telemetry->setRunInfo(JsonObject()
+            .add("dictionary", txt_path)
+            .addRaw("inputs", "[" + inputs + "]")
+            .add("output", output_path)
+            .add("threads", num_threads)
+            .add("engine", engine_name(options.engine))
+            .add("split", corpus_split ? "corpus" : "dictionary")
+            .add("per_shard", options.per_shard)
+            .add("normalize", options.folding != nullptr)
+            .add("words", total_words));
+        if (!telemetry->write(total_duration.count())) {
+            return -1;
+        }
+    }
+
     return 0;
 }
 
+// ============================================================================
+// 基准测试（bench 子命令）
+// 按固定种子在本地生成可复现的语料和词典，分别测量自动机插入、失败指针构建、冻结、扫描和文件加载的吞吐量，
+// 可以保存为基线并在之后与基线对比；同时用朴素的 string::find 核对各引擎的计数，新引擎必须给出相同的结果
+// ============================================================================
+
+struct BenchOptions {
+    size_t corpus_mb = 64;          // 语料大小
+    size_t words = 200000;          // 词典词条数
+    double cjk_ratio = 0.9;         // 语料和词典中 CJK 词条的比例，其余为 ASCII 词条
+    double zipf = 1.0;              // 语料中词条出现频率的 Zipf 指数
+    uint64_t seed = 1;
+    int repeat = 3;                 // 每项重复次数，取最快的一次
+    string dir = "wikifilter-bench";
+    string baseline_path;           // 与此基线对比
+    string save_baseline_path;      // 把本次结果保存为基线
+    size_t oracle_words = 500;      // 用 string::find 核对的词条数
+    size_t oracle_mb = 4;           // 核对时扫描的语料前缀大小
+    double tolerance = 5.0;         // 吞吐量下降超过此百分比时标记为回退
+};
+
+// 可复现的伪随机数（xorshift64*）：不使用标准库的分布，不同平台和编译器生成相同的数据
+class BenchRandom {
+private:
+    uint64_t state;
+
+public:
+    explicit BenchRandom(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL) {
+        if (state == 0) state = 1;
+    }
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    size_t below(size_t n) { return (size_t)(next() % n); }
+    double real() { return (next() >> 11) * (1.0 / 9007199254740992.0); }  // [0, 1)
+};
+
+// Zipf 分布：秩 r 的权重为 1 / (r + 1)^s，预先计算累积分布后二分查找
+class ZipfSampler {
+private:
+    vector<double> cdf;
+
+public:
+    ZipfSampler(size_t n, double exponent) : cdf(n) {
+        double total = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            total += 1.0 / pow((double)(i + 1), exponent);
+            cdf[i] = total;
+        }
+        for (auto& value : cdf) value /= total;
+    }
+
+    size_t sample(BenchRandom& random) const {
+        size_t rank = lower_bound(cdf.begin(), cdf.end(), random.real()) - cdf.begin();
+        return min(rank, cdf.size() - 1);
+    }
+};
+
+// 词条长度（字符数），大致按中文维基标题的分布：2 字 35%、3 字 25%、4 字 25%、5~8 字 15%
+static size_t bench_term_length(BenchRandom& random) {
+    double r = random.real();
+    if (r < 0.35) return 2;
+    if (r < 0.60) return 3;
+    if (r < 0.85) return 4;
+    return 5 + random.below(4);
+}
+
+// 生成一个词条：CJK 词条的字按 Zipf 分布取自常用字，ASCII 词条为小写字母，偶尔首字母大写
+static string bench_make_term(BenchRandom& random, bool cjk, const ZipfSampler& chars) {
+    string term;
+    size_t length = bench_term_length(random);
+    if (cjk) {
+        for (size_t i = 0; i < length; i++) {
+            // 把字的秩打散到整个基本区（20902 个字），避免常用字集中在同一段编码
+            encode_utf8(0x4E00 + (uint32_t)(chars.sample(random) * 7919 % 20902), term);
+        }
+    } else {
+        length = length * 2 + random.below(3);
+        for (size_t i = 0; i < length; i++) {
+            term += (char)('a' + random.below(26));
+        }
+        if (random.below(4) == 0) term[0] = (char)toupper((unsigned char)term[0]);
+    }
+    return term;
+}
+
+// 生成词表和词典：词表是语料的全部用词，词典 3/4 取自词表（秩均匀分布，多数是低频词），1/4 是语料中没有的新词
+static void bench_generate_terms(const BenchOptions& options, vector<string>& vocabulary, vector<string>& dictionary) {
+    BenchRandom random(options.seed);
+    ZipfSampler chars(3500, 1.0);
+    unordered_set<string> seen;
+
+    size_t vocabulary_size = options.words * 3 / 4 + 20000;
+    while (vocabulary.size() < vocabulary_size) {
+        string term = bench_make_term(random, random.real() < options.cjk_ratio, chars);
+        if (seen.insert(term).second) vocabulary.push_back(move(term));
+    }
+
+    size_t from_vocabulary = min(vocabulary.size(), options.words * 3 / 4);
+    vector<bool> picked(vocabulary.size(), false);
+    while (dictionary.size() < from_vocabulary) {
+        size_t rank = random.below(vocabulary.size());
+        if (picked[rank]) continue;
+        picked[rank] = true;
+        dictionary.push_back(vocabulary[rank]);
+    }
+    while (dictionary.size() < options.words) {
+        string term = bench_make_term(random, random.real() < options.cjk_ratio, chars);
+        if (seen.insert(term).second) dictionary.push_back(move(term));
+    }
+}
+
+// 生成语料：每行一篇文章，词条按 Zipf 分布取自词表，中间穿插标点，ASCII 词条两侧加空格
+// latin_ratio > 0 时按该比例插入词表之外的拉丁文单词和数字，模拟以拉丁文为主的文章
+static string bench_generate_corpus(const BenchOptions& options, const vector<string>& vocabulary, size_t target_mb,
+                                    double latin_ratio, uint64_t salt, size_t& articles) {
+    BenchRandom random(options.seed ^ salt);
+    ZipfSampler terms(vocabulary.size(), options.zipf);
+    size_t target = target_mb * 1024 * 1024;
+    string corpus;
+    corpus.reserve(target + 64 * 1024);
+    articles = 0;
+    while (corpus.size() < target) {
+        // 文章长度（词条数）大致服从均值约 300 的指数分布
+        size_t tokens = 20 + (size_t)(-log(1.0 - random.real()) * 300.0);
+        for (size_t i = 0; i < tokens; i++) {
+            if (latin_ratio > 0 && random.real() < latin_ratio) {
+                if (random.below(8) == 0) {
+                    corpus += to_string(1000 + random.below(9000));
+                } else {
+                    size_t letters = 2 + random.below(8);
+                    for (size_t k = 0; k < letters; k++) corpus += (char)('a' + random.below(26));
+                }
+                double r = random.real();
+                corpus += r < 0.08 ? ", " : r < 0.12 ? ". " : " ";
+                continue;
+            }
+            const string& term = vocabulary[terms.sample(random)];
+            if ((unsigned char)term[0] < 0x80) {
+                corpus += ' ';
+                corpus += term;
+                corpus += ' ';
+            } else {
+                corpus += term;
+            }
+            double r = random.real();
+            if (r < 0.10) corpus += "，";
+            else if (r < 0.15) corpus += "。";
+        }
+        corpus += '\n';
+        articles++;
+    }
+    return corpus;
+}
+
+static bool bench_write_file(const string& path, const string& content) {
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cerr << "Error writing " << path << endl;
+        return false;
+    }
+    file.write(content.data(), content.size());
+    file.close();
+    return !file.fail();
+}
+
+// 重复执行 body，返回最快一次的秒数
+template<typename Body>
+static double bench_best_seconds(int repeat, Body&& body) {
+    double best = numeric_limits<double>::max();
+    for (int i = 0; i < repeat; i++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return max(best, 1e-9);
+}
+
+// 扫描 [data, data + bytes) 的每一行并按行计数（与 process_batch_with_ac 相同的计数方式）
+static vector<int> bench_scan(const BatchAutomaton& ac, size_t pattern_count, const char* data, size_t bytes) {
+    DocumentCounter<> counter(pattern_count);
+    auto hit = [&counter](int idx) { counter.hit(idx); };
+    auto scan_line = [&](const char* line_text, size_t line_len, size_t, size_t) -> bool {
+        counter.beginLine();
+        ac.search(line_text, line_len, hit);
+        return true;
+    };
+    StreamingFileLoader::processLines(data, bytes, 0, 0, scan_line);
+    return counter.getCounts();
+}
+
+struct BenchMetric {
+    string name;
+    double value;   // 吞吐量，越大越好
+    string unit;
+};
+
+// 基线文件：每行 "param<TAB>名称<TAB>值" 或 "metric<TAB>名称<TAB>值<TAB>单位"
+static bool bench_save_baseline(const string& path, const vector<pair<string, string>>& params,
+                                const vector<BenchMetric>& metrics) {
+    ofstream file(path, ios::trunc);
+    if (!file.is_open()) {
+        cerr << "Error writing " << path << endl;
+        return false;
+    }
+    file << "# WikiFilter bench baseline" << endl;
+    for (const auto& param : params) {
+        file << "param\t" << param.first << "\t" << param.second << endl;
+    }
+    file << setprecision(9);
+    for (const auto& metric : metrics) {
+        file << "metric\t" << metric.name << "\t" << metric.value << "\t" << metric.unit << endl;
+    }
+    file.close();
+    return !file.fail();
+}
+
+static bool bench_load_baseline(const string& path, map<string, string>& params, map<string, double>& metrics) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        cerr << "Error opening baseline " << path << endl;
+        return false;
+    }
+    string line;
+    while (getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        vector<string> fields;
+        size_t start = 0;
+        while (true) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(line.substr(start, tab == string::npos ? string::npos : tab - start));
+            if (tab == string::npos) break;
+            start = tab + 1;
+        }
+        if (fields.size() >= 3 && fields[0] == "param") {
+            params[fields[1]] = fields[2];
+        } else if (fields.size() >= 3 && fields[0] == "metric") {
+            metrics[fields[1]] = atof(fields[2].c_str());
+        }
+    }
+    return true;
+}
+
+static int run_bench(const BenchOptions& options) {
+    // 1. 生成语料和词典
+    auto generate_start = chrono::steady_clock::now();
+    vector<string> vocabulary;
+    vector<string> words;
+    bench_generate_terms(options, vocabulary, words);
+    size_t articles = 0;
+    string corpus = bench_generate_corpus(options, vocabulary, options.corpus_mb, 0.0, 0xC0FFEEULL, articles);
+    // 以拉丁文为主的文章（词表之外的单词占 80%），用于单独衡量各引擎在拉丁文上的扫描速度
+    size_t latin_articles = 0;
+    string latin_corpus = bench_generate_corpus(options, vocabulary, max<size_t>(1, options.corpus_mb / 4), 0.8,
+                                                0x1A71EULL, latin_articles);
+    vocabulary.clear();
+    vocabulary.shrink_to_fit();
+
+    string dictionary_text;
+    for (const auto& word : words) {
+        dictionary_text += word;
+        dictionary_text += '\n';
+    }
+    mkdir(options.dir.c_str(), 0755);
+    string dict_path = options.dir + "/bench-dict.txt";
+    string corpus_path = options.dir + "/bench-corpus.txt";
+    if (!bench_write_file(dict_path, dictionary_text) || !bench_write_file(corpus_path, corpus)) {
+        return 1;
+    }
+    chrono::duration<double> generate_time = chrono::steady_clock::now() - generate_start;
+
+    char fingerprint[64];
+    snprintf(fingerprint, sizeof(fingerprint), "%016llx/%016llx",
+             (unsigned long long)hash_bytes(dictionary_text.data(), dictionary_text.size()),
+             (unsigned long long)hash_bytes(corpus.data(), corpus.size()));
+    cout << "Generated " << corpus_path << " (" << corpus.size() / (1024 * 1024) << " MB, " << articles
+         << " articles) and " << dict_path << " (" << words.size() << " words) in " << fixed << setprecision(2)
+         << generate_time.count() << "s, fingerprint " << fingerprint << endl;
+    cout << "Generated Latin-heavy articles in memory (" << latin_corpus.size() / (1024 * 1024) << " MB, "
+         << latin_articles << " articles)" << endl;
+    cout << "Parameters: CJK " << setprecision(0) << options.cjk_ratio * 100 << "%, Zipf " << setprecision(2)
+         << options.zipf << ", seed " << options.seed << ", best of " << options.repeat << endl;
+
+    double corpus_mb = corpus.size() / (1024.0 * 1024.0);
+    size_t n = words.size();
+    vector<BenchMetric> metrics;
+
+    // 批次自动机与扫描时一样从读回的词表构建（生成的词条都不含空白、至少两个字节，编号不变）
+    WordList dictionary;
+    if (!load_dictionary(dict_path, dictionary) || dictionary.size() != n) {
+        cerr << "Error: " << dict_path << " did not load back as " << n << " words" << endl;
+        return 1;
+    }
+
+    // 2. 构建：插入、失败指针、码点自动机，以及串行与多线程的完整构建
+    int build_threads = 1;
+    bool build_identical = true;
+    bool arena_identical = true;
+    {
+        unique_ptr<AhoCorasick> trie;
+        double seconds = bench_best_seconds(options.repeat, [&]() {
+            trie.reset(new AhoCorasick());
+            for (size_t i = 0; i < n; i++) trie->insert(words[i], (int)i);
+        });
+        metrics.push_back({ "insert", n / seconds, "words/s" });
+
+        // 失败指针每次都要在新插入的字典树上构建，插入不计时
+        size_t states = trie->getNodeCount();
+        double fail_seconds = numeric_limits<double>::max();
+        for (int r = 0; r < options.repeat; r++) {
+            trie.reset(new AhoCorasick());
+            for (size_t i = 0; i < n; i++) trie->insert(words[i], (int)i);
+            fail_seconds = min(fail_seconds, bench_best_seconds(1, [&]() { trie->buildFailureLinks(); }));
+        }
+        metrics.push_back({ "build_failure_links", states / fail_seconds, "states/s" });
+
+        unique_ptr<CodepointAhoCorasick> codepoint;
+        seconds = bench_best_seconds(options.repeat, [&]() {
+            codepoint.reset(new CodepointAhoCorasick(dictionary, 0, n));
+        });
+        metrics.push_back({ "build_codepoint", n / seconds, "words/s" });
+
+        // 建树 + 失败指针：串行与多线程（至少 2 个线程），按 BFS 重新编号后的数组必须逐字节相同
+        auto pattern_at = [&](size_t i) -> const string& { return words[i]; };
+        seconds = bench_best_seconds(options.repeat, [&]() {
+            trie.reset(new AhoCorasick());
+            trie->insertAll(n, pattern_at);
+            trie->buildFailureLinks();
+        });
+        metrics.push_back({ "build_serial", n / seconds, "words/s" });
+        uint64_t serial_checksum = FlatTrie<char>::fromTrie(*trie).checksum();
+
+        build_threads = max(2, (int)thread::hardware_concurrency());
+        seconds = bench_best_seconds(options.repeat, [&]() {
+            trie.reset(new AhoCorasick());
+            trie->insertAll(n, pattern_at, build_threads);
+            trie->buildFailureLinks(build_threads);
+        });
+        metrics.push_back({ "build_parallel", n / seconds, "words/s" });
+        build_identical = FlatTrie<char>::fromTrie(*trie).checksum() == serial_checksum;
+        trie.reset();
+
+        // 从排序后的词典批量构建平铺字典树（码点自动机的构建方式，这里用字节词条），单线程与多线程，
+        // 结果必须与逐个插入的字典树相同
+        auto flat_pattern = [&](size_t i) { return make_pair(words[i].data(), words[i].size()); };
+        for (int threads : { 1, build_threads }) {
+            FlatTrie<char> flat = FlatTrie<char>::build(n, flat_pattern, threads);
+            arena_identical = arena_identical && flat.checksum() == serial_checksum;
+        }
+    }
+
+    // 3. 扫描：每个引擎扫描内存中的整个语料，以及以拉丁文为主的语料
+    const SearchEngine engines[] = { SearchEngine::Codepoint, SearchEngine::Classic };
+    vector<vector<int>> engine_counts;
+    double latin_mb = latin_corpus.size() / (1024.0 * 1024.0);
+    BatchRange all = { 0, n };
+    for (SearchEngine engine : engines) {
+        BatchAutomaton ac(dictionary, all, engine);
+        string name = string("search_") + engine_name(engine);
+        vector<int> counts;
+        double seconds = bench_best_seconds(options.repeat, [&]() {
+            counts = bench_scan(ac, n, corpus.data(), corpus.size());
+        });
+        double latin_seconds = bench_best_seconds(options.repeat, [&]() {
+            bench_scan(ac, n, latin_corpus.data(), latin_corpus.size());
+        });
+        metrics.push_back({ name, corpus_mb / seconds, "MB/s" });
+        metrics.push_back({ name + "_latin", latin_mb / latin_seconds, "MB/s" });
+        engine_counts.push_back(move(counts));
+    }
+
+    // 4. 加载：读入词典并整理为词表；StreamingFileLoader 映射文件、扫描边界并遍历所有行；
+    //    再加上 codepoint 扫描测量端到端吞吐量
+    {
+        double dictionary_seconds = bench_best_seconds(options.repeat, [&]() {
+            WordList reloaded;
+            load_dictionary(dict_path, reloaded);
+        });
+        metrics.push_back({ "load_dictionary", n / dictionary_seconds, "words/s" });
+
+        size_t lines = 0;
+        double seconds = bench_best_seconds(options.repeat, [&]() {
+            cout.setstate(ios::failbit);  // 加载器的分块日志不输出
+            StreamingFileLoader loader(corpus_path);
+            loader.scanBoundaries();
+            lines = 0;
+            loader.streamProcess([&lines](const char*, size_t, size_t, size_t) -> bool { lines++; return true; });
+            cout.clear();
+        });
+        metrics.push_back({ "loader", corpus_mb / seconds, "MB/s" });
+
+        BatchAutomaton ac(dictionary, all, SearchEngine::Codepoint);
+        seconds = bench_best_seconds(options.repeat, [&]() {
+            cout.setstate(ios::failbit);
+            StreamingFileLoader loader(corpus_path);
+            loader.scanBoundaries();
+            DocumentCounter<> counter(n);
+            auto hit = [&counter](int idx) { counter.hit(idx); };
+            loader.streamProcess([&](const char* line_text, size_t line_len, size_t, size_t) -> bool {
+                counter.beginLine();
+                ac.search(line_text, line_len, hit);
+                return true;
+            });
+            cout.clear();
+        });
+        metrics.push_back({ "loader_codepoint_end_to_end", corpus_mb / seconds, "MB/s" });
+    }
+
+    // 5. 输出结果，与基线对比
+    map<string, string> baseline_params;
+    map<string, double> baseline_metrics;
+    vector<pair<string, string>> params = {
+        { "corpus_mb", to_string(options.corpus_mb) },
+        { "words", to_string(options.words) },
+        { "cjk_ratio", to_string(options.cjk_ratio) },
+        { "zipf", to_string(options.zipf) },
+        { "seed", to_string(options.seed) },
+        { "fingerprint", fingerprint },
+    };
+    if (!options.baseline_path.empty()) {
+        if (!bench_load_baseline(options.baseline_path, baseline_params, baseline_metrics)) {
+            return 1;
+        }
+        for (const auto& param : params) {
+            auto it = baseline_params.find(param.first);
+            if (it != baseline_params.end() && it->second != param.second) {
+                cout << "Warning: baseline " << param.first << " is " << it->second << ", this run uses "
+                     << param.second << "; deltas are not comparable" << endl;
+            }
+        }
+    }
+
+    int regressions = 0;
+    cout << "========================================" << endl;
+    for (const auto& metric : metrics) {
+        cout << "  " << left << setw(34) << metric.name << right << setw(14) << fixed << setprecision(1)
+             << metric.value << " " << left << setw(9) << metric.unit << right;
+        auto it = baseline_metrics.find(metric.name);
+        if (it != baseline_metrics.end() && it->second > 0) {
+            double delta = (metric.value - it->second) * 100.0 / it->second;
+            cout << showpos << setprecision(1) << delta << "%" << noshowpos;
+            if (delta < -options.tolerance) {
+                cout << "  REGRESSION";
+                regressions++;
+            }
+        }
+        cout << endl;
+    }
+    if (!options.baseline_path.empty()) {
+        cout << regressions << " regression(s) beyond " << setprecision(1) << options.tolerance
+             << "% against " << options.baseline_path << endl;
+    }
+    if (!options.save_baseline_path.empty()) {
+        if (!bench_save_baseline(options.save_baseline_path, params, metrics)) {
+            return 1;
+        }
+        cout << "Baseline saved: " << options.save_baseline_path << endl;
+    }
+
+    // 6. 核对：各引擎在整个语料上的计数必须一致，且与 string::find 在语料前缀上的结果一致
+    bool ok = true;
+    if (!build_identical) {
+        cout << "Check FAILED: the automaton built with " << build_threads
+             << " threads differs from the serial build" << endl;
+        ok = false;
+    }
+    if (!arena_identical) {
+        cout << "Check FAILED: the automaton built from the sorted dictionary differs from the inserted trie" << endl;
+        ok = false;
+    }
+    for (size_t e = 1; e < engine_counts.size(); e++) {
+        size_t mismatches = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (engine_counts[e][i] != engine_counts[0][i]) {
+                if (mismatches++ < 5) {
+                    cout << "  " << engine_name(engines[e]) << " vs " << engine_name(engines[0]) << ": "
+                         << words[i] << " " << engine_counts[e][i] << " != " << engine_counts[0][i] << endl;
+                }
+            }
+        }
+        if (mismatches > 0) {
+            cout << "Check FAILED: " << engine_name(engines[e]) << " differs from " << engine_name(engines[0])
+                 << " on " << mismatches << " words" << endl;
+            ok = false;
+        }
+    }
+
+    size_t prefix = min(corpus.size(), options.oracle_mb * 1024 * 1024);
+    while (prefix < corpus.size() && corpus[prefix - 1] != '\n') prefix++;
+    size_t oracle_count = min(n, options.oracle_words);
+    vector<size_t> oracle_ids;
+    for (size_t k = 0; k < oracle_count; k++) {
+        oracle_ids.push_back(k * n / oracle_count);  // 在词典中均匀取词
+    }
+    vector<int> expected(oracle_ids.size(), 0);
+    auto oracle_start = chrono::steady_clock::now();
+    auto find_line = [&](const char* line_text, size_t line_len, size_t, size_t) -> bool {
+        string line(line_text, line_len);
+        for (size_t k = 0; k < oracle_ids.size(); k++) {
+            if (line.find(words[oracle_ids[k]]) != string::npos) expected[k]++;
+        }
+        return true;
+    };
+    StreamingFileLoader::processLines(corpus.data(), prefix, 0, 0, find_line);
+    chrono::duration<double> oracle_time = chrono::steady_clock::now() - oracle_start;
+
+    size_t checked_hits = 0;
+    for (SearchEngine engine : engines) {
+        BatchAutomaton ac(dictionary, all, engine);
+        vector<int> counts = bench_scan(ac, n, corpus.data(), prefix);
+        size_t mismatches = 0;
+        for (size_t k = 0; k < oracle_ids.size(); k++) {
+            if (counts[oracle_ids[k]] != expected[k] && mismatches++ < 5) {
+                cout << "  " << engine_name(engine) << ": " << words[oracle_ids[k]] << " "
+                     << counts[oracle_ids[k]] << ", string::find " << expected[k] << endl;
+            }
+        }
+        if (mismatches > 0) {
+            cout << "Check FAILED: " << engine_name(engine) << " disagrees with string::find on "
+                 << mismatches << " of " << oracle_ids.size() << " words" << endl;
+            ok = false;
+        }
+    }
+    for (int count : expected) checked_hits += count;
+    if (ok) {
+        cout << "Check OK: " << build_threads << "-thread and sorted-arena builds identical to serial; "
+             << engine_counts.size() << " engines agree on all " << n << " words; "
+             << oracle_ids.size() << " words match string::find on the first " << prefix / (1024 * 1024)
+             << " MB (" << checked_hits << " line hits, " << setprecision(2) << oracle_time.count() << "s)" << endl;
+    }
+    return ok ? 0 : 1;
+}
+
+// 解析 bench 子命令的选项，出错时返回 false
+static bool parse_bench_options(int argc, char* argv[], int first, BenchOptions& options) {
+    for (int i = first; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        string value = eq == string::npos ? string() : arg.substr(eq + 1);
+        if (eq == string::npos) {
+            cerr << "Unknown bench option: " << arg << endl;
+            return false;
+        } else if (name == "--size-mb") {
+            options.corpus_mb = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+        } else if (name == "--words") {
+            options.words = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+        } else if (name == "--cjk") {
+            options.cjk_ratio = min(1.0, max(0.0, atof(value.c_str())));
+        } else if (name == "--zipf") {
+            options.zipf = atof(value.c_str());
+        } else if (name == "--seed") {
+            options.seed = strtoull(value.c_str(), nullptr, 10);
+        } else if (name == "--repeat") {
+            options.repeat = max(1, atoi(value.c_str()));
+        } else if (name == "--dir") {
+            options.dir = value;
+        } else if (name == "--baseline") {
+            options.baseline_path = value;
+        } else if (name == "--save-baseline") {
+            options.save_baseline_path = value;
+        } else if (name == "--oracle-words") {
+            options.oracle_words = strtoull(value.c_str(), nullptr, 10);
+        } else if (name == "--oracle-mb") {
+            options.oracle_mb = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+        } else if (name == "--tolerance") {
+            options.tolerance = atof(value.c_str());
+        } else {
+            cerr << "Unknown bench option: " << arg << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 // ============================================================================
 // 主函数
 // ============================================================================
 
+// 展开 args[begin, end) 中的通配符（shell 未展开时，例如参数带引号）
+static bool expand_input_paths(const vector<string>& args, size_t begin, size_t end, vector<string>& paths) {
+    for (size_t i = begin; i < end; i++) {
+        const string& pattern = args[i];
+        struct stat st;
+        if (pattern.find_first_of("*?[") == string::npos || stat(pattern.c_str(), &st) == 0) {
+            paths.push_back(pattern);
+            continue;
+        }
+        glob_t matches;
+        if (glob(pattern.c_str(), 0, nullptr, &matches) != 0) {
+            cerr << "No input files match: " << pattern << endl;
+            return false;
+        }
+        for (size_t j = 0; j < matches.gl_pathc; j++) {
+            paths.push_back(matches.gl_pathv[j]);
+        }
+        globfree(&matches);
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        cout << "用法: " << argv[0] << " <dict file path> <text file path> [thread number]" << endl;
+    FilterOptions options;
+    vector<string> positional;
+    string metrics_path;
+    string trace_path;
+    bool perf_counters = false;
+
+    // bench 模式：WikiFilter bench [--size-mb=N] [--words=N] ... 选项与扫描模式不同，单独解析
+    if (argc > 1 && string(argv[1]) == "bench") {
+        BenchOptions bench_options;
+        if (!parse_bench_options(argc, argv, 2, bench_options)) {
+            return 1;
+        }
+        return run_bench(bench_options);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--engine=", 0) == 0) {
+            string value = arg.substr(9);
+            if (value == "dense") {
+                cerr << "The dense engine has been removed, use --engine=codepoint (default) or --engine=classic" << endl;
+                return 1;
+            } else if (value == "codepoint") {
+                options.engine = SearchEngine::Codepoint;
+            } else if (value == "classic") {
+                options.engine = SearchEngine::Classic;
+            } else {
+                cerr << "Unknown engine: " << value << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--split=", 0) == 0) {
+            string value = arg.substr(8);
+            if (value == "dict") {
+                options.split = ParallelSplit::Dictionary;
+            } else if (value == "corpus") {
+                options.split = ParallelSplit::Corpus;
+            } else {
+                cerr << "Unknown split: " << value << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--schedule=", 0) == 0) {
+            string value = arg.substr(11);
+            if (value == "auto") {
+                options.schedule = ScanSchedule::Auto;
+            } else if (value == "batch") {
+                options.schedule = ScanSchedule::Batch;
+            } else if (value == "chunk") {
+                options.schedule = ScanSchedule::Chunk;
+            } else {
+                cerr << "Unknown schedule: " << value << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--index=", 0) == 0) {
+            options.index_path = arg.substr(8);
+        } else if (arg.rfind("--output=", 0) == 0) {
+            options.output_path = arg.substr(9);
+        } else if (arg == "--per-shard") {
+            options.per_shard = true;
+        } else if (arg.rfind("--partial=", 0) == 0) {
+            options.partial_path = arg.substr(10);
+        } else if (arg.rfind("--dict=", 0) == 0) {
+            options.dict_path = arg.substr(7);
+        } else if (arg.rfind("--normalize=", 0) == 0) {
+            options.folding.reset(new CharFolding());
+            string error;
+            if (!options.folding->load(arg.substr(12), error)) {
+                cerr << "Error loading normalization rules: " << error << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--threshold=", 0) == 0) {
+            options.threshold = atoll(arg.substr(12).c_str());
+        } else if (arg.rfind("--metrics-json=", 0) == 0) {
+            metrics_path = arg.substr(15);
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            trace_path = arg.substr(8);
+        } else if (arg == "--perf-counters") {
+            perf_counters = true;
+        } else if (arg.rfind("--build-threads=", 0) == 0) {
+            options.build_threads = atoi(arg.substr(16).c_str());
+        } else if (arg.rfind("--checkpoint-interval=", 0) == 0) {
+            options.checkpoint_interval = atof(arg.substr(22).c_str());
+        } else if (arg == "--resume") {
+            options.resume = true;
+        } else if (arg.rfind("--cache=", 0) == 0) {
+            options.cache_path = arg.substr(8);
+        } else if (arg.rfind("--readahead=", 0) == 0) {
+            options.readahead = atoi(arg.substr(12).c_str());
+        } else if (arg.rfind("--columns=", 0) == 0) {
+            string error;
+            if (!parse_stat_columns(arg.substr(10), options.columns, error)) {
+                cerr << "Error in --columns: " << error << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (!metrics_path.empty() || !trace_path.empty() || perf_counters) {
+        options.telemetry.reset(new RunTelemetry(metrics_path, trace_path, perf_counters));
+    }
+
+    // 归一化合在码点字母表中，只有 codepoint 引擎支持
+    if (options.folding && options.engine != SearchEngine::Codepoint) {
+        if (options.engine == SearchEngine::Classic) {
+            cerr << "Error: --normalize is not supported by the classic engine, use --engine=codepoint" << endl;
+            return 1;
+        }
+        cout << "--normalize requires the codepoint engine, using --engine=codepoint" << endl;
+        options.engine = SearchEngine::Codepoint;
+    }
+
+    // compile 模式：WikiFilter compile <dict file path> <index file path>
+    if (!positional.empty() && positional[0] == "compile") {
+        if (positional.size() < 3) {
+            cout << "用法: " << argv[0] << " compile <dict file path> <index file path>" << endl;
+            return 1;
+        }
+        return compile_index(positional[1], positional[2], options);
+    }
+
+    // merge 模式：WikiFilter merge <output prefix> <partial or csv file>...
+    if (!positional.empty() && positional[0] == "merge") {
+        if (positional.size() < 3) {
+            cout << "用法: " << argv[0] << " merge <output prefix> <partial or csv file>... [--dict=FILE] [--threshold=N]" << endl;
+            return 1;
+        }
+        vector<string> input_paths;
+        if (!expand_input_paths(positional, 2, positional.size(), input_paths)) {
+            return 1;
+        }
+        return merge_results(positional[1], input_paths, options);
+    }
+
+    if (positional.size() < 2) {
+        cout << "用法: " << argv[0] << " <dict file path> <text file path>... [thread number] [options]" << endl;
+        cout << "      " << argv[0] << " compile <dict file path> <index file path>" << endl;
+        cout << "      " << argv[0] << " merge <output prefix> <partial or csv file>... [--dict=FILE] [--threshold=N]" << endl;
+        cout << "      " << argv[0] << " bench [--size-mb=N] [--words=N] [--baseline=FILE] [--save-baseline=FILE] ..." << endl;
+        cout << endl;
+        cout << "选项:" << endl;
+        cout << "  --engine=codepoint|classic" << endl;
+        cout << "                          扫描引擎：codepoint 按 UTF-8 码点建树（默认），classic 为原始二分查找自动机" << endl;
+        cout << "  --split=dict|corpus     多线程划分方式：dict 按词典分批、每线程扫描全文（默认）；" << endl;
+        cout << "                          corpus 共享一个自动机，线程按行对齐的切片划分全文" << endl;
+        cout << "  --schedule=auto|batch|chunk" << endl;
+        cout << "                          词典分成多个批次时的扫描顺序：batch 每个批次各扫描一遍语料；chunk 先构建" << endl;
+        cout << "                          所有批次的自动机（放不下的写入临时文件再映射），语料只读一遍；" << endl;
+        cout << "                          auto（默认）按内存预算和预计读盘量选择" << endl;
+        cout << "  --index=FILE            使用 compile 生成的预编译索引（词典变化后会被拒绝）" << endl;
+        cout << "  --output=FILE           输出文件，默认单个输入为 <text file>.filted.csv，" << endl;
+        cout << "                          多个输入为第一个输入所在目录下的 merged.filted.csv" << endl;
+        cout << "  --columns=COL[,COL]     输出的统计列及顺序，默认 df；COL 为 df（出现的文章数）、total（出现总次数）、" << endl;
+        cout << "                          max（单篇文章中最多出现次数）、first（第一次出现的文章行号，从 1 开始）；" << endl;
+        cout << "                          所有列在同一遍扫描中统计，词条按 df > 0 输出" << endl;
+        cout << "  --per-shard             在统计列之后按输入文件顺序，为每个输入各输出一列文章数" << endl;
+        cout << "  --partial=FILE          另外写出按词条编号存储的二进制部分结果（文章数），供 merge 合并" << endl;
+        cout << "  --checkpoint-interval=S 每 S 秒把扫描进度写入 <output>.ckpt（默认 300，0 为不写），正常结束后删除" << endl;
+        cout << "  --resume                从 <output>.ckpt 继续：跳过已完成的批次，未完成的批次从记录的行继续；" << endl;
+        cout << "                          需要相同的词典、输入文件、线程数和选项" << endl;
+        cout << "  --cache=FILE            结果缓存：语料不变时，缓存中已有的词条直接取结果，只扫描新词条，" << endl;
+        cout << "                          结束后把新词条加入缓存；语料、--normalize 或 --columns 变化时缓存作废" << endl;
+        cout << "  --normalize=ITEM[,ITEM] 词典和正文按归一化后的形式匹配（使用 codepoint 引擎），ITEM 为：" << endl;
+        cout << "                          OpenCC 文本格式的单字映射表（如 TSCharacters.txt）、width（全角->半角）、" << endl;
+        cout << "                          case（ASCII 大小写）；compile 和 merge 需要使用相同的规则" << endl;
+        cout << "  --readahead=N           输入放不进内存时每个扫描线程驻留的分块数（默认 2，即双缓冲）：由 I/O 线程" << endl;
+        cout << "                          提前读入后面的分块，受内存规划限制；1 为不预读" << endl;
+        cout << "  --build-threads=N       构建自动机的线程数，默认与扫描同一自动机的线程数相同（compile 为全部核心），" << endl;
+        cout << "                          1 为串行构建；结果与串行构建相同" << endl;
+        cout << "  --metrics-json=FILE     写出 JSON 格式的运行指标：各阶段耗时，每个批次的自动机规模、构建/扫描时间、" << endl;
+        cout << "                          扫描字节数和行数、吞吐量、匹配数、内存峰值" << endl;
+        cout << "  --trace=FILE            写出 Chrome trace 格式的线程时间线（chrome://tracing 或 Perfetto 打开）" << endl;
+        cout << "  --perf-counters         用 perf_event_open 统计扫描期间的 cycles、instructions、LLC 和 dTLB 缺失，" << endl;
+        cout << "                          写入指标文件并在批次日志中输出 IPC" << endl;
+        cout << endl;
+        cout << "merge 选项:" << endl;
+        cout << "  --dict=FILE             扫描时使用的词典（输入含二进制部分结果时必需），可配合 --index=FILE" << endl;
+        cout << "  --threshold=N           词频大于 N 的词条写入 <output prefix>.txt，默认 0" << endl;
+        cout << endl;
+        cout << "bench 选项（按固定种子生成语料和词典，测量各环节吞吐量，并用 string::find 核对计数）:" << endl;
+        cout << "  --size-mb=N             语料大小，默认 64" << endl;
+        cout << "  --words=N               词典词条数，默认 200000" << endl;
+        cout << "  --cjk=R                 CJK 词条比例，其余为 ASCII 词条，默认 0.9" << endl;
+        cout << "  --zipf=S                语料中词频的 Zipf 指数，默认 1.0" << endl;
+        cout << "  --seed=N                随机种子，默认 1" << endl;
+        cout << "  --repeat=N              每项重复次数，取最快的一次，默认 3" << endl;
+        cout << "  --dir=DIR               生成文件的目录，默认 wikifilter-bench" << endl;
+        cout << "  --baseline=FILE         与基线对比，吞吐量下降超过 --tolerance（默认 5%）时标记 REGRESSION" << endl;
+        cout << "  --save-baseline=FILE    把本次结果保存为基线" << endl;
+        cout << "  --oracle-words=N        用 string::find 核对的词条数，默认 500，在语料前 --oracle-mb=N（默认 4）MB 上核对" << endl;
+        cout << endl;
+        cout << "可以给出多个文本文件或通配符（如 'text/AA/wiki_*.txt'），所有文件共用一个自动机扫描，" << endl;
+        cout << "结果合并输出到一个文件；支持 zstd/gzip/xz 压缩文件和标准输入（-），此时全文只扫描一遍" << endl;
         cout << endl;
         cout << "优化版本：使用 Aho-Corasick 自动机进行多模式匹配" << endl;
         cout << "支持大规模词典（百万级）和大型文本文件（GB级）" << endl;
         return 1;
     }
 
-    string dict_path = argv[1];
-    string text_path = argv[2];
+    string dict_path = positional[0];
     int num_threads = 1;
 
-    if (argc > 3) {
-        num_threads = atoi(argv[3]);
+    // 最后一个参数是纯数字且不是已存在的文件时，作为线程数（兼容原来的 <dict> <text> [thread number]）
+    size_t text_end = positional.size();
+    if (positional.size() > 2) {
+        const string& last = positional.back();
+        struct stat st;
+        if (last.find_first_not_of("0123456789") == string::npos && stat(last.c_str(), &st) != 0) {
+            num_threads = atoi(last.c_str());
+            text_end--;
+        }
+    }
+
+    vector<string> text_paths;
+    if (!expand_input_paths(positional, 1, text_end, text_paths)) {
+        return 1;
     }
 
     if (num_threads <= 0) {
@@ -944,5 +7792,5 @@ int main(int argc, char* argv[]) {
         cout << "threads = " << num_threads << endl;
     }
 
-    return process_files(text_path, dict_path, num_threads);
+    return process_files(text_paths, dict_path, num_threads, options);
 }
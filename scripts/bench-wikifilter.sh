@@ -0,0 +1,22 @@
+#!/bin/bash
+# 构建 WikiFilter 并运行基准测试（语料和词典按固定种子在本地生成，不需要维基数据）
+# 用法: ./scripts/bench-wikifilter.sh [基线文件] [bench 选项...]
+# 基线文件不存在时把本次结果保存为基线，存在时与之对比；计数核对失败时返回非 0
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+BASELINE="${1:-$PROJECT_ROOT/wikifilter-bench/baseline.txt}"
+shift || true
+
+"$SCRIPT_DIR/build-wikifilter.sh"
+
+mkdir -p "$(dirname "$BASELINE")"
+if [ -f "$BASELINE" ]; then
+    echo "=== 与基线对比: $BASELINE ==="
+    "$PROJECT_ROOT/WikiFilter/WikiFilter" bench --dir="$PROJECT_ROOT/wikifilter-bench" --baseline="$BASELINE" "$@"
+else
+    echo "=== 保存基线: $BASELINE ==="
+    "$PROJECT_ROOT/WikiFilter/WikiFilter" bench --dir="$PROJECT_ROOT/wikifilter-bench" --save-baseline="$BASELINE" "$@"
+fi
@@ -46,6 +46,7 @@ DICT_NAME="${1:-dict.txt}"
 INPUT_DIR="${2:-text/AA}"
 OUTPUT_DIR="${3:-text/AA}"
 SPLIT_COUNT="${4:-1}"  # 分片数量，默认1
+THREADS="${5:-1}"      # WikiFilter 线程数，默认1，0 为自动检测
 
 SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
 PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
@@ -65,6 +66,7 @@ echo "词库文件: $DICT_NAME"
 echo "输入目录: $INPUT_DIR"
 echo "输出目录: $OUTPUT_DIR"
 echo "分片数量: $SPLIT_COUNT"
+echo "线程数量: $THREADS"
 
 cd "$PROJECT_ROOT"
 
@@ -88,7 +90,8 @@ if [ -f "$INPUT_DIR/zhwiki.txt" ]; then
     $PYTHON scripts/split_file.py "$INPUT_DIR/zhwiki.txt" "$INPUT_DIR/" "$SPLIT_COUNT"
 fi
 
-# 处理每个分片
+# 收集所有分片
+INPUT_FILES=()
 for i in $(seq -f "%02g" 0 $((SPLIT_COUNT - 1))); do
     INPUT_FILE="$INPUT_DIR/wiki_${i}.txt"
     
@@ -96,15 +99,14 @@ for i in $(seq -f "%02g" 0 $((SPLIT_COUNT - 1))); do
         echo "跳过不存在的文件: $INPUT_FILE"
         continue
     fi
-    
-    echo "处理: $INPUT_FILE"
-    ./WikiFilter/WikiFilter "$DICT_NAME" "$INPUT_FILE" 1
-    
-    # 移动输出文件（仅当输入输出目录不同时）
-    if [ "$INPUT_DIR" != "$OUTPUT_DIR" ] && [ -f "${INPUT_FILE}.filted.csv" ]; then
-        mv "${INPUT_FILE}.filted.csv" "$OUTPUT_DIR/"
-    fi
+    INPUT_FILES+=("$INPUT_FILE")
 done
 
+# 所有分片在一次运行中处理：词典只加载、自动机只构建一次，结果直接合并为一个文件
+if [ ${#INPUT_FILES[@]} -gt 0 ]; then
+    echo "处理: ${INPUT_FILES[*]}"
+    ./WikiFilter/WikiFilter "$DICT_NAME" "${INPUT_FILES[@]}" "$THREADS" --output="$OUTPUT_DIR/merged.filted.csv"
+fi
+
 echo "=== 过滤完成 ==="
 ls -lh "$OUTPUT_DIR"/*.csv 2>/dev/null || echo "没有生成 CSV 文件"
@@ -28,6 +28,14 @@ echo "OpenCC 配置: $OPENCC_CONFIG"
 
 cd "$PROJECT_ROOT"
 
+# 与 merge_csv.py 相同：递归查找 $1 下文件名以 $2 结尾的文件，结果放在 INPUTS 中
+find_inputs() {
+    INPUTS=()
+    while IFS= read -r -d '' file; do
+        INPUTS+=("$file")
+    done < <(find "$1" -type f -name "*$2" -print0 | sort -z)
+}
+
 # 移动 opencc 配置文件
 if ls "$INPUT_DIR"/*.opencc.txt 1>/dev/null 2>&1; then
     mv "$INPUT_DIR"/*.opencc.txt scripts/ 2>/dev/null || true
@@ -38,7 +46,16 @@ rm -f "$INPUT_DIR"/*.raw.txt 2>/dev/null || true
 
 # 第一次合并
 echo "第一次合并 (filted.csv)..."
-$PYTHON scripts/merge_csv.py "$INPUT_DIR" merge "$OUTPUT_FILTER" filted.csv
+if [ -x "WikiFilter/WikiFilter" ]; then
+    find_inputs "$INPUT_DIR" "filted.csv"
+    if [ ${#INPUTS[@]} -eq 0 ]; then
+        echo "没有找到 *filted.csv，跳过合并"
+    else
+        ./WikiFilter/WikiFilter merge "$INPUT_DIR/merge" "${INPUTS[@]}" --threshold="$OUTPUT_FILTER"
+    fi
+else
+    $PYTHON scripts/merge_csv.py "$INPUT_DIR" merge "$OUTPUT_FILTER" filted.csv
+fi
 
 # 删除中间文件
 rm -f "$INPUT_DIR"/*.txt.filted.csv 2>/dev/null || true
@@ -50,7 +67,16 @@ if [ -f "$INPUT_DIR/merge.csv" ] && [ -f "$OPENCC_CONFIG" ]; then
     
     # 第二次合并
     echo "第二次合并 (chs.csv)..."
-    $PYTHON scripts/merge_csv.py "$INPUT_DIR" filted.chs 8 merge.chs.csv
+    if [ -x "WikiFilter/WikiFilter" ]; then
+        find_inputs "$INPUT_DIR" "merge.chs.csv"
+        if [ ${#INPUTS[@]} -eq 0 ]; then
+            echo "没有找到 *merge.chs.csv，跳过合并"
+        else
+            ./WikiFilter/WikiFilter merge "$INPUT_DIR/filted.chs" "${INPUTS[@]}" --threshold=8
+        fi
+    else
+        $PYTHON scripts/merge_csv.py "$INPUT_DIR" filted.chs 8 merge.chs.csv
+    fi
 fi
 
 echo "=== 合并完成 ==="